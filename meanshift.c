@@ -3,15 +3,60 @@
 ///
 
 // Compilation:
-//     - macOS: clang meanshift.c -framework OpenCL
-//     - Linux: gcc meanshift.c -lopencl -Lpath/to/opencl
+//     - macOS: clang meanshift.c meanshift_engine.c meanshift_reference.c meanshift_io.c -framework OpenCL
+//     - Linux: gcc meanshift.c meanshift_engine.c meanshift_reference.c meanshift_io.c -lopencl
+//       -Lpath/to/opencl -lm -lpthread
+//     - Add -DMS_STATS to count pairs, active points and shift lengths on the device at every iteration
+//
+// Usage:
+//     ./a.out [-s] [-m] [-n] [-k naive|tiled|symmetric|adaptive] [-g dataset] [-f points.npy|csv] [-d dims] [-C]
+//             [-i iterations] [-p] [-t trace.json] [-S] [-o results.msr] [-e seeds | -b count | -B]
+//             [-a plain|relaxed|anderson] [-M] [-Q] [-K rank] [-w bandwidth(s) | -V matrix |
+//             -E scott|silverman|quantile] [-W bandwidths [-H]]
+//
+//     -s  share one SVM allocation between host and device (OpenCL 2.0)
+//     -m  partition the points across every device of the first platform
+//     -n  partition the points across the NUMA nodes of the CPU device
+//     -k  kernel variant to execute
+//     -g  generate a synthetic data set on the device: diagonal, blobs, uniform, anisotropic or image
+//     -f  map the points from a .npy file, or from a raw float32 file of points of dimension -d (2 by default), or
+//         parse them from a .csv or .txt file
+//     -C  check the results against the double precision reference on the host, which is quadratic in the number of
+//         points and linear in the iterations
+//     -i  number of mean shift iterations, 1 by default
+//     -p  print the queued, submit, start and end time of every stage of the run
+//     -t  write the stages of the run as a Chrome trace, one track per command queue and one for the host
+//     -S  read frames of points from stdin and write each one to stdout once shifted, see meanshift_io.h
+//     -o  read the shifted points back into a mapped result file, followed by the labels, distances and modes
+//     -e  shift this many evenly spaced points as seeds against the whole data set, instead of every point
+//     -b  shift the centers of the cells of a grid of bandwidth sized cells holding at least this many points
+//     -B  blurring mean shift, every iteration shifts the points against their own previous positions; the symmetric
+//         variant requires it
+//     -a  iterate until every seed moves less than a thousandth of the bandwidth, at most -i times (300 by default),
+//         with this update rule; accelerated rules are compared with a plain run to convergence
+//     -M  with -a, stop the trajectories which come within a tenth of the bandwidth of a converged one, on the first
+//         device; compared with a plain run to convergence as well
+//     -Q  quick shift instead of mean shift: every point is linked to its nearest neighbour of higher density within
+//         twice the bandwidth, and the points end on the root of their tree
+//     -K  with the adaptive variant, bandwidth of every point from its distance to this nearest neighbour (16 by
+//         default), at least a tenth of the bandwidth
+//     -w  bandwidth of the gaussian kernel; without it the bandwidth is estimated from up to 1000 points spread over
+//         the data set, or every frame of the stream, except with -s which keeps a bandwidth of 3; with one comma
+//         separated bandwidth per dimension the points are whitened on the device by these bandwidths
+//     -V  bandwidth matrix of the gaussian kernel, the dims * dims comma separated values of a symmetric positive
+//         definite matrix in row major order; the points are whitened on the device by its Cholesky factor
+//     -E  estimator of the bandwidth: Scott's or Silverman's rule of thumb, or the mean distance to the nearest 30%
+//         of the samples (quantile, the default)
+//     -W  shift the seeds at each of these comma separated bandwidths in a single pass, up to 16 of them, and count
+//         the clusters found at every bandwidth
+//     -H  with -W in increasing order, link the modes of every bandwidth to those of the next one into a scale-space
+//         tree, by shifting them with the coarser kernel, and print the tree
 //
 
-#if defined(__APPLE__) || defined(__MACOSX)
-#include <OpenCL/opencl.h>
-#else
-#include <CL/opencl.h>
-#endif
+#include "meanshift_engine.h"
+#include "meanshift_io.h"
+#include "meanshift_reference.h"
+
 #include <fcntl.h>
 #include <math.h>
 #include <stdio.h>
@@ -26,263 +71,1196 @@
 // Use a static data size for simplicity
 //
 #define DATA_SIZE (512)
+#define DIMS (2)
 #define BANDWIDTH (3.0F)
+#define SEED (42)
+#define CLUSTERS (8)
+#define CONVERGENCE (1e-3F)  // distance below which a seed has converged, relative to the bandwidth
+#define MAX_ITERATIONS (300)
+#define MEMO_RADIUS (0.1F)   // memoization radius, relative to the bandwidth
+#define QUICK_DISTANCE (2.0F)  // longest link of the quick shift, relative to the bandwidth
+#define KNN_RANK (16)          // neighbour giving the bandwidth of a point with the adaptive variant
+#define MIN_BANDWIDTH (0.1F)   // smallest adaptive bandwidth, relative to the bandwidth
+#define QUANTILE (0.3F)        // neighbours of a sample with the quantile estimator, relative to the samples
+#define ESTIMATE_SAMPLES (1000)  // most samples of the bandwidth estimators
 
 ////////////////////////////////////////////////////////////////////////////////
 
-// Mean Shift Point kernel which computes the mean shift of points
+// Print every stage of the profile relative to the first one, followed by the total time spent in each kind of stage
 //
-const char *KernelSource =
-    "\n"
-    "__kernel void algorithm(                                                       \n"
-    "   __constant const float2* input_1,     // points                             \n"
-    "   __constant const float2* input_2,     // original_points                    \n"
-    "   const size_t count,                                                         \n"
-    "   const float bandwidth,                                                      \n"
-    "   __global float2* output)              // shifted_points                     \n"
-    "{                                                                              \n"
-    "    float pi = 3.14F;                                                          \n"
-    "    float base_weight = 1.0F / (bandwidth * sqrt(2.0F * pi));                  \n"
-    "    float2 shift = {0.0F, 0.0F};                                               \n"
-    "    float scale = 0.0F;                                                        \n"
-    "                                                                               \n"
-    "    size_t i = get_global_id(0);                                               \n"
-    "                                                                               \n"
-    "    for (size_t j = 0; j < count; j++)                                         \n"
-    "    {                                                                          \n"
-    "        float dist = distance(input_1[i], input_2[j]);                         \n"
-    "        float weight = base_weight * exp(-0.5F * pow(dist / bandwidth, 2.0F)); \n"
-    "                                                                               \n"
-    "        shift += input_2[j] * weight;                                          \n"
-    "        scale += weight;                                                       \n"
-    "    }                                                                          \n"
-    "                                                                               \n"
-    "    output[i] = shift / scale;                                                 \n"
-    "}                                                                              \n"
-    "\n";
-////////////////////////////////////////////////////////////////////////////////
+static void print_profile(const ms_profile *profile)
+{
+    int i, j;
+    cl_ulong origin = profile->num_stages ? profile->stages[0].queued : 0;
 
-int main(int argc, char **argv)
+    for (i = 0; i < profile->num_stages; i++)
+    {
+        origin = profile->stages[i].queued < origin ? profile->stages[i].queued : origin;
+    }
+
+    printf("%-10s %6s %9s %12s %12s %12s %12s %10s %10s\n", "stage", "device", "iteration", "queued[ms]",
+           "submit[ms]", "start[ms]", "end[ms]", "wait[ms]", "run[ms]");
+    for (i = 0; i < profile->num_stages; i++)
+    {
+        const ms_stage *stage = &profile->stages[i];
+        char device[16] = "host";
+        char iteration[16] = "-";
+
+        if (stage->device >= 0) snprintf(device, sizeof(device), "%d", stage->device);
+        if (stage->iteration >= 0) snprintf(iteration, sizeof(iteration), "%d", stage->iteration);
+        printf("%-10s %6s %9s %12.3f %12.3f %12.3f %12.3f %10.3f %10.3f\n", stage->name, device, iteration,
+               (stage->queued - origin) / 1e6, (stage->submit - origin) / 1e6, (stage->start - origin) / 1e6,
+               (stage->end - origin) / 1e6, (stage->start - stage->queued) / 1e6, (stage->end - stage->start) / 1e6);
+    }
+
+    printf("\n%-10s %6s %10s\n", "stage", "count", "total[ms]");
+    for (i = 0; i < profile->num_stages; i++)
+    {
+        int count = 0;
+        double total = 0.0;
+
+        for (j = 0; j < i && strcmp(profile->stages[j].name, profile->stages[i].name) != 0; j++)
+        {
+        }
+        if (j < i)
+        {
+            continue;  // already summed up with the first stage of the same name
+        }
+        for (j = i; j < profile->num_stages; j++)
+        {
+            if (strcmp(profile->stages[j].name, profile->stages[i].name) == 0)
+            {
+                total += (profile->stages[j].end - profile->stages[j].start) / 1e6;
+                count++;
+            }
+        }
+        printf("%-10s %6d %10.3f\n", profile->stages[i].name, count, total);
+    }
+}
+
+// Shift the frames read from stdin one at a time and write each one to stdout as soon as it is done, so that the
+// program can sit in a pipeline and start computing before the producer is finished. The engine is built for the
+// dimension of the first frame, and the bandwidth is estimated for every frame unless one is given. Standard output
+// is moved to another descriptor and replaced by standard error, so that every message printed along the way stays
+// out of the stream.
+//
+static int run_stream(ms_device_mode mode, ms_variant variant, cl_float bandwidth, ms_estimator estimator,
+                      int iterations, int blurring, int validate, ms_profile *stages, int print_stages,
+                      const char *trace_path)
 {
-    int err;  // error code returned from api calls
+    ms_engine engine;
+    ms_timing timing;
+    ms_check check;
+    ms_frame_header header;
+    float *points = NULL;
+    float *shifted = NULL;
+    size_t capacity = 0;
+    size_t shifted_capacity = 0;
+    size_t frames = 0;
+    int status;
+    int passed = 1;
+    int created = 0;
+    int fd;
+    FILE *out;
 
-    cl_float2 data[DATA_SIZE];     // original data set given to device
-    cl_float2 results[DATA_SIZE];  // results returned from device
+    fflush(stdout);
+    fd = dup(STDOUT_FILENO);
+    out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!out || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+    {
+        fprintf(stderr, "Error: Failed to redirect standard output!\n");
+        return EXIT_FAILURE;
+    }
 
-    unsigned int correct;  // number of correct results returned
+    while ((status = ms_stream_read(stdin, &header, &points, &capacity)) > 0)
+    {
+        int err;
+        cl_float frame_bandwidth = bandwidth;
 
-    size_t global;  // global domain size for our calculation
-    size_t local;   // local domain size for our calculation
+        if (!created)
+        {
+            if (ms_engine_create(&engine, mode, variant, header.dims, stages) != CL_SUCCESS)
+            {
+                status = -1;
+                break;
+            }
+            engine.iterations = iterations;
+            engine.blurring = blurring;
+            created = 1;
+        }
+        if (header.dims != engine.dims)
+        {
+            printf("Error: Frame of dimension %u in a stream of dimension %zu!\n", header.dims, engine.dims);
+            status = -1;
+            break;
+        }
+        if (capacity > shifted_capacity)
+        {
+            free(shifted);
+            shifted_capacity = capacity;
+            shifted = malloc(shifted_capacity);
+            if (!shifted)
+            {
+                printf("Error: Failed to allocate host memory!\n");
+                status = -1;
+                break;
+            }
+        }
 
-    cl_device_id device_id;     // compute device id
-    cl_context context;         // compute context
-    cl_command_queue commands;  // compute command queue
-    cl_program program;         // compute program
-    cl_kernel kernel;           // compute kernel
-    cl_event event;             // compute profile event
+        err = ms_engine_attach(&engine, points, header.count);
+        if (err == CL_SUCCESS && bandwidth <= 0.0F)
+        {
+            err = ms_engine_estimate_bandwidth(&engine, estimator, QUANTILE, ESTIMATE_SAMPLES, &frame_bandwidth);
+        }
+        if (err == CL_SUCCESS)
+        {
+            err = ms_engine_shift(&engine, frame_bandwidth, shifted, &timing);
+        }
+        if (err != CL_SUCCESS || ms_stream_write(out, shifted, header.count, header.dims) != 0)
+        {
+            status = -1;
+            break;
+        }
 
-    cl_ulong time_start;  // compute command queue execution time start
-    cl_ulong time_end;    // compute command queue execution time end
-    double elapsed_time;  // time taken for compute
+        memset(&check, 0, sizeof(check));
+        check.passed = 1;
+        if (validate &&
+            ms_check_shift(points, header.count, points, header.count, shifted, header.dims, frame_bandwidth, NULL,
+                           iterations, blurring, &check) != 0)
+        {
+            printf("Error: Failed to allocate host memory!\n");
+            status = -1;
+            break;
+        }
+        passed &= check.passed;
+        ms_engine_detach(&engine);  // the next frame may reallocate the points
+        printf("Frame %zu shifted '%llu' points with a bandwidth of %g in [%0.3fms]%s\n", frames++,
+               (unsigned long long)header.count, frame_bandwidth, timing.kernel_time,
+               !validate ? "" : check.passed ? ", check passed" : ", check FAILED");
+    }
 
-    cl_mem input_1, input_2;         // device memory used for the input array
-    cl_mem output;                   // device memory used for the output array
-    cl_float bandwidth = BANDWIDTH;  // device bandwidth
+    if (created && print_stages)
+    {
+        print_profile(stages);
+    }
+    if (created && trace_path)
+    {
+        ms_profile_write_trace(stages, &engine, trace_path);
+    }
+    if (created)
+    {
+        ms_engine_release(&engine);
+    }
+    free(points);
+    free(shifted);
+    fclose(out);
+    return status == 0 && passed ? 0 : EXIT_FAILURE;
+}
 
-    // Fill our data set with random float values
-    //
-    int i = 0;
-    size_t count = DATA_SIZE;
-    for (i = 0; i < count; i++)
+// Place `num_seeds` evenly spaced points of the data set on the engine as seeds
+//
+static int seed_engine(ms_engine *e, const cl_float *points, size_t count, cl_float *seeds, size_t num_seeds)
+{
+    size_t i;
+
+    for (i = 0; i < num_seeds; i++)
     {
-        data[i].s[0] = (cl_float)(i);
-        data[i].s[1] = (cl_float)(i);
+        memcpy(&seeds[i * e->dims], &points[(i * count / num_seeds) * e->dims], sizeof(cl_float) * e->dims);
+    }
+    return ms_engine_seed(e, seeds, num_seeds);
+}
 
-        results[i].s[0] = 0.0F;
-        results[i].s[1] = 0.0F;
+// Quick shift the points of the engine, each point then ends on the root of its tree in `shifted`
+//
+static int quick_shift(ms_engine *e, const cl_float *points, cl_float bandwidth, cl_float *shifted, cl_uint *parents,
+                       cl_float *densities, ms_timing *timing, size_t *num_roots)
+{
+    size_t i;
+    int err = ms_engine_quick_shift(e, bandwidth, QUICK_DISTANCE * bandwidth, parents, densities, timing);
+
+    *num_roots = 0;
+    for (i = 0; i < e->count && err == CL_SUCCESS; i++)
+    {
+        size_t root = i;
+        size_t steps;
+        for (steps = 0; steps < e->count && parents[root] != root; steps++)
+        {
+            root = parents[root];
+        }
+        *num_roots += parents[i] == i;
+        memcpy(&shifted[i * e->dims], &points[root * e->dims], sizeof(cl_float) * e->dims);
     }
+    return err;
+}
 
-    // printf("Inputs: {\n");
-    // for (i = 0; i < count; i++)
-    // {
-    //     printf("%f %f\n", data[i].s[0], data[i].s[1]);
-    // }
-    // printf("}\n");
+// Merge the shifted seeds into modes and label every point with its mode. Points which are their own seed take the
+// mode their trajectory reached; otherwise every point is assigned to its nearest mode on the device(s).
+//
+static int label_points(ms_engine *e, const cl_float *points, size_t count, const cl_float *shifted, size_t num_seeds,
+                        int seeded, float radius, cl_float *modes, cl_uint *labels, cl_float *distances,
+                        size_t *num_modes)
+{
+    size_t i, k;
 
-    // Connect to a compute device
-    //
-    int gpu = 1;
-    err = clGetDeviceIDs(NULL, gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU, 1, &device_id, NULL);
-    if (err != CL_SUCCESS)
+    *num_modes = ms_merge_modes(shifted, num_seeds, e->dims, radius, modes, seeded ? NULL : labels);
+    if (seeded)
     {
-        printf("Error: Failed to create a device group! %d\n", err);
-        return EXIT_FAILURE;
+        return ms_engine_assign(e, modes, *num_modes, labels, distances);
     }
 
-    // Create a compute context
-    //
-    context = clCreateContext(0, 1, &device_id, NULL, NULL, &err);
-    if (!context || err != CL_SUCCESS)
+    for (i = 0; i < count; i++)
     {
-        printf("Error: Failed to create a compute context! %d\n", err);
-        return EXIT_FAILURE;
+        double dist2 = 0.0;
+        for (k = 0; k < e->dims; k++)
+        {
+            double diff = points[i * e->dims + k] - modes[labels[i] * e->dims + k];
+            dist2 += diff * diff;
+        }
+        distances[i] = (cl_float)sqrt(dist2);
     }
+    return CL_SUCCESS;
+}
 
-    // Create a command commands
-    //
-    commands = clCreateCommandQueue(context, device_id, CL_QUEUE_PROFILING_ENABLE, &err);
-    if (!commands)
+// Parse a comma separated list of at most `max` values, positive ones with `positive`, returns their number or 0 when
+// one is invalid
+//
+static size_t parse_values(const char *list, cl_float *values, size_t max, int positive)
+{
+    size_t n = 0;
+    char *end;
+
+    while (n < max)
     {
-        printf("Error: Failed to create a command commands!\n");
-        return EXIT_FAILURE;
+        values[n] = strtof(list, &end);
+        if (end == list || (positive ? !(values[n] > 0.0F) : !isfinite(values[n])))
+        {
+            return 0;
+        }
+        n++;
+        if (*end != ',')
+        {
+            return *end ? 0 : n;
+        }
+        list = end + 1;
     }
+    return 0;
+}
 
-    // Create the compute program from the source buffer
-    //
-    program = clCreateProgramWithSource(context, 1, (const char **)&KernelSource, NULL, &err);
-    if (!program)
+// Number of values of a comma separated list
+//
+static size_t list_length(const char *list)
+{
+    size_t n = 1;
+
+    for (; *list; list++)
     {
-        printf("Error: Failed to create compute program!\n");
-        return EXIT_FAILURE;
+        n += *list == ',';
     }
+    return n;
+}
 
-    // Build the program executable
-    //
-    err = clBuildProgram(program, 1, &device_id, NULL, NULL, NULL);
-    if (err != CL_SUCCESS)
+// Take `count` whitened points back to their original coordinates in place, multiplying them by the lower triangular
+// `factor` of ms_engine_whiten(); the last coordinate goes first, as every coordinate only depends on the lower ones
+//
+static void unwhiten(const cl_float *factor, cl_float *points, size_t count, size_t dims)
+{
+    size_t i, r, c;
+
+    for (i = 0; i < count; i++)
     {
-        size_t len;
-        char buffer[2048];
+        cl_float *point = points + i * dims;
+        for (r = dims; r-- > 0;)
+        {
+            double sum = 0.0;
+            for (c = 0; c <= r; c++)
+            {
+                sum += (double)factor[r * dims + c] * point[c];
+            }
+            point[r] = (cl_float)sum;
+        }
+    }
+}
 
-        printf("Error: Failed to build program executable! %d\n", err);
-        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
-        printf("%s\n", buffer);
-        return EXIT_FAILURE;
+// Take the distances of `count` whitened points to their whitened modes back to the original coordinates, as the
+// length of the offset of every point to its mode multiplied by the lower triangular `factor` of ms_engine_whiten()
+//
+static void unwhiten_distances(const cl_float *factor, const cl_float *points, const cl_float *modes,
+                               const cl_uint *labels, cl_float *distances, size_t count, size_t dims)
+{
+    size_t i, r, c;
+
+    for (i = 0; i < count; i++)
+    {
+        const cl_float *point = points + i * dims;
+        const cl_float *mode = modes + labels[i] * dims;
+        double dist2 = 0.0;
+        for (r = 0; r < dims; r++)
+        {
+            double sum = 0.0;
+            for (c = 0; c <= r; c++)
+            {
+                sum += (double)factor[r * dims + c] * (point[c] - mode[c]);
+            }
+            dist2 += sum * sum;
+        }
+        distances[i] = (cl_float)sqrt(dist2);
     }
+}
+
+// Check the seeds shifted at every bandwidth of a sweep against the reference, summing the outcomes of the scales up
+// into `check`: the largest errors and tolerance, the mean of the mean errors and the totals of the correct seeds and
+// of the modes. Returns -1 when the host runs out of memory.
+//
+static int check_sweep(const cl_float *seeds, size_t num_seeds, const cl_float *points, size_t count,
+                       const cl_float *swept, size_t dims, const cl_float *scales, size_t num_scales, int iterations,
+                       ms_check *check)
+{
+    size_t b;
+    ms_check scale;
 
-    // Create the compute kernel in the program we wish to run
+    memset(check, 0, sizeof(*check));
+    check->passed = 1;
+    for (b = 0; b < num_scales; b++)
+    {
+        if (ms_check_shift(seeds, num_seeds, points, count, swept + b * num_seeds * dims, dims, scales[b], NULL,
+                           iterations, 0, &scale) != 0)
+        {
+            return -1;
+        }
+        check->max_error = scale.max_error > check->max_error ? scale.max_error : check->max_error;
+        check->mean_error += scale.mean_error / num_scales;
+        check->tolerance = scale.tolerance > check->tolerance ? scale.tolerance : check->tolerance;
+        check->correct += scale.correct;
+        check->num_modes += scale.num_modes;
+        check->reference_modes += scale.reference_modes;
+        check->mode_error = scale.mode_error > check->mode_error ? scale.mode_error : check->mode_error;
+        check->passed &= scale.passed;
+    }
+    return 0;
+}
+
+// Print mode `index` of scale `scale` of a scale-space tree, then the modes of the finer scales linked to it, indented
+// by scale. `first` gives the first mode of every scale.
+//
+static void print_scale_tree(const cl_float *modes, const size_t *num_modes, const size_t *first,
+                             const cl_uint *parents, const cl_float *scales, size_t dims, size_t scale, size_t index,
+                             int depth)
+{
+    size_t k, m;
+
+    printf("%*sBandwidth %g mode %zu (", 2 * depth, "", scales[scale], index);
+    for (k = 0; k < dims; k++)
+    {
+        printf("%s%g", k ? ", " : "", modes[(first[scale] + index) * dims + k]);
+    }
+    printf(")\n");
+    for (m = 0; scale > 0 && m < num_modes[scale - 1]; m++)
+    {
+        if (parents[first[scale - 1] + m] == index)
+        {
+            print_scale_tree(modes, num_modes, first, parents, scales, dims, scale - 1, m, depth + 1);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+    int err;  // error code returned from api calls
+
+    cl_float data[DATA_SIZE * DIMS];     // original data set given to device
+    cl_float results[DATA_SIZE * DIMS];  // results returned from device
+
+    unsigned int correct;  // number of correct results returned
+    ms_check check;        // comparison with the reference implementation
+
+    ms_engine engine;           // compute device(s), context and kernel
+    ms_timing timing;           // time taken for compute
+    static ms_profile profile;  // every stage of the run
+    ms_profile *stages = NULL;  // profile the engine records to, if any
+    int print_stages = 0;       // print the profile after the run
+    cl_ulong stage_start;
+
+    cl_float bandwidth = 0.0F;  // device bandwidth, estimated when not given
+
+    cl_float *points = data;                // host view of the data set (stack array or SVM allocation)
+    cl_float *shifted = results;            // host view of the results (stack array or SVM allocation)
+    int svm = 0;                            // share the data set with the device through SVM
+    ms_device_mode mode = MS_DEVICE_GPU;    // device(s) to run on
+    ms_variant variant = MS_VARIANT_NAIVE;  // kernel to run
+    int dataset = -1;                       // synthetic data set generated on the device, if any
+    int iterations = 0;                     // mean shift iterations, or most iterations until convergence
+    int update = -1;                        // update rule of a run until convergence, if any
+    int memoize = 0;                        // stop trajectories close to converged ones
+    int quick = 0;                          // quick shift instead of mean shift
+    cl_uint *parents = NULL;                // quick shift forest
+    cl_float *densities = NULL;             // quick shift density of every point
+    size_t num_roots = 0;                   // trees of the quick shift forest
+    unsigned int knn_rank = KNN_RANK;       // neighbour giving the bandwidth of every point, adaptive variant
+    cl_float *bandwidths = NULL;            // bandwidth of every point, adaptive variant
+    int estimator = -1;                     // bandwidth estimator, if chosen
+    int estimated = 0;                      // the bandwidth was estimated from the points
+    cl_float scales[MAX_SCALES];            // bandwidths of a sweep
+    size_t num_scales = 0;                  // bandwidths of the sweep, 0 without one
+    cl_float *swept = NULL;                 // seeds shifted at every bandwidth of the sweep
+    int hierarchy = 0;                      // link the modes of the sweep into a scale-space tree
+    cl_float *tree_modes = NULL;            // modes of every bandwidth of the sweep, one bandwidth after the other
+    size_t tree_count[MAX_SCALES];          // modes of every bandwidth
+    size_t tree_first[MAX_SCALES];          // first mode of every bandwidth
+    cl_uint *tree_parents = NULL;           // parent of every mode at the next bandwidth
+    ms_timing tree_timing;                  // time taken to link the modes
+    cl_float *matrix = NULL;                // per-dimension bandwidths or bandwidth matrix, if any
+    size_t num_matrix = 0;                  // values of the bandwidths or of the matrix
+    int diagonal = 0;                       // the values are per-dimension bandwidths
+    cl_float *factor = NULL;                // Cholesky factor of the bandwidth matrix, taking the points back
+    cl_float *whitened = NULL;              // points whitened by the bandwidth matrix
+    cl_float *plain = NULL;                 // seeds shifted by plain mean shift until convergence, when accelerated
+    int plain_iterations = 0;               // iterations of the plain run
+    ms_timing plain_timing;                 // time taken by the plain run
+    ms_check plain_check;                   // comparison of the plain run with the reference
+    const char *trace_path = NULL;          // Chrome trace written after the run, if any
+    const char *points_path = NULL;         // point file mapped as the data set, if any
+    int stream = 0;                         // shift frames from stdin to stdout
+    const char *result_path = NULL;         // result file the shifted points are read back into, if any
+    ms_result_file result;                  // mapping of the result file
+    size_t num_seeds = 0;                   // points shifted, a subsample of the data set when below its size
+    cl_float *seeds = NULL;                 // subsample of the points or bin centers shifted as seeds, if any
+    unsigned int min_bin_count = 0;         // seed from the bins of a grid holding at least this many points
+    int blurring = 0;                       // shift the points against their previous positions
+    ms_points_file file;                    // mapping of the point file
+    int validate = 0;                       // compare with the double precision reference
+
+    int i = 0;
+    int k = 0;
+    size_t count = DATA_SIZE;
+    size_t dims = DIMS;
+
+    // Parse command line options
     //
-    kernel = clCreateKernel(program, "algorithm", &err);
-    if (!kernel || err != CL_SUCCESS)
+    int opt;
+    while ((opt = getopt(argc, argv, "smnk:g:f:d:Ci:pt:So:e:b:Ba:MQK:w:V:E:W:H")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                svm = 1;
+                break;
+            case 'm':
+                mode = MS_DEVICE_ALL;
+                break;
+            case 'n':
+                mode = MS_DEVICE_NUMA;
+                break;
+            case 'k':
+                variant = ms_variant_from_name(optarg);
+                if ((int)variant < 0)
+                {
+                    printf("Error: Unknown kernel variant '%s'!\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'g':
+                dataset = ms_dataset_from_name(optarg);
+                if (dataset < 0)
+                {
+                    printf("Error: Unknown data set '%s'!\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'f':
+                points_path = optarg;
+                break;
+            case 'd':
+                dims = strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                validate = 1;
+                break;
+            case 'S':
+                stream = 1;
+                break;
+            case 'o':
+                result_path = optarg;
+                break;
+            case 'e':
+                num_seeds = strtoul(optarg, NULL, 10);
+                if (num_seeds < 1)
+                {
+                    printf("Error: Invalid number of seeds '%s'!\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'b':
+                min_bin_count = strtoul(optarg, NULL, 10);
+                if (min_bin_count < 1)
+                {
+                    printf("Error: Invalid bin count '%s'!\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'B':
+                blurring = 1;
+                break;
+            case 'M':
+                memoize = 1;
+                break;
+            case 'Q':
+                quick = 1;
+                break;
+            case 'K':
+                knn_rank = strtoul(optarg, NULL, 10);
+                if (knn_rank < 1 || knn_rank > MAX_KNN)
+                {
+                    printf("Error: Invalid neighbour rank '%s'!\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'w':
+            case 'V':
+                free(matrix);
+                num_matrix = list_length(optarg);
+                matrix = malloc(sizeof(cl_float) * num_matrix);
+                if (!matrix || parse_values(optarg, matrix, num_matrix, opt == 'w') != num_matrix)
+                {
+                    printf("Error: Invalid bandwidth%s '%s'!\n", opt == 'w' ? "" : " matrix", optarg);
+                    return EXIT_FAILURE;
+                }
+                diagonal = opt == 'w';
+                if (diagonal && num_matrix == 1)
+                {
+                    bandwidth = matrix[0];
+                    free(matrix);
+                    matrix = NULL;
+                    num_matrix = 0;
+                }
+                break;
+            case 'W':
+                num_scales = parse_values(optarg, scales, MAX_SCALES, 1);
+                if (num_scales == 0)
+                {
+                    printf("Error: Invalid list of bandwidths '%s'!\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'H':
+                hierarchy = 1;
+                break;
+            case 'E':
+                estimator = ms_estimator_from_name(optarg);
+                if (estimator < 0)
+                {
+                    printf("Error: Unknown bandwidth estimator '%s'!\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'a':
+                update = ms_update_from_name(optarg);
+                if (update < 0)
+                {
+                    printf("Error: Unknown update rule '%s'!\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                if (iterations < 1)
+                {
+                    printf("Error: Invalid number of iterations '%s'!\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                print_stages = 1;
+                stages = &profile;
+                break;
+            case 't':
+                trace_path = optarg;
+                stages = &profile;
+                break;
+            default:
+                printf("Usage: %s [-s] [-m] [-n] [-k naive|tiled|symmetric|adaptive] [-g dataset] [-f points.npy|csv] "
+                       "[-d dims] [-C] [-i iterations] [-p] [-t trace.json] [-S] [-o results.msr] "
+                       "[-e seeds | -b count | -B] [-a plain|relaxed|anderson] [-M] [-Q] [-K rank] "
+                       "[-w bandwidth(s) | -V matrix | -E scott|silverman|quantile] [-W bandwidths [-H]]\n",
+                       argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if ((bandwidth > 0.0F || matrix) && estimator >= 0)
+    {
+        printf("Error: Options -w, -V and -E are mutually exclusive!\n");
+        return EXIT_FAILURE;
+    }
+    if (svm && estimator >= 0)
+    {
+        printf("Error: Option -E is not supported with shared virtual memory!\n");
+        return EXIT_FAILURE;
+    }
+    if (matrix && (svm || stream || num_scales))
+    {
+        printf("Error: Bandwidth matrices are not supported with -s, -S and -W!\n");
+        return EXIT_FAILURE;
+    }
+    if (num_scales && (bandwidth > 0.0F || estimator >= 0 || svm || stream || result_path || min_bin_count ||
+                       blurring || update > MS_UPDATE_PLAIN || memoize || quick || variant == MS_VARIANT_ADAPTIVE))
     {
-        printf("Error: Failed to create compute kernel! %d\n", err);
+        printf("Error: Option -W is not supported with -w, -E, -s, -S, -o, -b, -B, -a other than plain, -M, -Q and the "
+               "adaptive variant!\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 1; i < num_scales && hierarchy; i++)
+    {
+        if (!(scales[i] > scales[i - 1]))
+        {
+            printf("Error: Option -H needs the bandwidths of -W in increasing order!\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (hierarchy && !num_scales)
+    {
+        printf("Error: Option -H requires -W!\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < num_scales; i++)
+    {
+        bandwidth = bandwidth > 0.0F && bandwidth < scales[i] ? bandwidth : scales[i];  // the finest of the sweep
+    }
+    bandwidth = svm && bandwidth <= 0.0F ? BANDWIDTH : bandwidth;
+    estimator = estimator >= 0 ? estimator : MS_ESTIMATOR_QUANTILE;
+    if (svm && mode != MS_DEVICE_GPU)
+    {
+        printf("Error: Options -s, -m and -n are mutually exclusive!\n");
+        return EXIT_FAILURE;
+    }
+    if (svm && (dataset >= 0 || points_path))
+    {
+        printf("Error: Synthetic data sets and point files are not supported with shared virtual memory!\n");
+        return EXIT_FAILURE;
+    }
+    if ((num_seeds && min_bin_count) || (blurring && (num_seeds || min_bin_count)))
+    {
+        printf("Error: Options -e, -b and -B are mutually exclusive!\n");
+        return EXIT_FAILURE;
+    }
+    if (update >= 0 && (svm || stream || blurring))
+    {
+        printf("Error: Option -a is not supported with -s, -S and -B!\n");
+        return EXIT_FAILURE;
+    }
+    if (quick && (svm || stream || num_seeds || min_bin_count || blurring || update >= 0))
+    {
+        printf("Error: Option -Q is not supported with -s, -S, -e, -b, -B and -a!\n");
+        return EXIT_FAILURE;
+    }
+    if (memoize && update < 0)
+    {
+        printf("Error: Option -M requires -a!\n");
+        return EXIT_FAILURE;
+    }
+    if (variant == MS_VARIANT_ADAPTIVE && (svm || stream || blurring || quick))
+    {
+        printf("Error: The adaptive variant is not supported with -s, -S, -B and -Q!\n");
+        return EXIT_FAILURE;
+    }
+    iterations = iterations ? iterations : update >= 0 ? MAX_ITERATIONS : 1;
+    if (variant == MS_VARIANT_SYMMETRIC && !blurring)
+    {
+        printf("Error: The symmetric variant requires option -B!\n");
+        return EXIT_FAILURE;
+    }
+    if (svm && (result_path || num_seeds || min_bin_count || blurring))
+    {
+        printf("Error: Result files, seeds and blurring are not supported with shared virtual memory!\n");
+        return EXIT_FAILURE;
+    }
+    if (stream && (svm || dataset >= 0 || points_path || dims != DIMS || result_path || num_seeds || min_bin_count))
+    {
+        printf("Error: Option -S reads the points from the stream only!\n");
+        return EXIT_FAILURE;
+    }
+    if (stream)
+    {
+        return run_stream(mode, variant, bandwidth, estimator, iterations, blurring, validate, stages, print_stages,
+                          trace_path);
+    }
+    if (!points_path && dims != DIMS)
+    {
+        printf("Error: Option -d only applies to raw point files!\n");
         return EXIT_FAILURE;
     }
 
-    // Create the input and output arrays in device memory for our calculation
+    // Map the point file, the results then live on the heap
     //
-    input_1 = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float2) * count, NULL, NULL);
-    input_2 = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float2) * count, NULL, NULL);
-    output = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_float2) * count, NULL, NULL);
-    if (!input_1 || !input_2 || !output)
+    if (points_path)
     {
-        printf("Error: Failed to allocate device memory!\n");
-        return EXIT_FAILURE;
+        stage_start = ms_profile_clock();
+        if (ms_points_open(&file, points_path, dims) != 0)
+        {
+            return EXIT_FAILURE;
+        }
+        ms_profile_host(stages, "map", stage_start);
+        points = (cl_float *)file.data;
+        count = file.count;
+        dims = file.dims;
+        shifted = result_path ? NULL : malloc(sizeof(cl_float) * dims * count);
+        if (!shifted && !result_path)
+        {
+            printf("Error: Failed to allocate host memory!\n");
+            return EXIT_FAILURE;
+        }
     }
 
-    // Write our data set into the input array in device memory
+    // Expand per-dimension bandwidths into a diagonal bandwidth matrix once the dimension is known
     //
-    err = clEnqueueWriteBuffer(commands, input_1, CL_TRUE, 0, sizeof(cl_float2) * count, data, 0, NULL, NULL);
-    if (err != CL_SUCCESS)
+    if (matrix && num_matrix != (diagonal ? dims : dims * dims))
     {
-        printf("Error: Failed to write to source array! %d\n", err);
+        printf("Error: Option %s needs '%zu' values!\n", diagonal ? "-w" : "-V",
+               diagonal ? dims : dims * dims);
         return EXIT_FAILURE;
     }
-    err = clEnqueueWriteBuffer(commands, input_2, CL_TRUE, 0, sizeof(cl_float2) * count, data, 0, NULL, NULL);
-    if (err != CL_SUCCESS)
+    if (matrix && diagonal)
+    {
+        cl_float *widths = matrix;
+        matrix = calloc(dims * dims, sizeof(cl_float));
+        for (k = 0; k < (int)dims && matrix; k++)
+        {
+            matrix[k * dims + k] = widths[k] * widths[k];
+        }
+        free(widths);
+    }
+    factor = num_matrix ? malloc(sizeof(cl_float) * dims * dims) : NULL;
+    whitened = num_matrix ? malloc(sizeof(cl_float) * dims * count) : NULL;
+    if (num_matrix && !(matrix && factor && whitened))
     {
-        printf("Error: Failed to write to source array! %d\n", err);
+        printf("Error: Failed to allocate host memory!\n");
         return EXIT_FAILURE;
     }
 
-    // Set the arguments to our compute kernel
+    // Pick the seeds once the size of the data set is known, the results then hold one shifted point per seed
     //
-    err = 0;
-    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &input_1);
-    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &input_2);
-    err |= clSetKernelArg(kernel, 2, sizeof(cl_uint), &count);
-    err |= clSetKernelArg(kernel, 3, sizeof(cl_float), &bandwidth);
-    err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &output);
-    if (err != CL_SUCCESS)
+    if (num_seeds > count)
     {
-        printf("Error: Failed to set kernel arguments! %d\n", err);
+        printf("Error: More seeds than the '%zu' points!\n", count);
         return EXIT_FAILURE;
     }
+    num_seeds = num_seeds ? num_seeds : count;
+    if (num_seeds < count || min_bin_count)
+    {
+        seeds = malloc(sizeof(cl_float) * dims * num_seeds);
+        if (!seeds)
+        {
+            printf("Error: Failed to allocate host memory!\n");
+            return EXIT_FAILURE;
+        }
+    }
 
-    // Get the maximum work group size for executing the kernel on the device
+    // Map the result file, the device then reads the shifted points back straight into its pages
     //
-    err = clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(local), &local, NULL);
-    if (err != CL_SUCCESS)
+    if (result_path)
     {
-        printf("Error: Failed to retrieve kernel work group info! %d\n", err);
-        return EXIT_FAILURE;
+        if (ms_result_create(&result, result_path, count, dims, bandwidth) != 0)
+        {
+            return EXIT_FAILURE;
+        }
+        shifted = result.points;
     }
 
-    // Execute the kernel over the entire range of our 1d input data set
-    // using the maximum number of work group items for this device
+    // Connect to the compute device(s) and build the kernel
     //
-    global = count;
-    err = clEnqueueNDRangeKernel(commands, kernel, 1, NULL, &global, &local, 0, NULL, &event);
+    err = ms_engine_create(&engine, mode, variant, dims, stages);
     if (err != CL_SUCCESS)
     {
-        printf("Error: Failed to execute kernel! %d\n", err);
         return EXIT_FAILURE;
     }
+    engine.iterations = iterations;
+    engine.blurring = blurring;
 
-    // Wait for the event commands to get serviced before reading back results
-    //
-    clWaitForEvents(1, &event);
+    if (svm)
+    {
+#ifdef CL_VERSION_2_0
+        // Allocate the data set and the results in shared virtual memory
+        //
+        points = ms_svm_alloc(&engine, sizeof(cl_float) * DIMS * count);
+        shifted = ms_svm_alloc(&engine, sizeof(cl_float) * DIMS * count);
+        if (!points || !shifted)
+        {
+            return EXIT_FAILURE;
+        }
+#else
+        printf("Error: Shared virtual memory requires OpenCL 2.0!\n");
+        return EXIT_FAILURE;
+#endif
+    }
 
-    // Wait for the command commands to get serviced before reading back results
+    // Fill our data set with random float values
     //
-    clFinish(commands);
+    stage_start = ms_profile_clock();
+    for (i = 0; i < count && !points_path; i++)
+    {
+        for (k = 0; k < DIMS; k++)
+        {
+            points[i * DIMS + k] = (cl_float)(i);
+            shifted[i * DIMS + k] = 0.0F;
+        }
+    }
+    ms_profile_host(stages, "fill", stage_start);
+
+    // printf("Inputs: {\n");
+    // for (i = 0; i < count; i++)
+    // {
+    //     printf("%f %f\n", points[i * DIMS], points[i * DIMS + 1]);
+    // }
+    // printf("}\n");
 
-    // Read back the results from the device to verify the output
+    // Write (or generate) the data set on the device(s), pick the seeds, execute the kernel and read back the results
     //
-    err = clEnqueueReadBuffer(commands, output, CL_TRUE, 0, sizeof(cl_float2) * count, results, 0, NULL, NULL);
+    if (dataset >= 0)
+    {
+        err = ms_engine_generate(&engine, dataset, count, SEED, CLUSTERS);
+        if (err == CL_SUCCESS && (seeds || quick))
+        {
+            err = ms_engine_download(&engine, points);
+        }
+    }
+    else if (points_path)
+    {
+        err = ms_engine_attach(&engine, points, count);
+    }
+    else if (!svm)
+    {
+        err = ms_engine_upload(&engine, points, count);
+    }
+    if (err == CL_SUCCESS && matrix)
+    {
+        // Everything runs on the whitened points from now on, with the bandwidth of the matrix being 1
+        //
+        err = ms_engine_whiten(&engine, matrix, factor);
+        err = err == CL_SUCCESS ? ms_engine_download(&engine, whitened) : err;
+        points = whitened;
+        bandwidth = 1.0F;
+        if (result_path)
+        {
+            ms_result_set_bandwidth(&result, bandwidth, matrix);
+        }
+    }
+    if (!svm && err == CL_SUCCESS && bandwidth <= 0.0F)
+    {
+        err = ms_engine_estimate_bandwidth(&engine, estimator, QUANTILE, ESTIMATE_SAMPLES, &bandwidth);
+        estimated = 1;
+        if (result_path)
+        {
+            ms_result_set_bandwidth(&result, bandwidth, NULL);
+        }
+    }
+    if (update >= 0)
+    {
+        engine.convergence = CONVERGENCE * bandwidth;
+    }
+    if (!svm && err == CL_SUCCESS && seeds)
+    {
+        err = min_bin_count ? ms_engine_bin_seed(&engine, bandwidth, min_bin_count, seeds)
+                            : seed_engine(&engine, points, count, seeds, num_seeds);
+        num_seeds = engine.num_seeds;
+    }
+    if (!svm && err == CL_SUCCESS && variant == MS_VARIANT_ADAPTIVE)
+    {
+        bandwidths = malloc(sizeof(cl_float) * count);
+        err = bandwidths ? ms_engine_adapt(&engine, knn_rank, MIN_BANDWIDTH * bandwidth, bandwidths)
+                         : CL_OUT_OF_HOST_MEMORY;
+    }
+    if (!svm && err == CL_SUCCESS && quick)
+    {
+        parents = malloc(sizeof(cl_uint) * count);
+        densities = malloc(sizeof(cl_float) * count);
+        err = parents && densities
+                  ? quick_shift(&engine, points, bandwidth, shifted, parents, densities, &timing, &num_roots)
+                  : CL_OUT_OF_HOST_MEMORY;
+    }
+    if (!svm && err == CL_SUCCESS && (update > MS_UPDATE_PLAIN || memoize))
+    {
+        plain = malloc(sizeof(cl_float) * dims * num_seeds);
+        err = plain ? ms_engine_shift(&engine, bandwidth, plain, &plain_timing) : CL_OUT_OF_HOST_MEMORY;
+        plain_iterations = engine.iterations_run;
+    }
+    if (!svm && err == CL_SUCCESS && num_scales)
+    {
+        swept = malloc(sizeof(cl_float) * dims * num_seeds * num_scales);
+        err = swept ? ms_engine_shift_multi(&engine, scales, num_scales, swept, &timing) : CL_OUT_OF_HOST_MEMORY;
+    }
+    if (!svm && err == CL_SUCCESS && hierarchy)
+    {
+        int sweep_iterations = engine.iterations_run;  // iterations of the sweep, which the check runs
+
+        // Merge the seeds of every bandwidth into its modes, then link the modes across the bandwidths
+        //
+        tree_modes = malloc(sizeof(cl_float) * dims * num_seeds * num_scales);
+        tree_parents = malloc(sizeof(cl_uint) * num_seeds * num_scales);
+        for (i = 0; i < num_scales && tree_modes; i++)
+        {
+            tree_first[i] = i ? tree_first[i - 1] + tree_count[i - 1] : 0;
+            tree_count[i] = ms_merge_modes(swept + i * num_seeds * dims, num_seeds, dims, MS_MODE_RADIUS * scales[i],
+                                           tree_modes + tree_first[i] * dims, NULL);
+        }
+        err = tree_modes && tree_parents ? ms_engine_link_scales(&engine, scales, num_scales, tree_modes, tree_count,
+                                                                 tree_parents, NULL, &tree_timing)
+                                         : CL_OUT_OF_HOST_MEMORY;
+        engine.iterations_run = sweep_iterations;
+    }
+    if (!svm && err == CL_SUCCESS && !quick && !num_scales)
+    {
+        engine.update = update >= 0 ? update : MS_UPDATE_PLAIN;
+        engine.memo_radius = memoize ? MEMO_RADIUS * bandwidth : 0.0F;
+        err = ms_engine_shift(&engine, bandwidth, shifted, &timing);
+    }
+#ifdef CL_VERSION_2_0
+    if (svm)
+    {
+        err = ms_engine_run_svm(&engine, points, count, bandwidth, shifted, &timing);
+    }
+#endif
     if (err != CL_SUCCESS)
     {
-        printf("Error: Failed to read output array! %d\n", err);
         return EXIT_FAILURE;
     }
 
-    // Obtain profiling details
+    // Validate our results against the double precision reference, generated data sets are read back first
     //
-    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
-    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
-    elapsed_time = (time_end - time_start) / 1000000.0;
+    if (dataset >= 0 && !seeds && !quick && ms_engine_download(&engine, points) != CL_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    stage_start = ms_profile_clock();
+    memset(&check, 0, sizeof(check));
+    check.passed = 1;
+    if (validate && plain &&
+        (ms_check_shift(seeds ? seeds : points, num_seeds, points, count, plain, dims, bandwidth, bandwidths,
+                        plain_iterations, 0, &plain_check) != 0 ||
+         ms_check_modes(shifted, plain, num_seeds, dims, bandwidth, &check) != 0))
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        return EXIT_FAILURE;
+    }
+    if (validate && quick &&
+        ms_check_quick_shift(points, count, dims, bandwidth, QUICK_DISTANCE * bandwidth, densities, parents,
+                             &check) != 0)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        return EXIT_FAILURE;
+    }
+    if (validate && num_scales &&
+        check_sweep(seeds ? seeds : points, num_seeds, points, count, swept, dims, scales, num_scales,
+                    engine.iterations_run, &check) != 0)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        return EXIT_FAILURE;
+    }
+    if (validate && !plain && !quick && !num_scales &&
+        ms_check_shift(seeds ? seeds : points, num_seeds, points, count, shifted, dims, bandwidth, bandwidths,
+                       engine.iterations_run, blurring, &check) != 0)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        return EXIT_FAILURE;
+    }
+    check.passed &= !validate || !plain || plain_check.passed;
+    correct = validate ? check.correct : num_seeds * (num_scales ? num_scales : 1);
+    ms_profile_host(stages, "validate", stage_start);
 
-    // Validate our results
+    // Merge the shifted seeds into modes and label every point, in the result file if any; sweeps only count clusters
     //
-    correct = 0;
-    for (i = 0; i < count; i++)
+    if ((result_path || seeds || quick) && !num_scales)
     {
-        if (results[i].s[0] != 0.0F && results[i].s[1] != 0.0F)
+        size_t num_modes = 0;
+        double max_distance = 0.0;
+        double sum_distance = 0.0;
+        cl_float *modes = result_path ? result.modes : malloc(sizeof(cl_float) * dims * num_seeds);
+        cl_uint *labels = result_path ? result.labels : malloc(sizeof(cl_uint) * count);
+        cl_float *distances = result_path ? result.distances : malloc(sizeof(cl_float) * count);
+
+        stage_start = ms_profile_clock();
+        err = CL_OUT_OF_HOST_MEMORY;
+        if (modes && labels && distances)
+        {
+            err = label_points(&engine, points, count, shifted, num_seeds, seeds != NULL, MS_MODE_RADIUS * bandwidth,
+                               modes, labels, distances, &num_modes);
+        }
+        else
+        {
+            printf("Error: Failed to allocate host memory!\n");
+        }
+        ms_profile_host(stages, "label", stage_start);
+
+        for (i = 0; i < count && err == CL_SUCCESS; i++)
+        {
+            max_distance = distances[i] > max_distance ? distances[i] : max_distance;
+            sum_distance += distances[i];
+        }
+        if (!result_path)
+        {
+            free(modes);
+            free(labels);
+            free(distances);
+        }
+        if (err != CL_SUCCESS)
+        {
+            return EXIT_FAILURE;
+        }
+        printf("Labelled '%zu' points with '%zu' modes, distance to the mode max %g mean %g\n", count, num_modes,
+               max_distance, count ? sum_distance / count : 0.0);
+
+        // The result file holds the shifted seeds, the distances and the modes in the original coordinates, along with
+        // the bandwidth matrix
+        //
+        if (result_path && factor)
+        {
+            unwhiten_distances(factor, points, result.modes, result.labels, result.distances, count, dims);
+            unwhiten(factor, result.points, num_seeds, dims);
+            unwhiten(factor, result.modes, num_modes, dims);
+        }
+
+        if (result_path && ms_result_close(&result, num_seeds, num_modes) != 0)
+        {
+            printf("Error: Failed to write '%s'!\n", result_path);
+            return EXIT_FAILURE;
+        }
+        if (result_path)
         {
-            correct++;
+            printf("Wrote '%zu' seeds and '%zu' modes to '%s'\n", num_seeds, num_modes, result_path);
         }
     }
 
     // printf("Results: {\n");
     // for (i = 0; i < count; i++)
     // {
-    //     printf("%f %f\n", results[i].s[0], results[i].s[1]);
+    //     printf("%f %f\n", shifted[i * DIMS], shifted[i * DIMS + 1]);
     // }
     // printf("}\n");
 
     // Print a brief summary detailing the results
     //
-    printf("Computed '%d/%zu' correct values in [%0.3fms]!\n", correct, count, elapsed_time);
+    for (i = 0; i < engine.num_devices && engine.num_devices > 1; i++)
+    {
+        char name[256] = "";
+        clGetDeviceInfo(engine.device_ids[i], CL_DEVICE_NAME, sizeof(name), name, NULL);
+        printf("Device %d '%s' shifted '%zu' points in [%0.3fms]\n", i, name, timing.device_share[i],
+               timing.device_time[i]);
+    }
+#ifdef MS_STATS
+    for (i = 0; i < engine.iterations_run && engine.stats; i++)
+    {
+        const ms_stats *stats = &engine.stats[i];
+        printf("Iteration %d evaluated '%llu' pairs ('%llu' weighted), '%u' points active, shift max %0.4f "
+               "mean %0.4f\n",
+               i, (unsigned long long)stats->pairs, (unsigned long long)stats->weighted_pairs, stats->active,
+               stats->max_shift, stats->mean_shift);
+    }
+#endif
+    if (estimated)
+    {
+        printf("Estimated a bandwidth of %g with the %s estimator\n", bandwidth, EstimatorNames[estimator]);
+    }
+    if (matrix)
+    {
+        printf("Whitened the points with the Cholesky factor of a %zux%zu bandwidth matrix\n", dims, dims);
+    }
+    if (bandwidths)
+    {
+        cl_float low = bandwidths[0];
+        cl_float high = bandwidths[0];
+        for (i = 1; i < count; i++)
+        {
+            low = bandwidths[i] < low ? bandwidths[i] : low;
+            high = bandwidths[i] > high ? bandwidths[i] : high;
+        }
+        printf("Adapted the bandwidths to the '%u'th nearest neighbour, from %g to %g\n", knn_rank, low, high);
+    }
+    for (i = 0; i < num_scales; i++)
+    {
+        cl_float *modes = malloc(sizeof(cl_float) * dims * num_seeds);
+        if (!modes)
+        {
+            printf("Error: Failed to allocate host memory!\n");
+            return EXIT_FAILURE;
+        }
+        printf("Bandwidth %g gave '%zu' clusters\n", scales[i],
+               ms_merge_modes(swept + i * num_seeds * dims, num_seeds, dims, MS_MODE_RADIUS * scales[i], modes, NULL));
+        free(modes);
+    }
+    if (hierarchy)
+    {
+        printf("Linked the modes of '%zu' bandwidths into a scale-space tree in [%0.3fms]\n", num_scales,
+               tree_timing.kernel_time);
+        for (i = 0; i < tree_count[num_scales - 1]; i++)
+        {
+            print_scale_tree(tree_modes, tree_count, tree_first, tree_parents, scales, dims, num_scales - 1, i, 0);
+        }
+    }
+    if (quick)
+    {
+        printf("Quick shift linked '%zu' points into '%zu' trees\n", count, num_roots);
+    }
+    if (plain)
+    {
+        printf("Converged in '%d' iterations with the %s update%s, plain mean shift in '%d' [%0.3fms]\n",
+               engine.iterations_run, UpdateNames[update], memoize ? " memoized" : "", plain_iterations,
+               plain_timing.kernel_time);
+    }
+    else if (update >= 0)
+    {
+        printf("Converged in '%d' iterations with the %s update\n", engine.iterations_run, UpdateNames[update]);
+    }
+    printf("Computed '%d/%zu' correct values in [%0.3fms]!\n", correct, num_seeds * (num_scales ? num_scales : 1),
+           timing.kernel_time);
+    if (validate && plain)
+    {
+        printf("Plain run max error %g, mean error %g (tolerance %g), '%zu/%zu' modes within %g\n",
+               plain_check.max_error, plain_check.mean_error, plain_check.tolerance, plain_check.num_modes,
+               plain_check.reference_modes, plain_check.mode_error);
+    }
+    if (validate)
+    {
+        printf("Max error %g, mean error %g (tolerance %g), '%zu/%zu' modes within %g\n", check.max_error,
+               check.mean_error, check.tolerance, check.num_modes, check.reference_modes, check.mode_error);
+    }
+    if (print_stages)
+    {
+        printf("\n");
+        print_profile(stages);
+    }
+    if (trace_path)
+    {
+        ms_profile_write_trace(stages, &engine, trace_path);
+    }
 
     // Shutdown and cleanup
     //
-    clReleaseMemObject(input_1);
-    clReleaseMemObject(input_2);
-    clReleaseMemObject(output);
-    clReleaseProgram(program);
-    clReleaseKernel(kernel);
-    clReleaseCommandQueue(commands);
-    clReleaseContext(context);
+#ifdef CL_VERSION_2_0
+    if (svm)
+    {
+        ms_svm_free(&engine, points);
+        ms_svm_free(&engine, shifted);
+    }
+#endif
+    ms_engine_release(&engine);
+    if (points_path)
+    {
+        ms_points_close(&file);
+    }
+    if (points_path && !result_path)
+    {
+        free(shifted);
+    }
+    free(seeds);
+    free(plain);
+    free(parents);
+    free(densities);
+    free(bandwidths);
+    free(swept);
+    free(tree_modes);
+    free(tree_parents);
+    free(matrix);
+    free(factor);
+    free(whitened);
 
-    return 0;
+    return check.passed ? 0 : EXIT_FAILURE;
 }
@@ -0,0 +1,467 @@
+///
+/// @file       meanshift_bench.c
+///
+
+// Compilation:
+//     - macOS: clang -o meanshift_bench meanshift_bench.c meanshift_engine.c meanshift_reference.c -framework OpenCL
+//     - Linux: gcc -o meanshift_bench meanshift_bench.c meanshift_engine.c meanshift_reference.c -lopencl
+//       -Lpath/to/opencl
+//
+// Usage:
+//     ./meanshift_bench [-n sizes] [-d dims] [-b bandwidths] [-k variants] [-t devices] [-g datasets] [-s seed]
+//                       [-i iterations] [-r repeats] [-C] [-j results.json] [-c results.csv]
+//
+//     Every list is comma separated, e.g. -n 1024,4096 -k naive,tiled -t gpu,cpu. Each combination is executed
+//     `repeats` times and the fastest kernel time is reported, along with its transfer time, the build time of the
+//     program, the evaluated pairs per second and the achieved GFLOP/s. The data sets are generated on the device
+//     from the seed, so runs are reproducible across machines. The symmetric variant only runs blurring mean shift,
+//     which it is measured and checked with. The adaptive variant takes the bandwidth of every point from its distance
+//     to its 16th nearest neighbour, with the bandwidth of the combination as a floor.
+//
+//     With -C every combination is also checked against the double precision reference: the shifted points and the
+//     modes they converge to have to be within the tolerances of meanshift_reference.h. A combination which cannot
+//     run, because its device, data set or kernel fails, is reported as failing rather than skipped. The program then
+//     exits with a failure if any combination is wrong, which makes a sweep of the variants, devices and data sets
+//     usable as a correctness test.
+//
+
+#include "meanshift_engine.h"
+#include "meanshift_reference.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define MAX_VALUES (32)     // longest list accepted per option
+#define MAX_RECORDS (4096)  // most measurements kept for the JSON and CSV outputs
+#define CLUSTERS (8)        // clusters (or image regions) of the synthetic data sets
+#define KNN_RANK (16)       // neighbour giving the bandwidth of a point with the adaptive variant
+
+////////////////////////////////////////////////////////////////////////////////
+
+// One measured combination of the sweep
+//
+typedef struct
+{
+    ms_device_mode mode;    // device(s) the kernel ran on
+    ms_variant variant;     // kernel variant
+    ms_dataset dataset;     // synthetic data set
+    char device_name[128];  // name of the first device
+    size_t count;           // number of points
+    size_t dims;            // dimension of the points
+    float bandwidth;        // kernel bandwidth
+    double build_time;      // ms
+    double kernel_time;     // ms, fastest of the repeats
+    double transfer_time;   // ms, of the fastest repeat
+    double pairs_per_second;
+    double gflops;
+    int iterations;     // mean shift iterations of each repeat
+    int checked;        // -1 when not checked, otherwise whether the check against the reference passed
+    double max_error;   // largest error of a coordinate, when checked
+    double mode_error;  // largest error of a mode, when checked
+} bench_record;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int parse_sizes(const char *list, size_t *values)
+{
+    int n = 0;
+    char *end;
+    while (n < MAX_VALUES && *list)
+    {
+        values[n++] = strtoul(list, &end, 10);
+        if (end == list || (*end && *end != ','))
+        {
+            return -1;
+        }
+        list = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+static int parse_floats(const char *list, float *values)
+{
+    int n = 0;
+    char *end;
+    while (n < MAX_VALUES && *list)
+    {
+        values[n++] = strtof(list, &end);
+        if (end == list || (*end && *end != ','))
+        {
+            return -1;
+        }
+        list = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+// Parse a list of names with the given lookup, e.g. ms_variant_from_name()
+//
+static int parse_names(const char *list, int *values, int (*from_name)(const char *))
+{
+    int n = 0;
+    char buffer[256];
+    char *name;
+
+    snprintf(buffer, sizeof(buffer), "%s", list);
+    for (name = strtok(buffer, ","); name && n < MAX_VALUES; name = strtok(NULL, ","))
+    {
+        values[n] = from_name(name);
+        if (values[n++] < 0)
+        {
+            printf("Error: Unknown name '%s'!\n", name);
+            return -1;
+        }
+    }
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void write_json(const char *path, const bench_record *records, int num_records)
+{
+    int r;
+    const char *c;
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        printf("Error: Failed to open '%s'!\n", path);
+        return;
+    }
+
+    fprintf(file, "[\n");
+    for (r = 0; r < num_records; r++)
+    {
+        const bench_record *rec = &records[r];
+        fprintf(file, "  {\"device\": \"%s\", \"device_name\": \"", DeviceModeNames[rec->mode]);
+        for (c = rec->device_name; *c; c++)
+        {
+            fprintf(file, (*c == '"' || *c == '\\') ? "\\%c" : "%c", *c);
+        }
+        fprintf(file,
+                "\", \"variant\": \"%s\", \"dataset\": \"%s\", \"n\": %zu, \"d\": %zu, \"bandwidth\": %g, "
+                "\"iterations\": %d, \"build_ms\": %.3f, \"kernel_ms\": %.3f, \"transfer_ms\": %.3f, "
+                "\"pairs_per_second\": %.6g, \"gflops\": %.3f",
+                VariantNames[rec->variant], DatasetNames[rec->dataset], rec->count, rec->dims, rec->bandwidth,
+                rec->iterations, rec->build_time, rec->kernel_time, rec->transfer_time, rec->pairs_per_second,
+                rec->gflops);
+        if (rec->checked >= 0)
+        {
+            fprintf(file, ", \"passed\": %s, \"max_error\": %g, \"mode_error\": %g", rec->checked ? "true" : "false",
+                    rec->max_error, rec->mode_error);
+        }
+        fprintf(file, "}%s\n", r + 1 < num_records ? "," : "");
+    }
+    fprintf(file, "]\n");
+    fclose(file);
+}
+
+static void write_csv(const char *path, const bench_record *records, int num_records)
+{
+    int r;
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        printf("Error: Failed to open '%s'!\n", path);
+        return;
+    }
+
+    fprintf(file, "device,device_name,variant,dataset,n,d,bandwidth,iterations,build_ms,kernel_ms,transfer_ms,"
+                  "pairs_per_second,gflops,passed,max_error,mode_error\n");
+    for (r = 0; r < num_records; r++)
+    {
+        const bench_record *rec = &records[r];
+        fprintf(file, "%s,\"%s\",%s,%s,%zu,%zu,%g,%d,%.3f,%.3f,%.3f,%.6g,%.3f,", DeviceModeNames[rec->mode],
+                rec->device_name, VariantNames[rec->variant], DatasetNames[rec->dataset], rec->count, rec->dims,
+                rec->bandwidth, rec->iterations, rec->build_time, rec->kernel_time, rec->transfer_time,
+                rec->pairs_per_second, rec->gflops);
+        if (rec->checked >= 0)
+        {
+            fprintf(file, "%d,%g,%g\n", rec->checked, rec->max_error, rec->mode_error);
+        }
+        else
+        {
+            fprintf(file, ",,\n");
+        }
+    }
+    fclose(file);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Shift the points of the engine `repeats` times and fill the timings of the record from the fastest repeat
+//
+static int measure(ms_engine *engine, int repeats, cl_float *results, bench_record *record)
+{
+    int err = CL_SUCCESS;
+    int r;
+    ms_timing timing;
+    double pairs = (double)record->count * (double)record->count * record->iterations;
+
+    record->kernel_time = -1.0;
+    for (r = 0; r < repeats && err == CL_SUCCESS; r++)
+    {
+        err = ms_engine_shift(engine, record->bandwidth, results, &timing);
+        if (err == CL_SUCCESS && (record->kernel_time < 0.0 || timing.kernel_time < record->kernel_time))
+        {
+            record->kernel_time = timing.kernel_time;
+            record->transfer_time = timing.transfer_time;
+        }
+    }
+
+    record->pairs_per_second = pairs / (record->kernel_time / 1000.0);
+    record->gflops = pairs * FLOPS_PER_PAIR(record->dims) / (record->kernel_time / 1000.0) / 1e9;
+    return err;
+}
+
+// Print a record as a row of the table and keep it for the JSON and CSV outputs
+//
+static void add_record(bench_record *records, int *num_records, const bench_record *record)
+{
+    printf("%-6s %-9s %-11s %9zu %4zu %9g %10.3f %11.3f %13.3f %12.1f %9.2f %6s\n", DeviceModeNames[record->mode],
+           VariantNames[record->variant], DatasetNames[record->dataset], record->count, record->dims,
+           record->bandwidth, record->build_time, record->kernel_time, record->transfer_time,
+           record->pairs_per_second / 1e6, record->gflops,
+           record->checked < 0 ? "-" : record->checked ? "pass" : "FAIL");
+    if (*num_records < MAX_RECORDS)
+    {
+        records[(*num_records)++] = *record;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+    int err;  // error code returned from api calls
+
+    size_t sizes[MAX_VALUES] = {1024, 4096, 16384};
+    size_t dims[MAX_VALUES] = {2};
+    float bandwidths[MAX_VALUES] = {3.0F};
+    int variants[MAX_VALUES] = {MS_VARIANT_NAIVE, MS_VARIANT_TILED};
+    int modes[MAX_VALUES] = {MS_DEVICE_GPU};
+    int datasets[MAX_VALUES] = {MS_DATA_BLOBS};
+    int num_sizes = 3, num_dims = 1, num_bandwidths = 1, num_variants = 2, num_modes = 1, num_datasets = 1;
+    int repeats = 3;
+    int iterations = 1;
+    int check = 0;
+    int failures = 0;
+    cl_uint seed = 42;
+    const char *json_path = NULL;
+    const char *csv_path = NULL;
+
+    static bench_record records[MAX_RECORDS];
+    int num_records = 0;
+
+    int t, v, d, g, n, b;
+
+    // Parse command line options
+    //
+    int opt;
+    while ((opt = getopt(argc, argv, "n:d:b:k:t:g:s:i:r:Cj:c:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                num_sizes = parse_sizes(optarg, sizes);
+                break;
+            case 'd':
+                num_dims = parse_sizes(optarg, dims);
+                break;
+            case 'b':
+                num_bandwidths = parse_floats(optarg, bandwidths);
+                break;
+            case 'k':
+                num_variants = parse_names(optarg, variants, ms_variant_from_name);
+                break;
+            case 't':
+                num_modes = parse_names(optarg, modes, ms_device_mode_from_name);
+                break;
+            case 'g':
+                num_datasets = parse_names(optarg, datasets, ms_dataset_from_name);
+                break;
+            case 's':
+                seed = (cl_uint)strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                break;
+            case 'r':
+                repeats = atoi(optarg);
+                break;
+            case 'C':
+                check = 1;
+                break;
+            case 'j':
+                json_path = optarg;
+                break;
+            case 'c':
+                csv_path = optarg;
+                break;
+            default:
+                num_sizes = -1;
+                break;
+        }
+    }
+    if (num_sizes <= 0 || num_dims <= 0 || num_bandwidths <= 0 || num_variants <= 0 || num_modes <= 0 ||
+        num_datasets <= 0 || iterations <= 0 || repeats <= 0)
+    {
+        printf("Usage: %s [-n sizes] [-d dims] [-b bandwidths] [-k variants] [-t devices] [-g datasets] [-s seed] "
+               "[-i iterations] [-r repeats] [-C] [-j results.json] [-c results.csv]\n",
+               argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-6s %-9s %-11s %9s %4s %9s %10s %11s %13s %12s %9s %6s\n", "device", "variant", "dataset", "n", "d",
+           "bandwidth", "build[ms]", "kernel[ms]", "transfer[ms]", "Mpairs/s", "GFLOP/s", "check");
+
+    // Sweep every combination, the program is built once per device, variant and dimension
+    //
+    for (t = 0; t < num_modes; t++)
+    {
+        for (v = 0; v < num_variants; v++)
+        {
+            for (d = 0; d < num_dims; d++)
+            {
+                ms_engine engine;
+                char device_name[128] = "";
+
+                // With -C a device which cannot run the combinations fails them rather than skipping them
+                //
+                err = ms_engine_create(&engine, modes[t], variants[v], dims[d], NULL);
+                if (err != CL_SUCCESS)
+                {
+                    printf("%s device '%s' with variant '%s' and d=%zu\n", check ? "Failing" : "Skipping",
+                           DeviceModeNames[modes[t]], VariantNames[variants[v]], dims[d]);
+                    if (!check)
+                    {
+                        ms_engine_release(&engine);
+                        continue;
+                    }
+                }
+                else
+                {
+                    clGetDeviceInfo(engine.device_ids[0], CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+                    engine.iterations = iterations;
+                    engine.blurring = variants[v] == MS_VARIANT_SYMMETRIC;
+                }
+
+                for (g = 0; g < num_datasets; g++)
+                {
+                    for (n = 0; n < num_sizes; n++)
+                    {
+                        size_t count = sizes[n];
+                        cl_float *results = malloc(sizeof(cl_float) * dims[d] * count);
+                        cl_float *points = check ? malloc(sizeof(cl_float) * dims[d] * count) : NULL;
+                        cl_float *adapted = variants[v] == MS_VARIANT_ADAPTIVE ? malloc(sizeof(cl_float) * count)
+                                                                               : NULL;
+                        int placed = err;  // the engine exists and holds the data set
+
+                        // Generate the data set on the device(s), only the results cross the bus unless the
+                        // points are needed by the reference
+                        //
+                        if (placed == CL_SUCCESS &&
+                            (!results || (check && !points) || (variants[v] == MS_VARIANT_ADAPTIVE && !adapted)))
+                        {
+                            printf("Error: Failed to allocate host memory!\n");
+                            placed = CL_OUT_OF_HOST_MEMORY;
+                        }
+                        if (placed == CL_SUCCESS)
+                        {
+                            placed = ms_engine_generate(&engine, datasets[g], count, seed, CLUSTERS);
+                        }
+                        if (placed == CL_SUCCESS && check)
+                        {
+                            placed = ms_engine_download(&engine, points);
+                        }
+                        for (b = 0; b < num_bandwidths && (placed == CL_SUCCESS || check); b++)
+                        {
+                            bench_record record;
+                            int status = placed;
+
+                            memset(&record, 0, sizeof(record));
+                            record.mode = modes[t];
+                            record.variant = variants[v];
+                            record.dataset = datasets[g];
+                            snprintf(record.device_name, sizeof(record.device_name), "%s", device_name);
+                            record.count = count;
+                            record.dims = dims[d];
+                            record.bandwidth = bandwidths[b];
+                            record.build_time = engine.build_time;
+                            record.iterations = iterations;
+                            record.checked = -1;
+                            if (status == CL_SUCCESS && adapted)
+                            {
+                                status = ms_engine_adapt(&engine, KNN_RANK, record.bandwidth, adapted);
+                            }
+                            if (status == CL_SUCCESS)
+                            {
+                                status = measure(&engine, repeats, results, &record);
+                            }
+                            if (status != CL_SUCCESS)
+                            {
+                                // A combination which did not run fails the check, with its timings left at zero
+                                //
+                                if (check)
+                                {
+                                    record.kernel_time = 0.0;
+                                    record.transfer_time = 0.0;
+                                    record.pairs_per_second = 0.0;
+                                    record.gflops = 0.0;
+                                    record.checked = 0;
+                                    failures++;
+                                    add_record(records, &num_records, &record);
+                                }
+                                continue;
+                            }
+
+                            if (check)
+                            {
+                                ms_check outcome;
+                                if (ms_check_shift(points, count, points, count, results, record.dims,
+                                                   record.bandwidth, adapted, iterations, engine.blurring,
+                                                   &outcome) != 0)
+                                {
+                                    printf("Error: Failed to allocate host memory!\n");
+                                    outcome.passed = 0;
+                                }
+                                record.checked = outcome.passed;
+                                record.max_error = outcome.max_error;
+                                record.mode_error = outcome.mode_error;
+                                failures += !outcome.passed;
+                            }
+                            add_record(records, &num_records, &record);
+                        }
+
+                        free(results);
+                        free(points);
+                        free(adapted);
+                    }
+                }
+
+                ms_engine_release(&engine);
+            }
+        }
+    }
+
+    // Write the machine readable outputs
+    //
+    if (json_path)
+    {
+        write_json(json_path, records, num_records);
+    }
+    if (csv_path)
+    {
+        write_csv(csv_path, records, num_records);
+    }
+
+    if (failures)
+    {
+        printf("%d combination(s) failed the check against the reference!\n", failures);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
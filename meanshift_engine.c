@@ -0,0 +1,4396 @@
+///
+/// @file       meanshift_engine.c
+///
+
+#include "meanshift_engine.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Work groups per compute unit of the slice measuring the throughput of each device in multi-device mode, enough to
+// keep every compute unit busy, and the largest work group used to execute the kernels
+//
+#define CALIBRATION_GROUPS (2)
+#define MAX_LOCAL_SIZE (256)
+#define GRID_MODES (256)        // modes from which points are assigned through a grid rather than tiles
+#define MAX_GRID_SIZE (4096)    // cells along each coordinate of the grid of modes
+
+#ifdef MS_STATS
+// Counters of one iteration on one device as laid out by the kernel, and the fixed point scale of the shift sum
+//
+#define STATS_SIZE (8)
+#define STATS_SHIFT_SCALE (65536.0)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Mean Shift Point kernels which compute the mean shift of points, and the generator of synthetic data sets
+//
+const char *KernelSource =
+    "\n"
+    "// DIM, the dimension of the points, is defined when building the program      \n"
+    "//                                                                             \n"
+    "#ifdef MS_STATS                                                                \n"
+    "// Counters of an iteration, see ms_stats. The 64 bit counters are kept as a   \n"
+    "// low and a high word, so that 32 bit atomics are enough.                     \n"
+    "//                                                                             \n"
+    "#define STATS_PAIRS 0                                                          \n"
+    "#define STATS_WEIGHTED 2                                                       \n"
+    "#define STATS_ACTIVE 4                                                         \n"
+    "#define STATS_MAX_SHIFT 5                                                      \n"
+    "#define STATS_SHIFT_SUM 6                                                      \n"
+    "#define STATS_SHIFT_SCALE 65536.0F                                             \n"
+    "#define NEGLIGIBLE_WEIGHT 1e-6F                                                \n"
+    "                                                                               \n"
+    "void add_counter(__global uint* counter, uint value)                           \n"
+    "{                                                                              \n"
+    "    uint old = atomic_add(&counter[0], value);                                 \n"
+    "    if (old + value < old)                                                     \n"
+    "    {                                                                          \n"
+    "        atomic_inc(&counter[1]);                                               \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Account for one shifted point. Shift lengths are non-negative, so their     \n"
+    "// bits order like unsigned integers and the maximum is an integer atomic.     \n"
+    "//                                                                             \n"
+    "void count_shift(__global uint* stats, const float* point, const float* shift, \n"
+    "                 float scale, uint pairs, uint weighted, float tolerance)      \n"
+    "{                                                                              \n"
+    "    float length2 = 0.0F;                                                      \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        float delta = shift[k] / scale - point[k];                             \n"
+    "        length2 += delta * delta;                                              \n"
+    "    }                                                                          \n"
+    "    float length = sqrt(length2);                                              \n"
+    "                                                                               \n"
+    "    add_counter(&stats[STATS_PAIRS], pairs);                                   \n"
+    "    add_counter(&stats[STATS_WEIGHTED], weighted);                             \n"
+    "    if (length >= tolerance)                                                   \n"
+    "    {                                                                          \n"
+    "        atomic_inc(&stats[STATS_ACTIVE]);                                      \n"
+    "    }                                                                          \n"
+    "    atomic_max(&stats[STATS_MAX_SHIFT], as_uint(length));                      \n"
+    "    add_counter(&stats[STATS_SHIFT_SUM],                                       \n"
+    "                (uint)(min(length, 65535.0F) * STATS_SHIFT_SCALE));            \n"
+    "}                                                                              \n"
+    "#endif                                                                         \n"
+    "                                                                               \n"
+    "// Shift each of the num_seeds seeds once against the num_points original      \n"
+    "// points, the seeds being the points themselves unless a seed set is given    \n"
+    "//                                                                             \n"
+    "__kernel void algorithm(                                                       \n"
+    "   __global const float* input_1,     // seeds                                 \n"
+    "   __global const float* input_2,     // original_points                       \n"
+    "   const uint num_seeds,                                                       \n"
+    "   const uint num_points,                                                      \n"
+    "   const float bandwidth,                                                      \n"
+    "   __global float* output             // shifted_points                        \n"
+    "#ifdef MS_STATS                                                                \n"
+    "   , __global uint* stats,            // counters of the iteration             \n"
+    "   const float tolerance              // points moving less have converged     \n"
+    "#endif                                                                         \n"
+    "   )                                                                           \n"
+    "{                                                                              \n"
+    "    float pi = 3.14F;                                                          \n"
+    "    float base_weight = 1.0F / (bandwidth * sqrt(2.0F * pi));                  \n"
+    "    float point[DIM];                                                          \n"
+    "    float shift[DIM];                                                          \n"
+    "    float scale = 0.0F;                                                        \n"
+    "#ifdef MS_STATS                                                                \n"
+    "    float negligible = base_weight * NEGLIGIBLE_WEIGHT;                        \n"
+    "    uint weighted = 0;                                                         \n"
+    "#endif                                                                         \n"
+    "                                                                               \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    if (i >= num_seeds)                                                        \n"
+    "    {                                                                          \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        point[k] = input_1[i * DIM + k];                                       \n"
+    "        shift[k] = 0.0F;                                                       \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint j = 0; j < num_points; j++)                                      \n"
+    "    {                                                                          \n"
+    "        float dist2 = 0.0F;                                                    \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            float diff = point[k] - input_2[j * DIM + k];                      \n"
+    "            dist2 += diff * diff;                                              \n"
+    "        }                                                                      \n"
+    "        float weight = base_weight * exp(-0.5F * dist2 / (bandwidth * bandwidth));\n"
+    "#ifdef MS_STATS                                                                \n"
+    "        weighted += weight > negligible;                                       \n"
+    "#endif                                                                         \n"
+    "                                                                               \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            shift[k] += input_2[j * DIM + k] * weight;                         \n"
+    "        }                                                                      \n"
+    "        scale += weight;                                                       \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        output[i * DIM + k] = shift[k] / scale;                                \n"
+    "    }                                                                          \n"
+    "#ifdef MS_STATS                                                                \n"
+    "    count_shift(stats, point, shift, scale, num_points, weighted,              \n"
+    "                tolerance);                                                    \n"
+    "#endif                                                                         \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Same as algorithm, but each work group stages the original points through   \n"
+    "// local memory, one point per work item at a time                             \n"
+    "//                                                                             \n"
+    "__kernel void algorithm_tiled(                                                 \n"
+    "   __global const float* input_1,     // seeds                                 \n"
+    "   __global const float* input_2,     // original_points                       \n"
+    "   const uint num_seeds,                                                       \n"
+    "   const uint num_points,                                                      \n"
+    "   const float bandwidth,                                                      \n"
+    "   __global float* output,            // shifted_points                        \n"
+    "   __local float* tile                // local_size original points            \n"
+    "#ifdef MS_STATS                                                                \n"
+    "   , __global uint* stats,            // counters of the iteration             \n"
+    "   const float tolerance              // points moving less have converged     \n"
+    "#endif                                                                         \n"
+    "   )                                                                           \n"
+    "{                                                                              \n"
+    "    float pi = 3.14F;                                                          \n"
+    "    float base_weight = 1.0F / (bandwidth * sqrt(2.0F * pi));                  \n"
+    "    float point[DIM];                                                          \n"
+    "    float shift[DIM];                                                          \n"
+    "    float scale = 0.0F;                                                        \n"
+    "#ifdef MS_STATS                                                                \n"
+    "    float negligible = base_weight * NEGLIGIBLE_WEIGHT;                        \n"
+    "    uint weighted = 0;                                                         \n"
+    "#endif                                                                         \n"
+    "                                                                               \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    uint lid = get_local_id(0);                                                \n"
+    "    uint local_size = get_local_size(0);                                       \n"
+    "    size_t p = i < num_seeds ? i : num_seeds - 1;                              \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        point[k] = input_1[p * DIM + k];                                       \n"
+    "        shift[k] = 0.0F;                                                       \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint base = 0; base < num_points; base += local_size)                 \n"
+    "    {                                                                          \n"
+    "        uint n = min(local_size, num_points - base);                           \n"
+    "                                                                               \n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);                                          \n"
+    "        for (uint t = lid; t < n * DIM; t += local_size)                       \n"
+    "        {                                                                      \n"
+    "            tile[t] = input_2[base * DIM + t];                                 \n"
+    "        }                                                                      \n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);                                          \n"
+    "                                                                               \n"
+    "        for (uint j = 0; j < n; j++)                                           \n"
+    "        {                                                                      \n"
+    "            float dist2 = 0.0F;                                                \n"
+    "            for (uint k = 0; k < DIM; k++)                                     \n"
+    "            {                                                                  \n"
+    "                float diff = point[k] - tile[j * DIM + k];                     \n"
+    "                dist2 += diff * diff;                                          \n"
+    "            }                                                                  \n"
+    "            float weight = base_weight * exp(-0.5F * dist2 / (bandwidth * bandwidth));\n"
+    "#ifdef MS_STATS                                                                \n"
+    "            weighted += weight > negligible;                                   \n"
+    "#endif                                                                         \n"
+    "                                                                               \n"
+    "            for (uint k = 0; k < DIM; k++)                                     \n"
+    "            {                                                                  \n"
+    "                shift[k] += tile[j * DIM + k] * weight;                        \n"
+    "            }                                                                  \n"
+    "            scale += weight;                                                   \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    if (i < num_seeds)                                                         \n"
+    "    {                                                                          \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            output[i * DIM + k] = shift[k] / scale;                            \n"
+    "        }                                                                      \n"
+    "#ifdef MS_STATS                                                                \n"
+    "        count_shift(stats, point, shift, scale, num_points, weighted,          \n"
+    "                    tolerance);                                                \n"
+    "#endif                                                                         \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Shift each seed once with a variable bandwidth, sample point estimator:     \n"
+    "// every original point j spreads its own kernel of bandwidth h_j, usually     \n"
+    "// the distance to its k-th nearest neighbour, and weighs                      \n"
+    "// exp(-d^2 / 2 h_j^2) / h_j^(DIM + 2), so that points of sparse regions       \n"
+    "// reach further with a lower peak. The scalar bandwidth is not used.          \n"
+    "//                                                                             \n"
+    "__kernel void algorithm_adaptive(                                              \n"
+    "   __global const float* input_1,     // seeds                                 \n"
+    "   __global const float* input_2,     // original_points                       \n"
+    "   const uint num_seeds,                                                       \n"
+    "   const uint num_points,                                                      \n"
+    "   const float bandwidth,                                                      \n"
+    "   __global float* output,            // shifted_points                        \n"
+    "   __global const float* bandwidths   // bandwidth of each original point      \n"
+    "#ifdef MS_STATS                                                                \n"
+    "   , __global uint* stats,            // counters of the iteration             \n"
+    "   const float tolerance              // points moving less have converged     \n"
+    "#endif                                                                         \n"
+    "   )                                                                           \n"
+    "{                                                                              \n"
+    "    float point[DIM];                                                          \n"
+    "    float shift[DIM];                                                          \n"
+    "    float scale = 0.0F;                                                        \n"
+    "#ifdef MS_STATS                                                                \n"
+    "    uint weighted = 0;                                                         \n"
+    "#endif                                                                         \n"
+    "                                                                               \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    if (i >= num_seeds)                                                        \n"
+    "    {                                                                          \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        point[k] = input_1[i * DIM + k];                                       \n"
+    "        shift[k] = 0.0F;                                                       \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint j = 0; j < num_points; j++)                                      \n"
+    "    {                                                                          \n"
+    "        float h = bandwidths[j];                                               \n"
+    "        float dist2 = 0.0F;                                                    \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            float diff = point[k] - input_2[j * DIM + k];                      \n"
+    "            dist2 += diff * diff;                                              \n"
+    "        }                                                                      \n"
+    "        float profile = exp(-0.5F * dist2 / (h * h));                          \n"
+    "        float weight = profile * pow(h, -(float)(DIM + 2));                    \n"
+    "#ifdef MS_STATS                                                                \n"
+    "        weighted += profile > NEGLIGIBLE_WEIGHT;                               \n"
+    "#endif                                                                         \n"
+    "                                                                               \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            shift[k] += input_2[j * DIM + k] * weight;                         \n"
+    "        }                                                                      \n"
+    "        scale += weight;                                                       \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        output[i * DIM + k] = shift[k] / scale;                                \n"
+    "    }                                                                          \n"
+    "#ifdef MS_STATS                                                                \n"
+    "    count_shift(stats, point, shift, scale, num_points, weighted, tolerance);  \n"
+    "#endif                                                                         \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Shift each seed once at every bandwidth of a sweep, one trajectory per      \n"
+    "// (seed, bandwidth) pair. Each original point is loaded once and weighted     \n"
+    "// at every scale, so a sweep of a few bandwidths costs little more than a     \n"
+    "// single one. The positions of the scales follow each other in input and      \n"
+    "// output, num_seeds per scale; on the first iteration the input holds the     \n"
+    "// seeds, shared by every scale. A seed counts as moving while any of its      \n"
+    "// trajectories moves by at least the convergence distance.                    \n"
+    "//                                                                             \n"
+    "#define MAX_SCALES 16                                                          \n"
+    "                                                                               \n"
+    "__kernel void algorithm_multi(                                                 \n"
+    "   __global const float* input,       // positions of every scale, or seeds    \n"
+    "   __global const float* points,      // original_points                       \n"
+    "   const uint num_seeds,                                                       \n"
+    "   const uint num_points,                                                      \n"
+    "   __global const float* bandwidths,  // bandwidth of every scale              \n"
+    "   const uint num_scales,             // at most MAX_SCALES                    \n"
+    "   const uint first,                  // input holds the seeds                 \n"
+    "   __global float* output,            // shifted positions of every scale      \n"
+    "   const float convergence,                                                    \n"
+    "   __global uint* moving)             // seeds which have not converged        \n"
+    "{                                                                              \n"
+    "    float position[MAX_SCALES * DIM];                                          \n"
+    "    float shift[MAX_SCALES * DIM];                                             \n"
+    "    float scale[MAX_SCALES];                                                   \n"
+    "    float factor[MAX_SCALES];          // -1 / 2h^2 of every scale             \n"
+    "    float reference[DIM];                                                      \n"
+    "    uint moved = 0;                                                            \n"
+    "                                                                               \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    if (i >= num_seeds)                                                        \n"
+    "    {                                                                          \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint s = 0; s < num_scales; s++)                                      \n"
+    "    {                                                                          \n"
+    "        size_t row = first ? i : s * (size_t)num_seeds + i;                    \n"
+    "        factor[s] = -0.5F / (bandwidths[s] * bandwidths[s]);                   \n"
+    "        scale[s] = 0.0F;                                                       \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            position[s * DIM + k] = input[row * DIM + k];                      \n"
+    "            shift[s * DIM + k] = 0.0F;                                         \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint j = 0; j < num_points; j++)                                      \n"
+    "    {                                                                          \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            reference[k] = points[j * DIM + k];                                \n"
+    "        }                                                                      \n"
+    "        for (uint s = 0; s < num_scales; s++)                                  \n"
+    "        {                                                                      \n"
+    "            float dist2 = 0.0F;                                                \n"
+    "            for (uint k = 0; k < DIM; k++)                                     \n"
+    "            {                                                                  \n"
+    "                float diff = position[s * DIM + k] - reference[k];             \n"
+    "                dist2 += diff * diff;                                          \n"
+    "            }                                                                  \n"
+    "            float weight = exp(dist2 * factor[s]);                             \n"
+    "                                                                               \n"
+    "            for (uint k = 0; k < DIM; k++)                                     \n"
+    "            {                                                                  \n"
+    "                shift[s * DIM + k] += reference[k] * weight;                   \n"
+    "            }                                                                  \n"
+    "            scale[s] += weight;                                                \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint s = 0; s < num_scales; s++)                                      \n"
+    "    {                                                                          \n"
+    "        float length2 = 0.0F;                                                  \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            float mean = shift[s * DIM + k] / scale[s];                        \n"
+    "            float step = mean - position[s * DIM + k];                         \n"
+    "            length2 += step * step;                                            \n"
+    "            output[(s * (size_t)num_seeds + i) * DIM + k] = mean;              \n"
+    "        }                                                                      \n"
+    "        moved |= length2 >= convergence * convergence;                         \n"
+    "    }                                                                          \n"
+    "    if (moved)                                                                 \n"
+    "    {                                                                          \n"
+    "        atomic_inc(moving);                                                    \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Float atomic additions, built on atomic_cmpxchg of the bits of the value    \n"
+    "//                                                                             \n"
+    "void atomic_add_global(volatile __global float* p, float value)                \n"
+    "{                                                                              \n"
+    "    uint old = as_uint(*p);                                                    \n"
+    "    uint assumed;                                                              \n"
+    "    do                                                                         \n"
+    "    {                                                                          \n"
+    "        assumed = old;                                                         \n"
+    "        old = atomic_cmpxchg((volatile __global uint*)p, assumed,              \n"
+    "                             as_uint(as_float(assumed) + value));              \n"
+    "    } while (old != assumed);                                                  \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "void atomic_add_local(volatile __local float* p, float value)                  \n"
+    "{                                                                              \n"
+    "    uint old = as_uint(*p);                                                    \n"
+    "    uint assumed;                                                              \n"
+    "    do                                                                         \n"
+    "    {                                                                          \n"
+    "        assumed = old;                                                         \n"
+    "        old = atomic_cmpxchg((volatile __local uint*)p, assumed,               \n"
+    "                             as_uint(as_float(assumed) + value));              \n"
+    "    } while (old != assumed);                                                  \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Weighted sums of blurring mean shift, where the points are their own        \n"
+    "// reference set so the weight of a pair is the same from both ends. Each      \n"
+    "// work group takes one pair of blocks bi <= bj of the upper triangle and      \n"
+    "// every pair of points is weighted once, contributing to both points. The     \n"
+    "// contributions to block bj are summed in local memory, each work item        \n"
+    "// starting at a different point to spread the atomics, then added to the      \n"
+    "// global sums once per work group.                                            \n"
+    "//                                                                             \n"
+    "__kernel void algorithm_symmetric(                                             \n"
+    "   __global const float* input,       // points, also the reference set        \n"
+    "   const uint count,                                                           \n"
+    "   const float bandwidth,                                                      \n"
+    "   __global float* sums,              // count * DIM weighted sums, zeroed     \n"
+    "   __global float* scales,            // count sums of the weights, zeroed     \n"
+    "   __local float* tile,               // local_size points of block bj         \n"
+    "   __local float* tile_sums)          // local_size * (DIM + 1) sums of bj     \n"
+    "{                                                                              \n"
+    "    float pi = 3.14F;                                                          \n"
+    "    float base_weight = 1.0F / (bandwidth * sqrt(2.0F * pi));                  \n"
+    "    float point[DIM];                                                          \n"
+    "    float shift[DIM];                                                          \n"
+    "    float scale = 0.0F;                                                        \n"
+    "                                                                               \n"
+    "    uint g = get_group_id(0);                                                  \n"
+    "    uint lid = get_local_id(0);                                                \n"
+    "    uint local_size = get_local_size(0);                                       \n"
+    "                                                                               \n"
+    "    // Block pair of the work group, from its index in the upper triangle      \n"
+    "    //                                                                         \n"
+    "    uint bj = (uint)((sqrt(8.0F * g + 1.0F) - 1.0F) / 2.0F);                   \n"
+    "    while (bj * (bj + 1) / 2 > g)                                              \n"
+    "    {                                                                          \n"
+    "        bj--;                                                                  \n"
+    "    }                                                                          \n"
+    "    while ((bj + 1) * (bj + 2) / 2 <= g)                                       \n"
+    "    {                                                                          \n"
+    "        bj++;                                                                  \n"
+    "    }                                                                          \n"
+    "    uint bi = g - bj * (bj + 1) / 2;                                           \n"
+    "                                                                               \n"
+    "    uint i = bi * local_size + lid;                                            \n"
+    "    uint base = bj * local_size;                                               \n"
+    "    uint n = min(local_size, count - base);                                    \n"
+    "                                                                               \n"
+    "    for (uint t = lid; t < n * DIM; t += local_size)                           \n"
+    "    {                                                                          \n"
+    "        tile[t] = input[base * DIM + t];                                       \n"
+    "    }                                                                          \n"
+    "    for (uint t = lid; t < local_size * (DIM + 1); t += local_size)            \n"
+    "    {                                                                          \n"
+    "        tile_sums[t] = 0.0F;                                                   \n"
+    "    }                                                                          \n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);                                              \n"
+    "                                                                               \n"
+    "    if (i < count)                                                             \n"
+    "    {                                                                          \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            point[k] = input[i * DIM + k];                                     \n"
+    "            shift[k] = 0.0F;                                                   \n"
+    "        }                                                                      \n"
+    "                                                                               \n"
+    "        for (uint s = 0; s < n; s++)                                           \n"
+    "        {                                                                      \n"
+    "            uint j = (s + lid) % n;                                            \n"
+    "            if (bi == bj && base + j < i)                                      \n"
+    "            {                                                                  \n"
+    "                continue;  // weighted by work item j                          \n"
+    "            }                                                                  \n"
+    "                                                                               \n"
+    "            float dist2 = 0.0F;                                                \n"
+    "            for (uint k = 0; k < DIM; k++)                                     \n"
+    "            {                                                                  \n"
+    "                float diff = point[k] - tile[j * DIM + k];                     \n"
+    "                dist2 += diff * diff;                                          \n"
+    "            }                                                                  \n"
+    "            float weight = base_weight * exp(-0.5F * dist2 / (bandwidth * bandwidth));\n"
+    "                                                                               \n"
+    "            for (uint k = 0; k < DIM; k++)                                     \n"
+    "            {                                                                  \n"
+    "                shift[k] += tile[j * DIM + k] * weight;                        \n"
+    "            }                                                                  \n"
+    "            scale += weight;                                                   \n"
+    "                                                                               \n"
+    "            if (base + j != i)                                                 \n"
+    "            {                                                                  \n"
+    "                for (uint k = 0; k < DIM; k++)                                 \n"
+    "                {                                                              \n"
+    "                    atomic_add_local(&tile_sums[j * (DIM + 1) + k],            \n"
+    "                                     point[k] * weight);                       \n"
+    "                }                                                              \n"
+    "                atomic_add_local(&tile_sums[j * (DIM + 1) + DIM], weight);     \n"
+    "            }                                                                  \n"
+    "        }                                                                      \n"
+    "                                                                               \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            atomic_add_global(&sums[i * DIM + k], shift[k]);                   \n"
+    "        }                                                                      \n"
+    "        atomic_add_global(&scales[i], scale);                                  \n"
+    "    }                                                                          \n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);                                              \n"
+    "                                                                               \n"
+    "    for (uint j = lid; j < n; j += local_size)                                 \n"
+    "    {                                                                          \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            atomic_add_global(&sums[(base + j) * DIM + k],                     \n"
+    "                              tile_sums[j * (DIM + 1) + k]);                   \n"
+    "        }                                                                      \n"
+    "        atomic_add_global(&scales[base + j], tile_sums[j * (DIM + 1) + DIM]);  \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Turn the sums of algorithm_symmetric into the shifted points                \n"
+    "//                                                                             \n"
+    "__kernel void normalize(                                                       \n"
+    "   __global const float* sums,                                                 \n"
+    "   __global const float* scales,                                               \n"
+    "   const uint count,                                                           \n"
+    "   __global float* output)            // shifted_points                        \n"
+    "{                                                                              \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    if (i >= count)                                                            \n"
+    "    {                                                                          \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        output[i * DIM + k] = sums[i * DIM + k] / scales[i];                   \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Update rules of the seeds, numbered as ms_update                            \n"
+    "//                                                                             \n"
+    "#define UPDATE_PLAIN 0                                                         \n"
+    "#define UPDATE_RELAXED 1                                                       \n"
+    "#define UPDATE_ANDERSON 2                                                      \n"
+    "                                                                               \n"
+    "// Turn the mean of every seed into its next position. The relaxed rule goes   \n"
+    "// `relaxation` times further along the mean shift step as long as the step    \n"
+    "// keeps the direction of the previous one, and falls back to a plain step as  \n"
+    "// soon as it turns back. The Anderson rule extrapolates along the last two    \n"
+    "// steps, depth one Anderson acceleration which is the vector form of Aitken's \n"
+    "// delta squared, unless the extrapolation jumps further than the bandwidth.   \n"
+    "// Seeds whose step is at least `convergence` long are counted in `moving`.    \n"
+    "//                                                                             \n"
+    "__kernel void update(                                                          \n"
+    "   __global const float* input,       // positions of the seeds                \n"
+    "   __global float* output,            // means of the seeds, then positions    \n"
+    "   __global float* history,           // previous step and mean of each seed   \n"
+    "   const uint num_seeds,                                                       \n"
+    "   const uint rule,                   // update rule, see ms_update            \n"
+    "   const uint first,                  // the history is empty                  \n"
+    "   const float relaxation,            // over-relaxation factor                \n"
+    "   const float bandwidth,                                                      \n"
+    "   const float convergence,                                                    \n"
+    "   __global uint* moving)             // seeds which have not converged        \n"
+    "{                                                                              \n"
+    "    float step[DIM];                                                           \n"
+    "    float length2 = 0.0F;                                                      \n"
+    "    float turn = 0.0F;                                                         \n"
+    "    float delta2 = 0.0F;                                                       \n"
+    "    float delta_step = 0.0F;                                                   \n"
+    "    float omega = 1.0F;                                                        \n"
+    "    float gamma = 0.0F;                                                        \n"
+    "                                                                               \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    if (i >= num_seeds)                                                        \n"
+    "    {                                                                          \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "    __global float* previous_step = &history[i * 2 * DIM];                     \n"
+    "    __global float* previous_mean = &history[i * 2 * DIM + DIM];               \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        float delta;                                                           \n"
+    "        step[k] = output[i * DIM + k] - input[i * DIM + k];                    \n"
+    "        delta = step[k] - previous_step[k];                                    \n"
+    "        length2 += step[k] * step[k];                                          \n"
+    "        turn += step[k] * previous_step[k];                                    \n"
+    "        delta2 += delta * delta;                                               \n"
+    "        delta_step += delta * step[k];                                         \n"
+    "    }                                                                          \n"
+    "    if (length2 >= convergence * convergence)                                  \n"
+    "    {                                                                          \n"
+    "        atomic_inc(moving);                                                    \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    if (rule == UPDATE_RELAXED && !first && turn > 0.0F)                       \n"
+    "    {                                                                          \n"
+    "        omega = relaxation;                                                    \n"
+    "    }                                                                          \n"
+    "    if (rule == UPDATE_ANDERSON && !first && turn > 0.0F && delta2 > 0.0F)     \n"
+    "    {                                                                          \n"
+    "        float jump2 = 0.0F;                                                    \n"
+    "        gamma = delta_step / delta2;                                           \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            float jump = gamma * (output[i * DIM + k] - previous_mean[k]);     \n"
+    "            jump2 += jump * jump;                                              \n"
+    "        }                                                                      \n"
+    "        if (!(gamma < 0.0F && jump2 <= bandwidth * bandwidth))                 \n"
+    "        {                                                                      \n"
+    "            gamma = 0.0F;                                                      \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        float mean = output[i * DIM + k];                                      \n"
+    "        output[i * DIM + k] = input[i * DIM + k] + omega * step[k] -           \n"
+    "                              gamma * (mean - previous_mean[k]);               \n"
+    "        previous_step[k] = step[k];                                            \n"
+    "        previous_mean[k] = mean;                                               \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Synthetic data sets, numbered as ms_dataset                                 \n"
+    "//                                                                             \n"
+    "#define DATA_DIAGONAL 0                                                        \n"
+    "#define DATA_BLOBS 1                                                           \n"
+    "#define DATA_UNIFORM 2                                                         \n"
+    "#define DATA_ANISOTROPIC 3                                                     \n"
+    "#define DATA_IMAGE 4                                                           \n"
+    "#define DATA_RANGE 100.0F                                                      \n"
+    "                                                                               \n"
+    "// Counter based random numbers: every value only depends on the seed and on   \n"
+    "// its indices, so data sets are identical whatever the device or work size    \n"
+    "//                                                                             \n"
+    "uint hash(uint x)                                                              \n"
+    "{                                                                              \n"
+    "    x ^= x >> 16;                                                              \n"
+    "    x *= 0x7feb352dU;                                                          \n"
+    "    x ^= x >> 15;                                                              \n"
+    "    x *= 0x846ca68bU;                                                          \n"
+    "    x ^= x >> 16;                                                              \n"
+    "    return x;                                                                  \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "uint random_uint(uint seed, uint index, uint stream)                           \n"
+    "{                                                                              \n"
+    "    return hash(seed ^ hash(index ^ hash(stream)));                            \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Uniform in [0, 1), exact in single precision                                \n"
+    "//                                                                             \n"
+    "float random_uniform(uint seed, uint index, uint stream)                       \n"
+    "{                                                                              \n"
+    "    return (random_uint(seed, index, stream) >> 8) * (1.0F / 16777216.0F);     \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Standard normal approximated by the sum of 12 uniforms (Irwin-Hall), which  \n"
+    "// only uses correctly rounded additions unlike log() and cos()                \n"
+    "//                                                                             \n"
+    "float random_normal(uint seed, uint index, uint stream)                        \n"
+    "{                                                                              \n"
+    "    float sum = -6.0F;                                                         \n"
+    "    for (uint r = 0; r < 12; r++)                                              \n"
+    "    {                                                                          \n"
+    "        sum += random_uniform(seed, index, stream * 12 + r);                   \n"
+    "    }                                                                          \n"
+    "    return sum;                                                                \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "__kernel void generate(                                                        \n"
+    "   __global float* output,            // generated points                      \n"
+    "   const uint count,                                                           \n"
+    "   const uint type,                   // data set, see ms_dataset              \n"
+    "   const uint seed,                                                            \n"
+    "   const uint clusters)               // number of clusters or image regions   \n"
+    "{                                                                              \n"
+    "#pragma OPENCL FP_CONTRACT OFF                                                 \n"
+    "    uint i = get_global_id(0);                                                 \n"
+    "    if (i >= count)                                                            \n"
+    "    {                                                                          \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    // Streams of the random numbers: 0 picks the cluster, 1 + k the noise of  \n"
+    "    // dimension k, 1 + DIM + ... the cluster centers, spreads and sites       \n"
+    "    //                                                                         \n"
+    "    uint cluster = random_uint(seed, i, 0) % clusters;                         \n"
+    "    uint centers = 1 + DIM;                                                    \n"
+    "                                                                               \n"
+    "    if (type == DATA_DIAGONAL)                                                 \n"
+    "    {                                                                          \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            output[i * DIM + k] = (float)i;                                    \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "    else if (type == DATA_UNIFORM)                                             \n"
+    "    {                                                                          \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            output[i * DIM + k] = DATA_RANGE * random_uniform(seed, i, 1 + k); \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "    else if (type == DATA_BLOBS || type == DATA_ANISOTROPIC)                   \n"
+    "    {                                                                          \n"
+    "        // Isotropic blobs have a spread of 2, anisotropic clusters draw a     \n"
+    "        // spread in [0.5, 5) per dimension and shear each dimension along the \n"
+    "        // previous one                                                        \n"
+    "        //                                                                     \n"
+    "        float previous = 0.0F;                                                 \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            float center = DATA_RANGE * random_uniform(seed, cluster, centers + k);\n"
+    "            float noise = random_normal(seed, i, 1 + k);                       \n"
+    "            float value;                                                       \n"
+    "            if (type == DATA_BLOBS)                                            \n"
+    "            {                                                                  \n"
+    "                value = center + 2.0F * noise;                                 \n"
+    "            }                                                                  \n"
+    "            else                                                               \n"
+    "            {                                                                  \n"
+    "                float spread = 0.5F + 4.5F * random_uniform(seed, cluster, centers + DIM + k);\n"
+    "                value = center + spread * noise + 0.5F * previous;             \n"
+    "                previous = spread * noise;                                     \n"
+    "            }                                                                  \n"
+    "            output[i * DIM + k] = value;                                       \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "    else if (type == DATA_IMAGE)                                               \n"
+    "    {                                                                          \n"
+    "        // Pixels of a square image: the first two dimensions are the pixel    \n"
+    "        // position, the others a color that is constant over the Voronoi      \n"
+    "        // regions of `clusters` random sites, plus noise                      \n"
+    "        //                                                                     \n"
+    "        uint width = (uint)sqrt((float)count);                                 \n"
+    "        while (width * width < count)                                          \n"
+    "        {                                                                      \n"
+    "            width++;                                                           \n"
+    "        }                                                                      \n"
+    "        float scale = DATA_RANGE / width;                                      \n"
+    "        float x = (i % width) * scale;                                         \n"
+    "        float y = (i / width) * scale;                                         \n"
+    "        float nearest = INFINITY;                                              \n"
+    "        uint region = 0;                                                       \n"
+    "        for (uint c = 0; c < clusters; c++)                                    \n"
+    "        {                                                                      \n"
+    "            float dx = x - DATA_RANGE * random_uniform(seed, c, centers);      \n"
+    "            float dy = y - DATA_RANGE * random_uniform(seed, c, centers + 1);  \n"
+    "            float dist2 = dx * dx + dy * dy;                                   \n"
+    "            if (dist2 < nearest)                                               \n"
+    "            {                                                                  \n"
+    "                nearest = dist2;                                               \n"
+    "                region = c;                                                    \n"
+    "            }                                                                  \n"
+    "        }                                                                      \n"
+    "                                                                               \n"
+    "        for (uint k = 0; k < DIM; k++)                                         \n"
+    "        {                                                                      \n"
+    "            float value = k == 0 ? x : y;                                      \n"
+    "            if (k >= 2)                                                        \n"
+    "            {                                                                  \n"
+    "                float color = DATA_RANGE * random_uniform(seed, region, centers + 2 + k);\n"
+    "                value = color + 2.0F * random_normal(seed, i, 1 + k);          \n"
+    "            }                                                                  \n"
+    "            output[i * DIM + k] = value;                                       \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "                                                                               \n"
+    "// Bin seeding: every point is counted in the cell of size `cell` of a grid    \n"
+    "// it falls in, the cells being the slots of an open addressing hash table.    \n"
+    "// The first point of a cell claims a slot and the other points of the cell    \n"
+    "// recognise it by computing the cell of that point again, so the table only   \n"
+    "// holds a point index and a count per slot.                                   \n"
+    "//                                                                             \n"
+    "int cell_of(float value, float cell)                                           \n"
+    "{                                                                              \n"
+    "    return (int)round(value / cell);                                           \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "uint hash_cell(__global const float* points, uint p, float cell)               \n"
+    "{                                                                              \n"
+    "    uint h = 0x9e3779b9U;                                                      \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        h = hash(h ^ (uint)cell_of(points[p * DIM + k], cell));                \n"
+    "    }                                                                          \n"
+    "    return h;                                                                  \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "int same_cell(__global const float* points, uint p, uint q, float cell)        \n"
+    "{                                                                              \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        if (cell_of(points[p * DIM + k], cell) !=                              \n"
+    "            cell_of(points[q * DIM + k], cell))                                \n"
+    "        {                                                                      \n"
+    "            return 0;                                                          \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "    return 1;                                                                  \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "__kernel void bin_points(                                                      \n"
+    "   __global const float* points,                                               \n"
+    "   const uint count,                                                           \n"
+    "   const float cell,                  // size of the cells of the grid         \n"
+    "   __global uint* owners,             // point + 1 owning each slot, 0 if free \n"
+    "   __global uint* counts,             // points in the cell of each slot       \n"
+    "   const uint table_mask)             // number of slots - 1, a power of two   \n"
+    "{                                                                              \n"
+    "    uint i = get_global_id(0);                                                 \n"
+    "    if (i >= count)                                                            \n"
+    "    {                                                                          \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    uint slot = hash_cell(points, i, cell) & table_mask;                       \n"
+    "    for (uint probe = 0; probe <= table_mask; probe++)                         \n"
+    "    {                                                                          \n"
+    "        uint owner = atomic_cmpxchg(&owners[slot], 0, i + 1);                  \n"
+    "        if (owner == 0 || same_cell(points, owner - 1, i, cell))               \n"
+    "        {                                                                      \n"
+    "            atomic_inc(&counts[slot]);                                         \n"
+    "            return;                                                            \n"
+    "        }                                                                      \n"
+    "        slot = (slot + 1) & table_mask;                                        \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Turn every cell holding at least min_count points into a seed at the        \n"
+    "// center of the cell, in no particular order                                  \n"
+    "//                                                                             \n"
+    "__kernel void bin_seeds(                                                       \n"
+    "   __global const float* points,                                               \n"
+    "   const float cell,                                                           \n"
+    "   __global const uint* owners,                                                \n"
+    "   __global const uint* counts,                                                \n"
+    "   const uint table_size,                                                      \n"
+    "   const uint min_count,              // fewest points of a cell kept          \n"
+    "   __global float* seeds,             // centers of the kept cells             \n"
+    "   __global uint* num_seeds)          // number of kept cells                  \n"
+    "{                                                                              \n"
+    "    uint slot = get_global_id(0);                                              \n"
+    "    if (slot >= table_size || counts[slot] < min_count || counts[slot] == 0)   \n"
+    "    {                                                                          \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    uint s = atomic_inc(num_seeds);                                            \n"
+    "    uint p = owners[slot] - 1;                                                 \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        seeds[s * DIM + k] = cell_of(points[p * DIM + k], cell) * cell;        \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Basin memoization: every position a trajectory goes through is recorded     \n"
+    "// in a hash table of cells of size `radius`, the first trajectory reaching a  \n"
+    "// cell owning it. A trajectory which lands within `radius` of a recorded      \n"
+    "// position of a converged trajectory stops and takes over its final position. \n"
+    "// The lookup is approximate: it only probes the cell of the new position, so  \n"
+    "// a converged trajectory within `radius` but across a cell border is missed   \n"
+    "// and the seed keeps moving until it converges or meets one in its own cell.  \n"
+    "// Probing the 3^DIM neighbouring cells would cost more than it saves.         \n"
+    "// The active seeds are compacted at every iteration, so that the next one     \n"
+    "// only shifts those still moving. A lookup only trusts trajectories done in   \n"
+    "// an earlier launch, and slots claimed during a launch belong to active       \n"
+    "// trajectories, so no lookup depends on a write of the same launch.           \n"
+    "//                                                                             \n"
+    "#define MEMO_PROBES 16                                                         \n"
+    "                                                                               \n"
+    "__kernel void memoize(                                                         \n"
+    "   __global const float* positions,   // positions of the active seeds         \n"
+    "   __global const float* next,        // their positions after the update      \n"
+    "   __global const float* history,     // their update history                  \n"
+    "   __global const uint* origin,       // their index in the seed set           \n"
+    "   const uint num_active,                                                      \n"
+    "   const uint iteration,              // the seed set itself is active at 0    \n"
+    "   const float convergence,                                                    \n"
+    "   const float radius,                // memoization radius, size of a cell    \n"
+    "   __global uint* keys,               // cell hash of each slot, 0 if free     \n"
+    "   __global uint* owners,             // seed + 1 owning each slot             \n"
+    "   __global float* path,              // position recorded in each slot        \n"
+    "   const uint table_mask,             // number of slots - 1, a power of two   \n"
+    "   __global uint* done,               // iteration + 1 a seed stopped at       \n"
+    "   __global float* results,           // latest position of every seed         \n"
+    "   __global float* active_positions,  // compacted seeds still moving          \n"
+    "   __global float* active_history,                                             \n"
+    "   __global uint* active_origin,                                               \n"
+    "   __global uint* num_moving)         // number of compacted seeds             \n"
+    "{                                                                              \n"
+    "    uint j = get_global_id(0);                                                 \n"
+    "    if (j >= num_active)                                                       \n"
+    "    {                                                                          \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    uint seed = iteration ? origin[j] : j;                                     \n"
+    "    float length2 = 0.0F;                                                      \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        float step = next[j * DIM + k] - positions[j * DIM + k];               \n"
+    "        length2 += step * step;                                                \n"
+    "        results[seed * DIM + k] = next[j * DIM + k];                           \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    uint h = hash_cell(next, j, radius);                                       \n"
+    "    uint key = h ? h : 1;                                                      \n"
+    "    uint slot = h & table_mask;                                                \n"
+    "    if (length2 < convergence * convergence)                                   \n"
+    "    {                                                                          \n"
+    "        done[seed] = iteration + 1;                                            \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint probe = 0; probe < MEMO_PROBES; probe++)                         \n"
+    "    {                                                                          \n"
+    "        uint claimed = atomic_cmpxchg(&keys[slot], 0, key);                    \n"
+    "        if (claimed == 0)                                                      \n"
+    "        {                                                                      \n"
+    "            for (uint k = 0; k < DIM; k++)                                     \n"
+    "            {                                                                  \n"
+    "                path[slot * DIM + k] = next[j * DIM + k];                      \n"
+    "            }                                                                  \n"
+    "            owners[slot] = seed + 1;                                           \n"
+    "            break;                                                             \n"
+    "        }                                                                      \n"
+    "        if (claimed == key)                                                    \n"
+    "        {                                                                      \n"
+    "            uint owner = owners[slot];                                         \n"
+    "            float dist2 = 0.0F;                                                \n"
+    "            for (uint k = 0; k < DIM; k++)                                     \n"
+    "            {                                                                  \n"
+    "                float diff = next[j * DIM + k] - path[slot * DIM + k];         \n"
+    "                dist2 += diff * diff;                                          \n"
+    "            }                                                                  \n"
+    "            uint owner_done = owner ? done[owner - 1] : 0;                     \n"
+    "            if (owner_done && owner_done <= iteration &&                       \n"
+    "                dist2 <= radius * radius)                                      \n"
+    "            {                                                                  \n"
+    "                for (uint k = 0; k < DIM; k++)                                 \n"
+    "                {                                                              \n"
+    "                    results[seed * DIM + k] = results[(owner - 1) * DIM + k];  \n"
+    "                }                                                              \n"
+    "                done[seed] = iteration + 1;                                    \n"
+    "                return;                                                        \n"
+    "            }                                                                  \n"
+    "            break;                                                             \n"
+    "        }                                                                      \n"
+    "        slot = (slot + 1) & table_mask;                                        \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    uint a = atomic_inc(num_moving);                                           \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        active_positions[a * DIM + k] = next[j * DIM + k];                     \n"
+    "        active_history[a * 2 * DIM + k] = history[j * 2 * DIM + k];            \n"
+    "        active_history[a * 2 * DIM + DIM + k] = history[j * 2 * DIM + DIM + k];\n"
+    "    }                                                                          \n"
+    "    active_origin[a] = seed;                                                   \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Quick shift: the density of every point is the sum of the same gaussian     \n"
+    "// weights as the mean shift, over every point staged through local memory     \n"
+    "//                                                                             \n"
+    "__kernel void density(                                                         \n"
+    "   __global const float* points,                                               \n"
+    "   const uint count,                                                           \n"
+    "   const float bandwidth,                                                      \n"
+    "   __global float* densities,         // kernel density estimate of each point \n"
+    "   __local float* tile)               // local_size points                     \n"
+    "{                                                                              \n"
+    "    float pi = 3.14F;                                                          \n"
+    "    float base_weight = 1.0F / (bandwidth * sqrt(2.0F * pi));                  \n"
+    "    float point[DIM];                                                          \n"
+    "    float scale = 0.0F;                                                        \n"
+    "                                                                               \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    uint lid = get_local_id(0);                                                \n"
+    "    uint local_size = get_local_size(0);                                       \n"
+    "    size_t p = i < count ? i : count - 1;                                      \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        point[k] = points[p * DIM + k];                                        \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint base = 0; base < count; base += local_size)                      \n"
+    "    {                                                                          \n"
+    "        uint n = min(local_size, count - base);                                \n"
+    "                                                                               \n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);                                          \n"
+    "        for (uint t = lid; t < n * DIM; t += local_size)                       \n"
+    "        {                                                                      \n"
+    "            tile[t] = points[base * DIM + t];                                  \n"
+    "        }                                                                      \n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);                                          \n"
+    "                                                                               \n"
+    "        for (uint j = 0; j < n; j++)                                           \n"
+    "        {                                                                      \n"
+    "            float dist2 = 0.0F;                                                \n"
+    "            for (uint k = 0; k < DIM; k++)                                     \n"
+    "            {                                                                  \n"
+    "                float diff = point[k] - tile[j * DIM + k];                     \n"
+    "                dist2 += diff * diff;                                          \n"
+    "            }                                                                  \n"
+    "            scale += base_weight *                                             \n"
+    "                     exp(-0.5F * dist2 / (bandwidth * bandwidth));             \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    if (i < count)                                                             \n"
+    "    {                                                                          \n"
+    "        densities[i] = scale / count;                                          \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Link every point to its nearest neighbour of higher density closer than     \n"
+    "// max_distance, or to itself when it has none and is a mode. Densities are    \n"
+    "// ordered along with the indices, so that equal densities cannot form cycles. \n"
+    "//                                                                             \n"
+    "__kernel void link_points(                                                     \n"
+    "   __global const float* points,                                               \n"
+    "   const uint count,                                                           \n"
+    "   __global const float* densities,                                            \n"
+    "   const float max_distance,                                                   \n"
+    "   __global uint* parents,            // parent of each point in the forest    \n"
+    "   __local float* tile)               // local_size points and densities       \n"
+    "{                                                                              \n"
+    "    float point[DIM];                                                          \n"
+    "    float best = max_distance * max_distance;                                  \n"
+    "                                                                               \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    uint lid = get_local_id(0);                                                \n"
+    "    uint local_size = get_local_size(0);                                       \n"
+    "    size_t p = i < count ? i : count - 1;                                      \n"
+    "    float density = densities[p];                                              \n"
+    "    uint parent = p;                                                           \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        point[k] = points[p * DIM + k];                                        \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint base = 0; base < count; base += local_size)                      \n"
+    "    {                                                                          \n"
+    "        uint n = min(local_size, count - base);                                \n"
+    "                                                                               \n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);                                          \n"
+    "        for (uint t = lid; t < n * DIM; t += local_size)                       \n"
+    "        {                                                                      \n"
+    "            tile[t] = points[base * DIM + t];                                  \n"
+    "        }                                                                      \n"
+    "        for (uint t = lid; t < n; t += local_size)                             \n"
+    "        {                                                                      \n"
+    "            tile[n * DIM + t] = densities[base + t];                           \n"
+    "        }                                                                      \n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);                                          \n"
+    "                                                                               \n"
+    "        for (uint j = 0; j < n; j++)                                           \n"
+    "        {                                                                      \n"
+    "            float other = tile[n * DIM + j];                                   \n"
+    "            if (other < density || (other == density && base + j <= p))        \n"
+    "            {                                                                  \n"
+    "                continue;                                                      \n"
+    "            }                                                                  \n"
+    "                                                                               \n"
+    "            float dist2 = 0.0F;                                                \n"
+    "            for (uint k = 0; k < DIM; k++)                                     \n"
+    "            {                                                                  \n"
+    "                float diff = point[k] - tile[j * DIM + k];                     \n"
+    "                dist2 += diff * diff;                                          \n"
+    "            }                                                                  \n"
+    "            if (dist2 < best)                                                  \n"
+    "            {                                                                  \n"
+    "                best = dist2;                                                  \n"
+    "                parent = base + j;                                             \n"
+    "            }                                                                  \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    if (i < count)                                                             \n"
+    "    {                                                                          \n"
+    "        parents[i] = parent;                                                   \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Bandwidth of every point for the adaptive variant, the distance to its      \n"
+    "// k-th nearest neighbour, at least min_bandwidth. Each work item keeps the    \n"
+    "// k smallest squared distances seen so far sorted in private memory, and      \n"
+    "// the points go through local memory tile by tile.                            \n"
+    "//                                                                             \n"
+    "#define MAX_KNN 64                                                             \n"
+    "                                                                               \n"
+    "__kernel void knn_bandwidth(                                                   \n"
+    "   __global const float* points,                                               \n"
+    "   const uint count,                                                           \n"
+    "   const uint k_nearest,              // at most MAX_KNN                       \n"
+    "   const float min_bandwidth,                                                  \n"
+    "   __global float* bandwidths,        // bandwidth of each point               \n"
+    "   __local float* tile)               // local_size points                     \n"
+    "{                                                                              \n"
+    "    float point[DIM];                                                          \n"
+    "    float nearest[MAX_KNN];                                                    \n"
+    "                                                                               \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    uint lid = get_local_id(0);                                                \n"
+    "    uint local_size = get_local_size(0);                                       \n"
+    "    size_t p = i < count ? i : count - 1;                                      \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        point[k] = points[p * DIM + k];                                        \n"
+    "    }                                                                          \n"
+    "    for (uint n = 0; n < k_nearest; n++)                                       \n"
+    "    {                                                                          \n"
+    "        nearest[n] = INFINITY;                                                 \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint base = 0; base < count; base += local_size)                      \n"
+    "    {                                                                          \n"
+    "        uint n = min(local_size, count - base);                                \n"
+    "                                                                               \n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);                                          \n"
+    "        for (uint t = lid; t < n * DIM; t += local_size)                       \n"
+    "        {                                                                      \n"
+    "            tile[t] = points[base * DIM + t];                                  \n"
+    "        }                                                                      \n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);                                          \n"
+    "                                                                               \n"
+    "        for (uint j = 0; j < n; j++)                                           \n"
+    "        {                                                                      \n"
+    "            float dist2 = 0.0F;                                                \n"
+    "            uint slot = k_nearest - 1;                                         \n"
+    "            for (uint k = 0; k < DIM; k++)                                     \n"
+    "            {                                                                  \n"
+    "                float diff = point[k] - tile[j * DIM + k];                     \n"
+    "                dist2 += diff * diff;                                          \n"
+    "            }                                                                  \n"
+    "            if (base + j == p || dist2 >= nearest[slot])                       \n"
+    "            {                                                                  \n"
+    "                continue;                                                      \n"
+    "            }                                                                  \n"
+    "                                                                               \n"
+    "            // Insertion into the sorted distances, dropping the largest       \n"
+    "            //                                                                 \n"
+    "            while (slot > 0 && nearest[slot - 1] > dist2)                      \n"
+    "            {                                                                  \n"
+    "                nearest[slot] = nearest[slot - 1];                             \n"
+    "                slot--;                                                        \n"
+    "            }                                                                  \n"
+    "            nearest[slot] = dist2;                                             \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    if (i < count)                                                             \n"
+    "    {                                                                          \n"
+    "        bandwidths[i] = max(sqrt(nearest[k_nearest - 1]), min_bandwidth);      \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Subsample of num_samples points spread evenly over the count points, for    \n"
+    "// the bandwidth estimators                                                    \n"
+    "//                                                                             \n"
+    "__kernel void sample_points(                                                   \n"
+    "   __global const float* points,                                               \n"
+    "   const uint count,                                                           \n"
+    "   const uint num_samples,                                                     \n"
+    "   __global float* samples)           // num_samples points                    \n"
+    "{                                                                              \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    if (i >= num_samples)                                                      \n"
+    "    {                                                                          \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    size_t p = (size_t)((ulong)i * count / num_samples);                       \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        samples[i * DIM + k] = points[p * DIM + k];                            \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Distance of every sample to its k-th nearest sample, itself included,       \n"
+    "// which the quantile estimator averages. k can be a large fraction of the     \n"
+    "// samples, so instead of keeping the k nearest the work item bisects the      \n"
+    "// bits of the squared distance, which order like unsigned integers: each      \n"
+    "// step counts the samples within the middle distance, the tile of samples     \n"
+    "// going through local memory, until the smallest distance with k samples      \n"
+    "// within is found. Every work item runs the same steps to keep the            \n"
+    "// barriers uniform.                                                           \n"
+    "//                                                                             \n"
+    "#define BISECTION_STEPS 31                                                     \n"
+    "                                                                               \n"
+    "__kernel void knn_quantile(                                                    \n"
+    "   __global const float* samples,                                              \n"
+    "   const uint num_samples,                                                     \n"
+    "   const uint k_nearest,              // at most num_samples                   \n"
+    "   __global float* distances,         // distance to the k-th nearest          \n"
+    "   __local float* tile)               // local_size samples                    \n"
+    "{                                                                              \n"
+    "    float point[DIM];                                                          \n"
+    "    uint low = 0;                                                              \n"
+    "    uint high = as_uint(INFINITY);                                             \n"
+    "                                                                               \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    uint lid = get_local_id(0);                                                \n"
+    "    uint local_size = get_local_size(0);                                       \n"
+    "    size_t p = i < num_samples ? i : num_samples - 1;                          \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        point[k] = samples[p * DIM + k];                                       \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint step = 0; step < BISECTION_STEPS; step++)                        \n"
+    "    {                                                                          \n"
+    "        uint middle = low + (high - low) / 2;                                  \n"
+    "        uint within = 0;                                                       \n"
+    "                                                                               \n"
+    "        for (uint base = 0; base < num_samples; base += local_size)            \n"
+    "        {                                                                      \n"
+    "            uint n = min(local_size, num_samples - base);                      \n"
+    "                                                                               \n"
+    "            barrier(CLK_LOCAL_MEM_FENCE);                                      \n"
+    "            for (uint t = lid; t < n * DIM; t += local_size)                   \n"
+    "            {                                                                  \n"
+    "                tile[t] = samples[base * DIM + t];                             \n"
+    "            }                                                                  \n"
+    "            barrier(CLK_LOCAL_MEM_FENCE);                                      \n"
+    "                                                                               \n"
+    "            for (uint j = 0; j < n; j++)                                       \n"
+    "            {                                                                  \n"
+    "                float dist2 = 0.0F;                                            \n"
+    "                for (uint k = 0; k < DIM; k++)                                 \n"
+    "                {                                                              \n"
+    "                    float diff = point[k] - tile[j * DIM + k];                 \n"
+    "                    dist2 += diff * diff;                                      \n"
+    "                }                                                              \n"
+    "                within += as_uint(dist2) <= middle;                            \n"
+    "            }                                                                  \n"
+    "        }                                                                      \n"
+    "                                                                               \n"
+    "        if (within >= k_nearest)                                               \n"
+    "        {                                                                      \n"
+    "            high = middle;                                                     \n"
+    "        }                                                                      \n"
+    "        else                                                                   \n"
+    "        {                                                                      \n"
+    "            low = middle + 1;                                                  \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    if (i < num_samples)                                                       \n"
+    "    {                                                                          \n"
+    "        distances[i] = sqrt(as_float(high));                                   \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Whiten the points for a full bandwidth matrix H = L L^T: every point is     \n"
+    "// multiplied by the inverse of the lower triangular Cholesky factor L, so     \n"
+    "// that the squared Mahalanobis distances under H become plain squared         \n"
+    "// distances and the mean shift runs with a bandwidth of 1                     \n"
+    "//                                                                             \n"
+    "__kernel void whiten(                                                          \n"
+    "   __global const float* points,                                               \n"
+    "   const uint count,                                                           \n"
+    "   __global const float* inverse,     // DIM * DIM, row major, lower           \n"
+    "   __global float* output)            // whitened points                       \n"
+    "{                                                                              \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    if (i >= count)                                                            \n"
+    "    {                                                                          \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint r = 0; r < DIM; r++)                                             \n"
+    "    {                                                                          \n"
+    "        float sum = 0.0F;                                                      \n"
+    "        for (uint c = 0; c <= r; c++)                                          \n"
+    "        {                                                                      \n"
+    "            sum += inverse[r * DIM + c] * points[i * DIM + c];                 \n"
+    "        }                                                                      \n"
+    "        output[i * DIM + r] = sum;                                             \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Label every point with its nearest mode, the modes being staged through     \n"
+    "// local memory one tile of local_size modes at a time                         \n"
+    "//                                                                             \n"
+    "__kernel void assign(                                                          \n"
+    "   __global const float* points,                                               \n"
+    "   const uint count,                                                           \n"
+    "   __global const float* modes,                                                \n"
+    "   const uint num_modes,                                                       \n"
+    "   __global uint* labels,             // nearest mode of each point of the     \n"
+    "   __global float* distances,         // share, and the distance to it         \n"
+    "   __local float* tile)               // local_size modes                      \n"
+    "{                                                                              \n"
+    "    float point[DIM];                                                          \n"
+    "    float best = INFINITY;                                                     \n"
+    "    uint label = 0;                                                            \n"
+    "                                                                               \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    uint lid = get_local_id(0);                                                \n"
+    "    uint local_size = get_local_size(0);                                       \n"
+    "    size_t p = i < count ? i : count - 1;                                      \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        point[k] = points[p * DIM + k];                                        \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint base = 0; base < num_modes; base += local_size)                  \n"
+    "    {                                                                          \n"
+    "        uint n = min(local_size, num_modes - base);                            \n"
+    "                                                                               \n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);                                          \n"
+    "        for (uint t = lid; t < n * DIM; t += local_size)                       \n"
+    "        {                                                                      \n"
+    "            tile[t] = modes[base * DIM + t];                                   \n"
+    "        }                                                                      \n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);                                          \n"
+    "                                                                               \n"
+    "        for (uint j = 0; j < n; j++)                                           \n"
+    "        {                                                                      \n"
+    "            float dist2 = 0.0F;                                                \n"
+    "            for (uint k = 0; k < DIM; k++)                                     \n"
+    "            {                                                                  \n"
+    "                float diff = point[k] - tile[j * DIM + k];                     \n"
+    "                dist2 += diff * diff;                                          \n"
+    "            }                                                                  \n"
+    "            if (dist2 < best)                                                  \n"
+    "            {                                                                  \n"
+    "                best = dist2;                                                  \n"
+    "                label = base + j;                                              \n"
+    "            }                                                                  \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    if (i < count)                                                             \n"
+    "    {                                                                          \n"
+    "        labels[i - get_global_offset(0)] = label;                              \n"
+    "        distances[i - get_global_offset(0)] = sqrt(best);                      \n"
+    "    }                                                                          \n"
+    "}                                                                              \n"
+    "                                                                               \n"
+    "// Same as assign for many modes: the modes are sorted by their cell in a      \n"
+    "// grid over their first two coordinates (one when DIM is 1), and each point   \n"
+    "// searches rings of cells around its own until no mode beyond the rings can   \n"
+    "// be closer than the nearest one found. Modes in cells r + 1 away are at      \n"
+    "// least r cells away along one of the grid coordinates.                       \n"
+    "//                                                                             \n"
+    "#define GRID_DIMS (DIM < 2 ? DIM : 2)                                          \n"
+    "                                                                               \n"
+    "__kernel void assign_grid(                                                     \n"
+    "   __global const float* points,                                               \n"
+    "   const uint count,                                                           \n"
+    "   __global const float* modes,       // modes sorted by cell                  \n"
+    "   __global const uint* mode_index,   // original index of each sorted mode    \n"
+    "   __global const uint* cell_start,   // first sorted mode of each cell        \n"
+    "   const uint width,                  // cells along the first coordinate      \n"
+    "   const uint height,                 // cells along the second coordinate     \n"
+    "   const float origin_x,              // corner of the grid                    \n"
+    "   const float origin_y,                                                       \n"
+    "   const float cell,                  // size of the cells                     \n"
+    "   __global uint* labels,             // nearest mode of each point of the     \n"
+    "   __global float* distances)         // share, and the distance to it         \n"
+    "{                                                                              \n"
+    "    float point[DIM];                                                          \n"
+    "    float best = INFINITY;                                                     \n"
+    "    uint label = 0;                                                            \n"
+    "                                                                               \n"
+    "    size_t i = get_global_id(0);                                               \n"
+    "    if (i >= count)                                                            \n"
+    "    {                                                                          \n"
+    "        return;                                                                \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    for (uint k = 0; k < DIM; k++)                                             \n"
+    "    {                                                                          \n"
+    "        point[k] = points[i * DIM + k];                                        \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    int cx = (int)floor((point[0] - origin_x) / cell);                         \n"
+    "    int cy = 0;                                                                \n"
+    "    if (GRID_DIMS > 1)                                                         \n"
+    "    {                                                                          \n"
+    "        cy = (int)floor((point[GRID_DIMS - 1] - origin_y) / cell);             \n"
+    "    }                                                                          \n"
+    "    int max_r = max(max(cx, (int)width - 1 - cx),                              \n"
+    "                    max(cy, (int)height - 1 - cy));                            \n"
+    "                                                                               \n"
+    "    for (int r = 0; r <= max_r; r++)                                           \n"
+    "    {                                                                          \n"
+    "        float reach = (r - 1) * cell;                                          \n"
+    "        if (r > 0 && best <= reach * reach)                                    \n"
+    "        {                                                                      \n"
+    "            break;                                                             \n"
+    "        }                                                                      \n"
+    "                                                                               \n"
+    "        for (int dy = -r; dy <= r; dy++)                                       \n"
+    "        {                                                                      \n"
+    "            int y = cy + dy;                                                   \n"
+    "            int step = r == 0 || dy == -r || dy == r ? 1 : 2 * r;              \n"
+    "            if (y < 0 || y >= (int)height)                                     \n"
+    "            {                                                                  \n"
+    "                continue;                                                      \n"
+    "            }                                                                  \n"
+    "                                                                               \n"
+    "            for (int dx = -r; dx <= r; dx += step)                             \n"
+    "            {                                                                  \n"
+    "                int x = cx + dx;                                               \n"
+    "                if (x < 0 || x >= (int)width)                                  \n"
+    "                {                                                              \n"
+    "                    continue;                                                  \n"
+    "                }                                                              \n"
+    "                                                                               \n"
+    "                uint c = y * width + x;                                        \n"
+    "                for (uint m = cell_start[c]; m < cell_start[c + 1]; m++)       \n"
+    "                {                                                              \n"
+    "                    float dist2 = 0.0F;                                        \n"
+    "                    for (uint k = 0; k < DIM; k++)                             \n"
+    "                    {                                                          \n"
+    "                        float diff = point[k] - modes[m * DIM + k];            \n"
+    "                        dist2 += diff * diff;                                  \n"
+    "                    }                                                          \n"
+    "                    if (dist2 < best ||                                        \n"
+    "                        (dist2 == best && mode_index[m] < label))              \n"
+    "                    {                                                          \n"
+    "                        best = dist2;                                          \n"
+    "                        label = mode_index[m];                                 \n"
+    "                    }                                                          \n"
+    "                }                                                              \n"
+    "            }                                                                  \n"
+    "        }                                                                      \n"
+    "    }                                                                          \n"
+    "                                                                               \n"
+    "    labels[i - get_global_offset(0)] = label;                                  \n"
+    "    distances[i - get_global_offset(0)] = sqrt(best);                          \n"
+    "}                                                                              \n"
+    "\n";
+////////////////////////////////////////////////////////////////////////////////
+
+const char *DeviceModeNames[MS_NUM_DEVICE_MODES] = {"gpu", "cpu", "all", "numa"};
+const char *VariantNames[MS_NUM_VARIANTS] = {"naive", "tiled", "symmetric", "adaptive"};
+const char *DatasetNames[MS_NUM_DATASETS] = {"diagonal", "blobs", "uniform", "anisotropic", "image"};
+const char *UpdateNames[MS_NUM_UPDATES] = {"plain", "relaxed", "anderson"};
+const char *EstimatorNames[MS_NUM_ESTIMATORS] = {"scott", "silverman", "quantile"};
+
+static const char *KernelNames[MS_NUM_VARIANTS] = {"algorithm", "algorithm_tiled", "algorithm_symmetric",
+                                                   "algorithm_adaptive"};
+
+int ms_device_mode_from_name(const char *name)
+{
+    int i;
+    for (i = 0; i < MS_NUM_DEVICE_MODES; i++)
+    {
+        if (strcmp(name, DeviceModeNames[i]) == 0) return i;
+    }
+    return -1;
+}
+
+int ms_variant_from_name(const char *name)
+{
+    int i;
+    for (i = 0; i < MS_NUM_VARIANTS; i++)
+    {
+        if (strcmp(name, VariantNames[i]) == 0) return i;
+    }
+    return -1;
+}
+
+int ms_dataset_from_name(const char *name)
+{
+    int i;
+    for (i = 0; i < MS_NUM_DATASETS; i++)
+    {
+        if (strcmp(name, DatasetNames[i]) == 0) return i;
+    }
+    return -1;
+}
+
+int ms_update_from_name(const char *name)
+{
+    int i;
+    for (i = 0; i < MS_NUM_UPDATES; i++)
+    {
+        if (strcmp(name, UpdateNames[i]) == 0) return i;
+    }
+    return -1;
+}
+
+int ms_estimator_from_name(const char *name)
+{
+    int i;
+    for (i = 0; i < MS_NUM_ESTIMATORS; i++)
+    {
+        if (strcmp(name, EstimatorNames[i]) == 0) return i;
+    }
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+cl_ulong ms_profile_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (cl_ulong)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void ms_profile_host(ms_profile *p, const char *name, cl_ulong start)
+{
+    ms_stage *stage;
+    if (!p || p->num_stages >= MAX_STAGES)
+    {
+        return;
+    }
+
+    stage = &p->stages[p->num_stages++];
+    stage->name = name;
+    stage->device = -1;
+    stage->iteration = -1;
+    stage->queued = start;
+    stage->submit = start;
+    stage->start = start;
+    stage->end = ms_profile_clock();
+}
+
+int ms_profile_write_trace(const ms_profile *p, const ms_engine *e, const char *path)
+{
+    int i;
+    cl_uint d;
+    cl_ulong origin = p->num_stages ? p->stages[0].queued : 0;
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        printf("Error: Failed to open '%s'!\n", path);
+        return -1;
+    }
+
+    for (i = 0; i < p->num_stages; i++)
+    {
+        origin = p->stages[i].queued < origin ? p->stages[i].queued : origin;
+    }
+
+    // Name the tracks, thread 0 is the host thread and thread d + 1 the queue of device d
+    //
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(file, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, "
+                  "\"args\": {\"name\": \"meanshift\"}},\n");
+    fprintf(file, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0, "
+                  "\"args\": {\"name\": \"host\"}}");
+    for (d = 0; d < e->num_devices; d++)
+    {
+        char name[128] = "";
+        clGetDeviceInfo(e->device_ids[d], CL_DEVICE_NAME, sizeof(name), name, NULL);
+        for (i = 0; name[i]; i++)
+        {
+            name[i] = (name[i] == '"' || name[i] == '\\') ? ' ' : name[i];
+        }
+        fprintf(file,
+                ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %u, "
+                "\"args\": {\"name\": \"queue %u: %s\"}}",
+                d + 1, d, name);
+    }
+
+    // One complete event per stage, in us. Device commands keep their queued and submit times as arguments, the
+    // gap up to the start shows as the idle time of the queue.
+    //
+    for (i = 0; i < p->num_stages; i++)
+    {
+        const ms_stage *stage = &p->stages[i];
+        fprintf(file, ",\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, ",
+                stage->name, stage->device < 0 ? "host" : "device", stage->device + 1);
+        fprintf(file, "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"iteration\": %d, \"queued_us\": %.3f, "
+                "\"submit_us\": %.3f}}",
+                (stage->start - origin) / 1e3, (stage->end - stage->start) / 1e3, stage->iteration,
+                (stage->queued - origin) / 1e3, (stage->submit - origin) / 1e3);
+    }
+    fprintf(file, "\n]}\n");
+
+    fclose(file);
+    return 0;
+}
+
+// Record a profiled command executed by the queue of device `d`, once it has completed
+//
+static void profile_event(ms_engine *e, const char *name, cl_uint d, int iteration, cl_event event)
+{
+    ms_profile *p = e->profile;
+    ms_stage *stage;
+    if (!p || !event || p->num_stages >= MAX_STAGES)
+    {
+        return;
+    }
+
+    stage = &p->stages[p->num_stages++];
+    stage->name = name;
+    stage->device = d;
+    stage->iteration = iteration;
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &stage->queued, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &stage->submit, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &stage->start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &stage->end, NULL);
+    stage->queued += e->clock_offset[d];
+    stage->submit += e->clock_offset[d];
+    stage->start += e->clock_offset[d];
+    stage->end += e->clock_offset[d];
+}
+
+// Block until the queue of device `d` has executed every command, recording how long the host waited for it
+//
+static void finish_queue(ms_engine *e, cl_uint d)
+{
+    cl_ulong start = ms_profile_clock();
+    clFinish(e->commands[d]);
+    ms_profile_host(e->profile, "wait", start);
+}
+
+// Host wall clock in ms, for the stages which have no profiling event
+//
+static double host_time(void)
+{
+    return ms_profile_clock() / 1000000.0;
+}
+
+// Execution time of a profiled command in ms
+//
+static double event_time(cl_event event)
+{
+    cl_ulong time_start;  // compute command queue execution time start
+    cl_ulong time_end;    // compute command queue execution time end
+
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+    return (time_end - time_start) / 1000000.0;
+}
+
+// Work group size used to execute `kernel` on a device, limited by the work group size of the kernel on the device and
+// by its local memory when every work item stages `tile_floats` floats there
+//
+static size_t work_group_size(cl_kernel kernel, cl_device_id device_id, size_t tile_floats)
+{
+    size_t local = MAX_LOCAL_SIZE;
+    size_t max_local = 0;
+    cl_ulong local_mem = 0;
+
+    clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_local), &max_local, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+    while (local > 1 && (local > max_local || local * tile_floats * sizeof(cl_float) > local_mem / 2))
+    {
+        local /= 2;
+    }
+    return local;
+}
+
+// Work group size of the compute kernel, the tiled variant staging one original point per work item and the symmetric
+// one a point and its sums
+//
+static size_t compute_group_size(ms_engine *e, cl_device_id device_id)
+{
+    size_t tile_floats = 0;
+
+    if (e->variant == MS_VARIANT_TILED)
+    {
+        tile_floats = e->dims;
+    }
+    else if (e->variant == MS_VARIANT_SYMMETRIC)
+    {
+        tile_floats = 2 * e->dims + 1;
+    }
+    return work_group_size(e->kernel, device_id, tile_floats);
+}
+
+static size_t round_up(size_t value, size_t multiple)
+{
+    return ((value + multiple - 1) / multiple) * multiple;
+}
+
+// Set the arguments of the compute kernel on device `d`, the seeds and points are either cl_mem buffers or SVM pointers
+//
+static int set_kernel_args(ms_engine *e, cl_uint d, const void *input_1, const void *input_2, size_t num_seeds,
+                           size_t num_points, cl_float bandwidth, const void *output, size_t local, int svm)
+{
+    int err = CL_SUCCESS;
+    cl_uint seeds = (cl_uint)num_seeds;
+    cl_uint points = (cl_uint)num_points;
+
+    if (!svm)
+    {
+        err |= clSetKernelArg(e->kernel, 0, sizeof(cl_mem), input_1);
+        err |= clSetKernelArg(e->kernel, 1, sizeof(cl_mem), input_2);
+        err |= clSetKernelArg(e->kernel, 5, sizeof(cl_mem), output);
+    }
+#ifdef CL_VERSION_2_0
+    else
+    {
+        err |= clSetKernelArgSVMPointer(e->kernel, 0, input_1);
+        err |= clSetKernelArgSVMPointer(e->kernel, 1, input_2);
+        err |= clSetKernelArgSVMPointer(e->kernel, 5, output);
+    }
+#endif
+    err |= clSetKernelArg(e->kernel, 2, sizeof(cl_uint), &seeds);
+    err |= clSetKernelArg(e->kernel, 3, sizeof(cl_uint), &points);
+    err |= clSetKernelArg(e->kernel, 4, sizeof(cl_float), &bandwidth);
+    if (e->variant == MS_VARIANT_TILED)
+    {
+        err |= clSetKernelArg(e->kernel, 6, sizeof(cl_float) * e->dims * local, NULL);
+    }
+    else if (e->variant == MS_VARIANT_ADAPTIVE)
+    {
+        err |= clSetKernelArg(e->kernel, 6, sizeof(cl_mem), &e->bandwidths[d]);
+    }
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to set kernel arguments! %d\n", err);
+    }
+    return err;
+}
+
+#ifdef MS_STATS
+// Pass the counters of device `d` to the compute kernel and clear them before an iteration
+//
+static int stats_begin(ms_engine *e, cl_uint d)
+{
+    cl_uint zero = 0;
+    cl_uint index = e->variant == MS_VARIANT_TILED || e->variant == MS_VARIANT_ADAPTIVE ? 7 : 6;  // after the others
+    int err;
+
+    err = clSetKernelArg(e->kernel, index, sizeof(cl_mem), &e->stats_buffers[d]);
+    err |= clSetKernelArg(e->kernel, index + 1, sizeof(cl_float), &e->tolerance);
+    err |= clEnqueueFillBuffer(e->commands[d], e->stats_buffers[d], &zero, sizeof(zero), 0,
+                               sizeof(cl_uint) * STATS_SIZE, 0, NULL, NULL);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to clear the counters! %d\n", err);
+    }
+    return err;
+}
+
+// Read the counters of device `d` back once the iteration is done, without waiting for it
+//
+static int stats_end(ms_engine *e, cl_uint d, cl_uint *counters)
+{
+    int err = clEnqueueReadBuffer(e->commands[d], e->stats_buffers[d], CL_FALSE, 0, sizeof(cl_uint) * STATS_SIZE,
+                                  counters, 0, NULL, NULL);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to read the counters! %d\n", err);
+    }
+    return err;
+}
+
+// Sum the counters of every device into the statistics of each iteration of a run over `count` points, `counters`
+// holds STATS_SIZE counters per device and per iteration
+//
+static int stats_gather(ms_engine *e, const cl_uint *counters, int iterations, size_t count)
+{
+    int it;
+    cl_uint d;
+    ms_stats *stats = realloc(e->stats, sizeof(ms_stats) * iterations);
+    if (!stats)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+    e->stats = stats;
+
+    for (it = 0; it < iterations; it++)
+    {
+        double shift_sum = 0.0;
+
+        memset(&stats[it], 0, sizeof(stats[it]));
+        for (d = 0; d < e->num_devices; d++)
+        {
+            const cl_uint *c = &counters[(it * e->num_devices + d) * STATS_SIZE];
+            float max_shift;
+
+            memcpy(&max_shift, &c[5], sizeof(max_shift));
+            stats[it].pairs += c[0] | (cl_ulong)c[1] << 32;
+            stats[it].weighted_pairs += c[2] | (cl_ulong)c[3] << 32;
+            stats[it].active += c[4];
+            stats[it].max_shift = max_shift > stats[it].max_shift ? max_shift : stats[it].max_shift;
+            shift_sum += (c[6] | (cl_ulong)c[7] << 32) / STATS_SHIFT_SCALE;
+        }
+        stats[it].mean_shift = count ? shift_sum / count : 0.0;
+    }
+    return CL_SUCCESS;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+int ms_engine_create(ms_engine *e, ms_device_mode mode, ms_variant variant, size_t dims, ms_profile *profile)
+{
+    int err;  // error code returned from api calls
+    cl_uint d;
+    char options[64];
+    double build_start;
+    cl_ulong stage_start = ms_profile_clock();
+
+    memset(e, 0, sizeof(*e));
+    e->variant = variant;
+    e->dims = dims;
+    e->num_devices = 1;
+    e->iterations = 1;
+    e->relaxation = 1.5F;
+    e->profile = profile;
+#ifdef MS_STATS
+    e->tolerance = 1e-3F;
+#endif
+
+    // Connect to a compute device, or to every device of the first platform
+    //
+    if (mode == MS_DEVICE_ALL)
+    {
+        cl_platform_id platform;
+        err = clGetPlatformIDs(1, &platform, NULL);
+        if (err == CL_SUCCESS)
+        {
+            err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, MAX_DEVICES, e->device_ids, &e->num_devices);
+        }
+    }
+    else if (mode == MS_DEVICE_NUMA)
+    {
+        // Split the CPU device into one sub-device per NUMA node. Machines with a single node cannot be
+        // partitioned this way and simply run on the whole device.
+        //
+        cl_device_id parent;
+        cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+                                                     CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+        err = clGetDeviceIDs(NULL, CL_DEVICE_TYPE_CPU, 1, &parent, NULL);
+        if (err == CL_SUCCESS)
+        {
+            err = clCreateSubDevices(parent, properties, MAX_DEVICES, e->device_ids, &e->num_sub_devices);
+            if (err != CL_SUCCESS)
+            {
+                printf("Warning: Failed to partition the device by NUMA node, using the whole device! %d\n", err);
+                e->device_ids[0] = parent;
+                e->num_sub_devices = 0;
+                err = CL_SUCCESS;
+            }
+            e->num_devices = e->num_sub_devices ? e->num_sub_devices : 1;
+        }
+    }
+    else
+    {
+        err = clGetDeviceIDs(NULL, mode == MS_DEVICE_GPU ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU, 1, e->device_ids,
+                             NULL);
+    }
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to create a device group! %d\n", err);
+        return err;
+    }
+    e->num_devices = e->num_devices < MAX_DEVICES ? e->num_devices : MAX_DEVICES;
+    ms_profile_host(profile, "discovery", stage_start);
+
+    // Create a compute context
+    //
+    stage_start = ms_profile_clock();
+    e->context = clCreateContext(0, e->num_devices, e->device_ids, NULL, NULL, &err);
+    if (!e->context || err != CL_SUCCESS)
+    {
+        printf("Error: Failed to create a compute context! %d\n", err);
+        return err ? err : CL_INVALID_VALUE;
+    }
+
+    // Create a command commands for every device
+    //
+    for (d = 0; d < e->num_devices; d++)
+    {
+        e->commands[d] = clCreateCommandQueue(e->context, e->device_ids[d], CL_QUEUE_PROFILING_ENABLE, &err);
+        if (!e->commands[d])
+        {
+            printf("Error: Failed to create a command commands!\n");
+            return err ? err : CL_INVALID_VALUE;
+        }
+    }
+    ms_profile_host(profile, "context", stage_start);
+
+    // Measure the offset of every device clock from the host clock with a marker, halfway through its enqueueing,
+    // so that device and host stages share one timeline
+    //
+    for (d = 0; d < e->num_devices && profile; d++)
+    {
+        cl_event marker;
+        cl_ulong before = ms_profile_clock();
+        cl_ulong after;
+        cl_ulong queued = 0;
+
+        if (clEnqueueMarkerWithWaitList(e->commands[d], 0, NULL, &marker) != CL_SUCCESS)
+        {
+            continue;
+        }
+        after = ms_profile_clock();
+        clWaitForEvents(1, &marker);
+        clGetEventProfilingInfo(marker, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL);
+        e->clock_offset[d] = (cl_long)(before + (after - before) / 2) - (cl_long)queued;
+        clReleaseEvent(marker);
+    }
+
+    // Create the compute program from the source buffer
+    //
+    e->program = clCreateProgramWithSource(e->context, 1, (const char **)&KernelSource, NULL, &err);
+    if (!e->program)
+    {
+        printf("Error: Failed to create compute program!\n");
+        return err ? err : CL_INVALID_VALUE;
+    }
+
+    // Build the program executable for the dimension of the points
+    //
+    snprintf(options, sizeof(options), "-D DIM=%zu", dims);
+#ifdef MS_STATS
+    strncat(options, " -D MS_STATS", sizeof(options) - strlen(options) - 1);
+#endif
+    stage_start = ms_profile_clock();
+    build_start = host_time();
+    err = clBuildProgram(e->program, e->num_devices, e->device_ids, options, NULL, NULL);
+    e->build_time = host_time() - build_start;
+    ms_profile_host(profile, "build", stage_start);
+    if (err != CL_SUCCESS)
+    {
+        size_t len;
+        char buffer[2048];
+
+        printf("Error: Failed to build program executable! %d\n", err);
+        for (d = 0; d < e->num_devices; d++)
+        {
+            clGetProgramBuildInfo(e->program, e->device_ids[d], CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
+            printf("%s\n", buffer);
+        }
+        return err;
+    }
+
+    // Create the compute kernel in the program we wish to run
+    //
+    stage_start = ms_profile_clock();
+    e->kernel = clCreateKernel(e->program, KernelNames[variant], &err);
+    if (!e->kernel || err != CL_SUCCESS)
+    {
+        printf("Error: Failed to create compute kernel! %d\n", err);
+        return err ? err : CL_INVALID_VALUE;
+    }
+    e->generator = clCreateKernel(e->program, "generate", &err);
+    if (!e->generator || err != CL_SUCCESS)
+    {
+        printf("Error: Failed to create compute kernel! %d\n", err);
+        return err ? err : CL_INVALID_VALUE;
+    }
+    e->binner = clCreateKernel(e->program, "bin_points", &err);
+    e->bin_seeder = e->binner ? clCreateKernel(e->program, "bin_seeds", &err) : NULL;
+    e->assigner = e->bin_seeder ? clCreateKernel(e->program, "assign", &err) : NULL;
+    e->grid_assigner = e->assigner ? clCreateKernel(e->program, "assign_grid", &err) : NULL;
+    e->normalizer = e->grid_assigner ? clCreateKernel(e->program, "normalize", &err) : NULL;
+    e->updater = e->normalizer ? clCreateKernel(e->program, "update", &err) : NULL;
+    e->memoizer = e->updater ? clCreateKernel(e->program, "memoize", &err) : NULL;
+    e->estimator = e->memoizer ? clCreateKernel(e->program, "density", &err) : NULL;
+    e->linker = e->estimator ? clCreateKernel(e->program, "link_points", &err) : NULL;
+    e->knn = e->linker ? clCreateKernel(e->program, "knn_bandwidth", &err) : NULL;
+    e->sampler = e->knn ? clCreateKernel(e->program, "sample_points", &err) : NULL;
+    e->quantiler = e->sampler ? clCreateKernel(e->program, "knn_quantile", &err) : NULL;
+    e->sweeper = e->quantiler ? clCreateKernel(e->program, "algorithm_multi", &err) : NULL;
+    e->whitener = e->sweeper ? clCreateKernel(e->program, "whiten", &err) : NULL;
+    if (!e->whitener || err != CL_SUCCESS)
+    {
+        printf("Error: Failed to create compute kernel! %d\n", err);
+        return err ? err : CL_INVALID_VALUE;
+    }
+    ms_profile_host(profile, "kernels", stage_start);
+
+#ifdef MS_STATS
+    // Create the counters of every device
+    //
+    for (d = 0; d < e->num_devices; d++)
+    {
+        e->stats_buffers[d] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_uint) * STATS_SIZE, NULL, &err);
+        if (!e->stats_buffers[d])
+        {
+            printf("Error: Failed to allocate device memory!\n");
+            return err ? err : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        }
+    }
+#endif
+
+    return CL_SUCCESS;
+}
+
+void ms_engine_release(ms_engine *e)
+{
+    cl_uint d;
+
+    if (e->kernel) clReleaseKernel(e->kernel);
+    if (e->generator) clReleaseKernel(e->generator);
+    if (e->binner) clReleaseKernel(e->binner);
+    if (e->bin_seeder) clReleaseKernel(e->bin_seeder);
+    if (e->assigner) clReleaseKernel(e->assigner);
+    if (e->grid_assigner) clReleaseKernel(e->grid_assigner);
+    if (e->normalizer) clReleaseKernel(e->normalizer);
+    if (e->updater) clReleaseKernel(e->updater);
+    if (e->memoizer) clReleaseKernel(e->memoizer);
+    if (e->estimator) clReleaseKernel(e->estimator);
+    if (e->linker) clReleaseKernel(e->linker);
+    if (e->knn) clReleaseKernel(e->knn);
+    if (e->sampler) clReleaseKernel(e->sampler);
+    if (e->quantiler) clReleaseKernel(e->quantiler);
+    if (e->sweeper) clReleaseKernel(e->sweeper);
+    if (e->whitener) clReleaseKernel(e->whitener);
+    if (e->program) clReleaseProgram(e->program);
+    for (d = 0; d < e->num_devices; d++)
+    {
+        if (e->points[d]) clReleaseMemObject(e->points[d]);
+        if (e->seeds[d]) clReleaseMemObject(e->seeds[d]);
+        if (e->bandwidths[d]) clReleaseMemObject(e->bandwidths[d]);
+#ifdef MS_STATS
+        if (e->stats_buffers[d]) clReleaseMemObject(e->stats_buffers[d]);
+#endif
+        if (e->commands[d]) clReleaseCommandQueue(e->commands[d]);
+    }
+#ifdef MS_STATS
+    free(e->stats);
+#endif
+    if (e->context) clReleaseContext(e->context);
+    for (d = 0; d < e->num_sub_devices; d++)
+    {
+        clReleaseDevice(e->device_ids[d]);
+    }
+    memset(e, 0, sizeof(*e));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Drop the bandwidths of the adaptive variant, which belong to the points being replaced
+//
+static void release_bandwidths(ms_engine *e)
+{
+    cl_uint d;
+
+    for (d = 0; d < e->num_devices; d++)
+    {
+        if (e->bandwidths[d]) clReleaseMemObject(e->bandwidths[d]);
+        e->bandwidths[d] = NULL;
+    }
+}
+
+// Allocate the per-device replicas of the points, releasing the previous ones. The replicas are migrated to their
+// device before being filled, so NUMA sub-devices end up reading node-local memory.
+//
+static int alloc_points(ms_engine *e, size_t count)
+{
+    int err = CL_SUCCESS;
+    cl_uint d;
+    cl_event migrate[MAX_DEVICES] = {0};  // per-device migration profile events
+
+    release_bandwidths(e);
+    for (d = 0; d < e->num_devices; d++)
+    {
+        if (e->points[d]) clReleaseMemObject(e->points[d]);
+
+        e->points[d] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * e->dims * count, NULL, &err);
+        if (!e->points[d])
+        {
+            printf("Error: Failed to allocate device memory!\n");
+            return err ? err : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        }
+
+        err = clEnqueueMigrateMemObjects(e->commands[d], 1, &e->points[d], CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED, 0,
+                                         NULL, &migrate[d]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to migrate device memory! %d\n", err);
+            break;
+        }
+    }
+
+    for (d = 0; d < e->num_devices; d++)
+    {
+        if (migrate[d])
+        {
+            clWaitForEvents(1, &migrate[d]);
+            profile_event(e, "migrate", d, -1, migrate[d]);
+            clReleaseEvent(migrate[d]);
+        }
+    }
+    if (err != CL_SUCCESS)
+    {
+        return err;
+    }
+    e->count = count;
+    e->upload_time = 0.0;
+    return err;
+}
+
+int ms_engine_upload(ms_engine *e, const cl_float *data, size_t count)
+{
+    int err;
+    cl_uint d;
+    cl_event write[MAX_DEVICES] = {0};  // per-device upload profile events
+
+    err = alloc_points(e, count);
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        err = clEnqueueWriteBuffer(e->commands[d], e->points[d], CL_FALSE, 0, sizeof(cl_float) * e->dims * count, data,
+                                   0, NULL, &write[d]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to write to source array! %d\n", err);
+        }
+    }
+
+    for (d = 0; d < e->num_devices; d++)
+    {
+        finish_queue(e, d);
+        if (write[d])
+        {
+            e->upload_time += event_time(write[d]);
+            profile_event(e, "write", d, -1, write[d]);
+            clReleaseEvent(write[d]);
+        }
+    }
+    return err;
+}
+
+int ms_engine_attach(ms_engine *e, const cl_float *data, size_t count)
+{
+    int err = CL_SUCCESS;
+    cl_uint d;
+    cl_event write[MAX_DEVICES] = {0};  // per-device upload profile events
+
+    // Devices which share the host memory use it in place, the others get a copy
+    //
+    release_bandwidths(e);
+    e->upload_time = 0.0;
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        cl_device_type type = 0;
+        size_t size = sizeof(cl_float) * e->dims * count;
+
+        clGetDeviceInfo(e->device_ids[d], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+        if (e->points[d]) clReleaseMemObject(e->points[d]);
+        if (type & CL_DEVICE_TYPE_CPU)
+        {
+            e->points[d] = clCreateBuffer(e->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, size, (void *)data, &err);
+        }
+        else
+        {
+            e->points[d] = clCreateBuffer(e->context, CL_MEM_READ_ONLY, size, NULL, &err);
+            if (e->points[d])
+            {
+                err = clEnqueueWriteBuffer(e->commands[d], e->points[d], CL_FALSE, 0, size, data, 0, NULL, &write[d]);
+            }
+        }
+        if (!e->points[d] || err != CL_SUCCESS)
+        {
+            printf("Error: Failed to allocate device memory! %d\n", err);
+            err = err ? err : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        }
+    }
+
+    for (d = 0; d < e->num_devices; d++)
+    {
+        if (write[d])
+        {
+            finish_queue(e, d);
+            e->upload_time += event_time(write[d]);
+            profile_event(e, "write", d, -1, write[d]);
+            clReleaseEvent(write[d]);
+        }
+    }
+
+    // A partial attach leaves no points, rather than replicas of different data sets which may wrap freed memory
+    //
+    if (err != CL_SUCCESS)
+    {
+        ms_engine_detach(e);
+        return err;
+    }
+    e->count = count;
+    return err;
+}
+
+void ms_engine_detach(ms_engine *e)
+{
+    cl_uint d;
+
+    release_bandwidths(e);
+    for (d = 0; d < e->num_devices; d++)
+    {
+        finish_queue(e, d);
+        if (e->points[d]) clReleaseMemObject(e->points[d]);
+        e->points[d] = NULL;
+    }
+    e->count = 0;
+}
+
+int ms_engine_generate(ms_engine *e, ms_dataset dataset, size_t count, cl_uint seed, cl_uint clusters)
+{
+    int err;
+    cl_uint d;
+    cl_event generate[MAX_DEVICES] = {0};  // per-device generation profile events
+    cl_uint n = (cl_uint)count;
+    cl_uint type = dataset;
+
+    // Every device generates its own replica, the generator gives identical points whatever the device
+    //
+    err = alloc_points(e, count);
+    clusters = clusters ? clusters : 1;
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        size_t local = MAX_LOCAL_SIZE;
+        size_t global = round_up(count, local);
+
+        err = clSetKernelArg(e->generator, 0, sizeof(cl_mem), &e->points[d]);
+        err |= clSetKernelArg(e->generator, 1, sizeof(cl_uint), &n);
+        err |= clSetKernelArg(e->generator, 2, sizeof(cl_uint), &type);
+        err |= clSetKernelArg(e->generator, 3, sizeof(cl_uint), &seed);
+        err |= clSetKernelArg(e->generator, 4, sizeof(cl_uint), &clusters);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to set kernel arguments! %d\n", err);
+            break;
+        }
+
+        err = clEnqueueNDRangeKernel(e->commands[d], e->generator, 1, NULL, &global, NULL, 0, NULL, &generate[d]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to execute kernel! %d\n", err);
+        }
+    }
+
+    for (d = 0; d < e->num_devices; d++)
+    {
+        finish_queue(e, d);
+        if (generate[d])
+        {
+            profile_event(e, "generate", d, -1, generate[d]);
+            clReleaseEvent(generate[d]);
+        }
+    }
+    return err;
+}
+
+int ms_engine_download(ms_engine *e, cl_float *data)
+{
+    cl_event read = NULL;
+    int err = clEnqueueReadBuffer(e->commands[0], e->points[0], CL_TRUE, 0, sizeof(cl_float) * e->dims * e->count,
+                                  data, 0, NULL, &read);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to read output array! %d\n", err);
+    }
+    if (read)
+    {
+        profile_event(e, "download", 0, -1, read);
+        clReleaseEvent(read);
+    }
+    return err;
+}
+
+int ms_engine_seed(ms_engine *e, const cl_float *seeds, size_t num_seeds)
+{
+    int err = CL_SUCCESS;
+    cl_uint d;
+    cl_event write[MAX_DEVICES] = {0};  // per-device upload profile events
+
+    for (d = 0; d < e->num_devices; d++)
+    {
+        if (e->seeds[d]) clReleaseMemObject(e->seeds[d]);
+        e->seeds[d] = NULL;
+    }
+    e->num_seeds = 0;
+
+    for (d = 0; d < e->num_devices && num_seeds && err == CL_SUCCESS; d++)
+    {
+        size_t size = sizeof(cl_float) * e->dims * num_seeds;
+
+        e->seeds[d] = clCreateBuffer(e->context, CL_MEM_READ_ONLY, size, NULL, &err);
+        if (e->seeds[d])
+        {
+            err = clEnqueueWriteBuffer(e->commands[d], e->seeds[d], CL_FALSE, 0, size, seeds, 0, NULL, &write[d]);
+        }
+        if (!e->seeds[d] || err != CL_SUCCESS)
+        {
+            printf("Error: Failed to allocate device memory! %d\n", err);
+            err = err ? err : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        }
+    }
+    if (err == CL_SUCCESS)
+    {
+        e->num_seeds = num_seeds;
+    }
+
+    for (d = 0; d < e->num_devices; d++)
+    {
+        if (write[d])
+        {
+            finish_queue(e, d);
+            profile_event(e, "seed", d, -1, write[d]);
+            clReleaseEvent(write[d]);
+        }
+    }
+    return err;
+}
+
+int ms_engine_bin_seed(ms_engine *e, cl_float cell, cl_uint min_count, cl_float *seeds)
+{
+    int err = CL_SUCCESS;
+    cl_uint zero = 0;
+    cl_uint n = (cl_uint)e->count;
+    cl_uint num_seeds = 0;
+    size_t table_size = 1;
+    cl_uint size;
+    cl_uint mask;
+    size_t local = MAX_LOCAL_SIZE;
+    size_t global;
+    cl_event events[3] = {0};  // binning, seeding and readback profile events
+    cl_mem owners, counts, centers, found;
+    cl_command_queue queue = e->commands[0];
+
+    // Keep the table at most half full, every point may fall in a cell of its own
+    //
+    while (table_size < 2 * e->count)
+    {
+        table_size *= 2;
+    }
+    size = (cl_uint)table_size;
+    mask = size - 1;
+
+    owners = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_uint) * table_size, NULL, NULL);
+    counts = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_uint) * table_size, NULL, NULL);
+    centers = clCreateBuffer(e->context, CL_MEM_WRITE_ONLY, sizeof(cl_float) * e->dims * e->count, NULL, NULL);
+    found = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, NULL);
+    if (!owners || !counts || !centers || !found)
+    {
+        printf("Error: Failed to allocate device memory!\n");
+        err = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+
+    // Bin the points of the first device, the seeds are then placed on every device
+    //
+    if (err == CL_SUCCESS)
+    {
+        err = clEnqueueFillBuffer(queue, owners, &zero, sizeof(zero), 0, sizeof(cl_uint) * table_size, 0, NULL, NULL);
+        err |= clEnqueueFillBuffer(queue, counts, &zero, sizeof(zero), 0, sizeof(cl_uint) * table_size, 0, NULL, NULL);
+        err |= clEnqueueFillBuffer(queue, found, &zero, sizeof(zero), 0, sizeof(cl_uint), 0, NULL, NULL);
+
+        err |= clSetKernelArg(e->binner, 0, sizeof(cl_mem), &e->points[0]);
+        err |= clSetKernelArg(e->binner, 1, sizeof(cl_uint), &n);
+        err |= clSetKernelArg(e->binner, 2, sizeof(cl_float), &cell);
+        err |= clSetKernelArg(e->binner, 3, sizeof(cl_mem), &owners);
+        err |= clSetKernelArg(e->binner, 4, sizeof(cl_mem), &counts);
+        err |= clSetKernelArg(e->binner, 5, sizeof(cl_uint), &mask);
+
+        err |= clSetKernelArg(e->bin_seeder, 0, sizeof(cl_mem), &e->points[0]);
+        err |= clSetKernelArg(e->bin_seeder, 1, sizeof(cl_float), &cell);
+        err |= clSetKernelArg(e->bin_seeder, 2, sizeof(cl_mem), &owners);
+        err |= clSetKernelArg(e->bin_seeder, 3, sizeof(cl_mem), &counts);
+        err |= clSetKernelArg(e->bin_seeder, 4, sizeof(cl_uint), &size);
+        err |= clSetKernelArg(e->bin_seeder, 5, sizeof(cl_uint), &min_count);
+        err |= clSetKernelArg(e->bin_seeder, 6, sizeof(cl_mem), &centers);
+        err |= clSetKernelArg(e->bin_seeder, 7, sizeof(cl_mem), &found);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to set kernel arguments! %d\n", err);
+        }
+    }
+    if (err == CL_SUCCESS)
+    {
+        global = round_up(e->count, local);
+        err = clEnqueueNDRangeKernel(queue, e->binner, 1, NULL, &global, NULL, 0, NULL, &events[0]);
+        global = round_up(table_size, local);
+        err |= clEnqueueNDRangeKernel(queue, e->bin_seeder, 1, NULL, &global, NULL, 0, NULL, &events[1]);
+        err |= clEnqueueReadBuffer(queue, found, CL_TRUE, 0, sizeof(cl_uint), &num_seeds, 0, NULL, NULL);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to execute kernel! %d\n", err);
+        }
+    }
+    if (err == CL_SUCCESS && num_seeds == 0)
+    {
+        printf("Error: No cell holds %u points!\n", min_count);
+        err = CL_INVALID_VALUE;
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = clEnqueueReadBuffer(queue, centers, CL_TRUE, 0, sizeof(cl_float) * e->dims * num_seeds, seeds, 0, NULL,
+                                  &events[2]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to read output array! %d\n", err);
+        }
+    }
+
+    finish_queue(e, 0);
+    profile_event(e, "bin", 0, -1, events[0]);
+    profile_event(e, "bin seeds", 0, -1, events[1]);
+    profile_event(e, "read", 0, -1, events[2]);
+    for (n = 0; n < 3; n++)
+    {
+        if (events[n]) clReleaseEvent(events[n]);
+    }
+    if (owners) clReleaseMemObject(owners);
+    if (counts) clReleaseMemObject(counts);
+    if (centers) clReleaseMemObject(centers);
+    if (found) clReleaseMemObject(found);
+
+    return err == CL_SUCCESS ? ms_engine_seed(e, seeds, num_seeds) : err;
+}
+
+// Grid over the modes for assign_grid: the modes sorted by cell, their original index and the first mode of each cell
+//
+typedef struct
+{
+    cl_float *modes;
+    cl_uint *index;
+    cl_uint *cell_start;
+    cl_uint width;
+    cl_uint height;
+    cl_float origin[2];
+    cl_float cell;
+} mode_grid;
+
+// Cell of the grid a mode falls in
+//
+static cl_uint grid_cell(const mode_grid *grid, const cl_float *mode, size_t dims)
+{
+    cl_uint x = (cl_uint)((mode[0] - grid->origin[0]) / grid->cell);
+    cl_uint y = dims > 1 ? (cl_uint)((mode[1] - grid->origin[1]) / grid->cell) : 0;
+    x = x < grid->width ? x : grid->width - 1;
+    y = y < grid->height ? y : grid->height - 1;
+    return y * grid->width + x;
+}
+
+// Sort the modes into a grid over their first two coordinates (or one), with about one mode per cell
+//
+static int build_grid(mode_grid *grid, const cl_float *modes, size_t num_modes, size_t dims)
+{
+    size_t grid_dims = dims < 2 ? dims : 2;
+    cl_float high[2] = {0.0F, 0.0F};
+    double area = 1.0;
+    cl_uint *cursor;
+    size_t num_cells;
+    size_t i, k;
+
+    memset(grid, 0, sizeof(*grid));
+    for (k = 0; k < grid_dims; k++)
+    {
+        grid->origin[k] = high[k] = modes[k];
+        for (i = 1; i < num_modes; i++)
+        {
+            grid->origin[k] = modes[i * dims + k] < grid->origin[k] ? modes[i * dims + k] : grid->origin[k];
+            high[k] = modes[i * dims + k] > high[k] ? modes[i * dims + k] : high[k];
+        }
+        area *= high[k] - grid->origin[k];
+    }
+    grid->cell = (cl_float)pow(area / num_modes, 1.0 / grid_dims);
+    for (k = 0; k < grid_dims; k++)
+    {
+        double extent = high[k] - grid->origin[k];
+        grid->cell = extent / grid->cell > MAX_GRID_SIZE - 1 ? (cl_float)(extent / (MAX_GRID_SIZE - 1)) : grid->cell;
+    }
+    grid->cell = grid->cell > 0.0F ? grid->cell : 1.0F;
+    grid->width = (cl_uint)((high[0] - grid->origin[0]) / grid->cell) + 1;
+    grid->height = grid_dims > 1 ? (cl_uint)((high[1] - grid->origin[1]) / grid->cell) + 1 : 1;
+    num_cells = (size_t)grid->width * grid->height;
+
+    grid->modes = malloc(sizeof(cl_float) * dims * num_modes);
+    grid->index = malloc(sizeof(cl_uint) * num_modes);
+    grid->cell_start = calloc(num_cells + 1, sizeof(cl_uint));
+    cursor = malloc(sizeof(cl_uint) * num_cells);
+    if (!grid->modes || !grid->index || !grid->cell_start || !cursor)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        free(cursor);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    // Counting sort of the modes by cell
+    //
+    for (i = 0; i < num_modes; i++)
+    {
+        grid->cell_start[grid_cell(grid, &modes[i * dims], dims) + 1]++;
+    }
+    for (i = 0; i < num_cells; i++)
+    {
+        grid->cell_start[i + 1] += grid->cell_start[i];
+        cursor[i] = grid->cell_start[i];
+    }
+    for (i = 0; i < num_modes; i++)
+    {
+        cl_uint slot = cursor[grid_cell(grid, &modes[i * dims], dims)]++;
+        memcpy(&grid->modes[slot * dims], &modes[i * dims], sizeof(cl_float) * dims);
+        grid->index[slot] = (cl_uint)i;
+    }
+    free(cursor);
+    return CL_SUCCESS;
+}
+
+static void release_grid(mode_grid *grid)
+{
+    free(grid->modes);
+    free(grid->index);
+    free(grid->cell_start);
+}
+
+int ms_engine_assign(ms_engine *e, const cl_float *modes, size_t num_modes, cl_uint *labels, cl_float *distances)
+{
+    int err = CL_SUCCESS;
+    cl_uint d;
+    int use_grid = num_modes > GRID_MODES;
+    cl_kernel kernel = use_grid ? e->grid_assigner : e->assigner;
+    cl_uint n = (cl_uint)e->count;
+    cl_uint m = (cl_uint)num_modes;
+    mode_grid grid;
+
+    cl_mem buffers[MAX_DEVICES][5] = {{0}};  // per-device modes, mode index, cell starts, labels and distances
+    cl_event event[MAX_DEVICES] = {0};       // per-device assignment profile events
+    cl_event read[MAX_DEVICES][2] = {{0}};   // per-device readback profile events
+    size_t offset = 0;
+
+    memset(&grid, 0, sizeof(grid));
+    if (num_modes == 0)
+    {
+        printf("Error: No modes to assign the points to!\n");
+        return CL_INVALID_VALUE;
+    }
+    if (use_grid)
+    {
+        err = build_grid(&grid, modes, num_modes, e->dims);
+    }
+
+    // Every device labels an even share of the points, in whole work groups
+    //
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        size_t local = work_group_size(kernel, e->device_ids[d], use_grid ? 0 : e->dims);
+        size_t share = round_up(e->count / e->num_devices, local);
+        size_t global;
+        cl_mem *mem = buffers[d];
+
+        share = d == e->num_devices - 1 || offset + share > e->count ? e->count - offset : share;
+        global = round_up(share, local);
+        if (share == 0)
+        {
+            continue;
+        }
+
+        mem[0] = clCreateBuffer(e->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                sizeof(cl_float) * e->dims * num_modes, use_grid ? grid.modes : (void *)modes, &err);
+        if (use_grid && mem[0])
+        {
+            mem[1] = clCreateBuffer(e->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint) * num_modes,
+                                    grid.index, &err);
+            mem[2] = mem[1] ? clCreateBuffer(e->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                             sizeof(cl_uint) * ((size_t)grid.width * grid.height + 1), grid.cell_start,
+                                             &err)
+                            : NULL;
+        }
+        mem[3] = clCreateBuffer(e->context, CL_MEM_WRITE_ONLY, sizeof(cl_uint) * share, NULL, &err);
+        mem[4] = clCreateBuffer(e->context, CL_MEM_WRITE_ONLY, sizeof(cl_float) * share, NULL, &err);
+        if (!mem[0] || (use_grid && !mem[2]) || !mem[3] || !mem[4])
+        {
+            printf("Error: Failed to allocate device memory!\n");
+            err = err ? err : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+            break;
+        }
+
+        err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &e->points[d]);
+        err |= clSetKernelArg(kernel, 1, sizeof(cl_uint), &n);
+        err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &mem[0]);
+        if (use_grid)
+        {
+            err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &mem[1]);
+            err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &mem[2]);
+            err |= clSetKernelArg(kernel, 5, sizeof(cl_uint), &grid.width);
+            err |= clSetKernelArg(kernel, 6, sizeof(cl_uint), &grid.height);
+            err |= clSetKernelArg(kernel, 7, sizeof(cl_float), &grid.origin[0]);
+            err |= clSetKernelArg(kernel, 8, sizeof(cl_float), &grid.origin[1]);
+            err |= clSetKernelArg(kernel, 9, sizeof(cl_float), &grid.cell);
+            err |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &mem[3]);
+            err |= clSetKernelArg(kernel, 11, sizeof(cl_mem), &mem[4]);
+        }
+        else
+        {
+            err |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &m);
+            err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &mem[3]);
+            err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &mem[4]);
+            err |= clSetKernelArg(kernel, 6, sizeof(cl_float) * e->dims * local, NULL);
+        }
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to set kernel arguments! %d\n", err);
+            break;
+        }
+
+        err = clEnqueueNDRangeKernel(e->commands[d], kernel, 1, &offset, &global, &local, 0, NULL, &event[d]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to execute kernel! %d\n", err);
+            break;
+        }
+        err = clEnqueueReadBuffer(e->commands[d], mem[3], CL_FALSE, 0, sizeof(cl_uint) * share, labels + offset, 0,
+                                  NULL, &read[d][0]);
+        err |= clEnqueueReadBuffer(e->commands[d], mem[4], CL_FALSE, 0, sizeof(cl_float) * share, distances + offset,
+                                   0, NULL, &read[d][1]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to read output array! %d\n", err);
+            break;
+        }
+        clFlush(e->commands[d]);
+        offset += share;
+    }
+
+    for (d = 0; d < e->num_devices; d++)
+    {
+        int b;
+
+        finish_queue(e, d);
+        profile_event(e, "assign", d, -1, event[d]);
+        profile_event(e, "read", d, -1, read[d][0]);
+        profile_event(e, "read", d, -1, read[d][1]);
+        if (event[d]) clReleaseEvent(event[d]);
+        if (read[d][0]) clReleaseEvent(read[d][0]);
+        if (read[d][1]) clReleaseEvent(read[d][1]);
+        for (b = 0; b < 5; b++)
+        {
+            if (buffers[d][b]) clReleaseMemObject(buffers[d][b]);
+        }
+    }
+    release_grid(&grid);
+    return err;
+}
+
+// Run a per-point kernel, such as the quick shift ones, over an even share of the points on every device and read
+// `item_size` bytes per point back into `results`. Argument 0 of the kernel is the points, `output_arg` the output,
+// followed by a local tile of `tile_floats` per work item, and `input_arg` a per-device input unless negative; the
+// others are set by the caller.
+//
+static int point_pass(ms_engine *e, cl_kernel kernel, int input_arg, cl_mem *inputs, cl_uint output_arg,
+                      cl_mem *outputs, size_t item_size, size_t tile_floats, void *results, const char *name,
+                      ms_timing *timing)
+{
+    int err = CL_SUCCESS;
+    cl_uint d;
+    cl_event event[MAX_DEVICES] = {0};  // per-device profile events
+    cl_event read[MAX_DEVICES] = {0};   // per-device readback profile events
+    size_t offset = 0;
+
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        size_t local = work_group_size(kernel, e->device_ids[d], tile_floats);
+        size_t share = round_up(e->count / e->num_devices, local);
+        size_t global;
+
+        share = d == e->num_devices - 1 || offset + share > e->count ? e->count - offset : share;
+        global = round_up(share, local);
+        timing->device_share[d] = share;
+        if (share == 0)
+        {
+            continue;
+        }
+
+        err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &e->points[d]);
+        if (input_arg >= 0)
+        {
+            err |= clSetKernelArg(kernel, input_arg, sizeof(cl_mem), &inputs[d]);
+        }
+        err |= clSetKernelArg(kernel, output_arg, sizeof(cl_mem), &outputs[d]);
+        err |= clSetKernelArg(kernel, output_arg + 1, sizeof(cl_float) * tile_floats * local, NULL);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to set kernel arguments! %d\n", err);
+            break;
+        }
+
+        err = clEnqueueNDRangeKernel(e->commands[d], kernel, 1, &offset, &global, &local, 0, NULL, &event[d]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to execute kernel! %d\n", err);
+            break;
+        }
+        err = clEnqueueReadBuffer(e->commands[d], outputs[d], CL_FALSE, item_size * offset, item_size * share,
+                                  (char *)results + item_size * offset, 0, NULL, &read[d]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to read output array! %d\n", err);
+            break;
+        }
+        clFlush(e->commands[d]);
+        offset += share;
+    }
+
+    for (d = 0; d < e->num_devices; d++)
+    {
+        finish_queue(e, d);
+        if (err == CL_SUCCESS && event[d])
+        {
+            timing->device_time[d] += event_time(event[d]);
+            timing->transfer_time += event_time(read[d]);
+        }
+        profile_event(e, name, d, -1, event[d]);
+        profile_event(e, "read", d, -1, read[d]);
+        if (event[d]) clReleaseEvent(event[d]);
+        if (read[d]) clReleaseEvent(read[d]);
+    }
+    return err;
+}
+
+int ms_engine_quick_shift(ms_engine *e, cl_float bandwidth, cl_float max_distance, cl_uint *parents,
+                          cl_float *densities, ms_timing *timing)
+{
+    int err = CL_SUCCESS;
+    cl_uint d;
+    cl_uint n = (cl_uint)e->count;
+
+    cl_mem density_buffers[MAX_DEVICES] = {0};  // per-device densities, of its share then of every point
+    cl_mem parent_buffers[MAX_DEVICES] = {0};   // per-device parents of its share
+    cl_event write[MAX_DEVICES] = {0};          // per-device density upload profile events
+
+    memset(timing, 0, sizeof(*timing));
+    timing->transfer_time = e->upload_time;
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        density_buffers[d] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * e->count, NULL, NULL);
+        parent_buffers[d] = clCreateBuffer(e->context, CL_MEM_WRITE_ONLY, sizeof(cl_uint) * e->count, NULL, NULL);
+        if (!density_buffers[d] || !parent_buffers[d])
+        {
+            printf("Error: Failed to allocate device memory!\n");
+            err = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        }
+    }
+
+    // Densities of every share, then every device links its share against the densities of all the points
+    //
+    if (err == CL_SUCCESS)
+    {
+        err = clSetKernelArg(e->estimator, 1, sizeof(cl_uint), &n);
+        err |= clSetKernelArg(e->estimator, 2, sizeof(cl_float), &bandwidth);
+        err |= clSetKernelArg(e->linker, 1, sizeof(cl_uint), &n);
+        err |= clSetKernelArg(e->linker, 3, sizeof(cl_float), &max_distance);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to set kernel arguments! %d\n", err);
+        }
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = point_pass(e, e->estimator, -1, NULL, 3, density_buffers, sizeof(cl_float), e->dims, densities,
+                         "density", timing);
+    }
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS && e->num_devices > 1; d++)
+    {
+        err = clEnqueueWriteBuffer(e->commands[d], density_buffers[d], CL_FALSE, 0, sizeof(cl_float) * e->count,
+                                   densities, 0, NULL, &write[d]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to write to source array! %d\n", err);
+        }
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = point_pass(e, e->linker, 2, density_buffers, 4, parent_buffers, sizeof(cl_uint), e->dims + 1, parents,
+                         "link", timing);
+    }
+
+    for (d = 0; d < e->num_devices; d++)
+    {
+        if (err == CL_SUCCESS && write[d])
+        {
+            timing->transfer_time += event_time(write[d]);
+            profile_event(e, "write", d, -1, write[d]);
+        }
+        timing->kernel_time = timing->device_time[d] > timing->kernel_time ? timing->device_time[d]
+                                                                           : timing->kernel_time;
+        if (write[d]) clReleaseEvent(write[d]);
+        if (density_buffers[d]) clReleaseMemObject(density_buffers[d]);
+        if (parent_buffers[d]) clReleaseMemObject(parent_buffers[d]);
+    }
+    return err;
+}
+
+int ms_engine_estimate_bandwidth(ms_engine *e, ms_estimator estimator, cl_float quantile, size_t num_samples,
+                                 cl_float *bandwidth)
+{
+    int err = CL_SUCCESS;
+    size_t i, k;
+    cl_uint n = (cl_uint)e->count;
+    cl_uint m;
+    cl_uint rank;
+    size_t local = work_group_size(e->quantiler, e->device_ids[0], e->dims);
+    size_t sample_local = work_group_size(e->sampler, e->device_ids[0], 0);
+    size_t global;
+    double estimate = 0.0;
+    cl_mem samples = NULL;
+    cl_mem distances = NULL;
+    cl_event event[3] = {0};      // sampling, quantile and readback profile events
+    cl_float *host = NULL;        // samples, or the distances of the quantile estimator
+
+    num_samples = num_samples && num_samples < e->count ? num_samples : e->count;
+    m = (cl_uint)num_samples;
+    rank = (cl_uint)(quantile * num_samples);
+    rank = rank > 0 ? rank : 1;
+    local = sample_local < local ? sample_local : local;  // both kernels share the launch geometry
+    global = round_up(num_samples, local);
+    if (num_samples < 2 || !(quantile > 0.0F && quantile <= 1.0F))
+    {
+        printf("Error: The bandwidth needs at least 2 samples and a quantile in (0, 1]!\n");
+        return CL_INVALID_VALUE;
+    }
+
+    samples = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * e->dims * num_samples, NULL, NULL);
+    distances = clCreateBuffer(e->context, CL_MEM_WRITE_ONLY, sizeof(cl_float) * num_samples, NULL, NULL);
+    host = malloc(sizeof(cl_float) * e->dims * num_samples);
+    if (!samples || !distances)
+    {
+        printf("Error: Failed to allocate device memory!\n");
+        err = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+    else if (!host)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        err = CL_OUT_OF_HOST_MEMORY;
+    }
+
+    // Subsample the points, then either compare every sample with every other one on the device or read the samples
+    // back for their moments, which take a single pass
+    //
+    if (err == CL_SUCCESS)
+    {
+        err = clSetKernelArg(e->sampler, 0, sizeof(cl_mem), &e->points[0]);
+        err |= clSetKernelArg(e->sampler, 1, sizeof(cl_uint), &n);
+        err |= clSetKernelArg(e->sampler, 2, sizeof(cl_uint), &m);
+        err |= clSetKernelArg(e->sampler, 3, sizeof(cl_mem), &samples);
+        err |= clSetKernelArg(e->quantiler, 0, sizeof(cl_mem), &samples);
+        err |= clSetKernelArg(e->quantiler, 1, sizeof(cl_uint), &m);
+        err |= clSetKernelArg(e->quantiler, 2, sizeof(cl_uint), &rank);
+        err |= clSetKernelArg(e->quantiler, 3, sizeof(cl_mem), &distances);
+        err |= clSetKernelArg(e->quantiler, 4, sizeof(cl_float) * e->dims * local, NULL);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to set kernel arguments! %d\n", err);
+        }
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = clEnqueueNDRangeKernel(e->commands[0], e->sampler, 1, NULL, &global, &local, 0, NULL, &event[0]);
+    }
+    if (err == CL_SUCCESS && estimator == MS_ESTIMATOR_QUANTILE)
+    {
+        err = clEnqueueNDRangeKernel(e->commands[0], e->quantiler, 1, NULL, &global, &local, 0, NULL, &event[1]);
+    }
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to execute kernel! %d\n", err);
+    }
+    else
+    {
+        cl_mem source = estimator == MS_ESTIMATOR_QUANTILE ? distances : samples;
+        size_t size = estimator == MS_ESTIMATOR_QUANTILE ? num_samples : e->dims * num_samples;
+        err = clEnqueueReadBuffer(e->commands[0], source, CL_TRUE, 0, sizeof(cl_float) * size, host, 0, NULL,
+                                  &event[2]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to read output array! %d\n", err);
+        }
+    }
+    finish_queue(e, 0);
+    profile_event(e, "sample", 0, -1, event[0]);
+    profile_event(e, "quantile", 0, -1, event[1]);
+    profile_event(e, "read", 0, -1, event[2]);
+
+    if (err == CL_SUCCESS && estimator == MS_ESTIMATOR_QUANTILE)
+    {
+        for (i = 0; i < num_samples; i++)
+        {
+            estimate += host[i];
+        }
+        estimate /= num_samples;
+    }
+    else if (err == CL_SUCCESS)
+    {
+        // Root mean variance of the coordinates, in two passes to keep the precision of off-center data sets
+        //
+        double dims = (double)e->dims;
+        for (k = 0; k < e->dims; k++)
+        {
+            double mean = 0.0;
+            for (i = 0; i < num_samples; i++)
+            {
+                mean += host[i * e->dims + k];
+            }
+            mean /= num_samples;
+            for (i = 0; i < num_samples; i++)
+            {
+                double diff = host[i * e->dims + k] - mean;
+                estimate += diff * diff / ((num_samples - 1) * dims);
+            }
+        }
+        estimate = sqrt(estimate) * pow((double)e->count, -1.0 / (dims + 4.0));
+        if (estimator == MS_ESTIMATOR_SILVERMAN)
+        {
+            estimate *= pow(4.0 / (dims + 2.0), 1.0 / (dims + 4.0));
+        }
+    }
+    if (err == CL_SUCCESS && !(estimate > 0.0))
+    {
+        printf("Error: The samples are all the same point, there is no bandwidth to estimate!\n");
+        err = CL_INVALID_VALUE;
+    }
+    *bandwidth = (cl_float)estimate;
+
+    for (i = 0; i < 3; i++)
+    {
+        if (event[i]) clReleaseEvent(event[i]);
+    }
+    if (samples) clReleaseMemObject(samples);
+    if (distances) clReleaseMemObject(distances);
+    free(host);
+    return err;
+}
+
+int ms_engine_adapt(ms_engine *e, cl_uint k, cl_float min_bandwidth, cl_float *bandwidths)
+{
+    int err = CL_SUCCESS;
+    cl_uint d;
+    cl_uint n = (cl_uint)e->count;
+    ms_timing timing;                   // only filled to run the pass
+    cl_event write[MAX_DEVICES] = {0};  // per-device bandwidth upload profile events
+
+    if (k < 1 || k > MAX_KNN || k >= e->count)
+    {
+        printf("Error: The bandwidths need a neighbour rank between 1 and %d, below the number of points!\n", MAX_KNN);
+        return CL_INVALID_VALUE;
+    }
+
+    memset(&timing, 0, sizeof(timing));
+    release_bandwidths(e);
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        e->bandwidths[d] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * e->count, NULL, NULL);
+        if (!e->bandwidths[d])
+        {
+            printf("Error: Failed to allocate device memory!\n");
+            err = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        }
+    }
+
+    // Bandwidths of every share, then every device gets those of all the points
+    //
+    if (err == CL_SUCCESS)
+    {
+        err = clSetKernelArg(e->knn, 1, sizeof(cl_uint), &n);
+        err |= clSetKernelArg(e->knn, 2, sizeof(cl_uint), &k);
+        err |= clSetKernelArg(e->knn, 3, sizeof(cl_float), &min_bandwidth);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to set kernel arguments! %d\n", err);
+        }
+    }
+    if (err == CL_SUCCESS)
+    {
+        err = point_pass(e, e->knn, -1, NULL, 4, e->bandwidths, sizeof(cl_float), e->dims, bandwidths, "knn",
+                         &timing);
+    }
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS && e->num_devices > 1; d++)
+    {
+        err = clEnqueueWriteBuffer(e->commands[d], e->bandwidths[d], CL_FALSE, 0, sizeof(cl_float) * e->count,
+                                   bandwidths, 0, NULL, &write[d]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to write to source array! %d\n", err);
+        }
+    }
+
+    for (d = 0; d < e->num_devices; d++)
+    {
+        finish_queue(e, d);
+        profile_event(e, "write", d, -1, write[d]);
+        if (write[d]) clReleaseEvent(write[d]);
+    }
+    if (err != CL_SUCCESS)
+    {
+        release_bandwidths(e);
+    }
+    return err;
+}
+
+// Replace `*buffer`, `count` points on device `d`, with a copy transformed by the whitening kernel. The previous buffer
+// is only released once the queue has finished with it.
+//
+static int enqueue_whiten(ms_engine *e, cl_uint d, cl_mem *buffer, size_t count, cl_mem inverse, cl_mem *previous,
+                          cl_event *event)
+{
+    int err = CL_SUCCESS;
+    cl_uint n = (cl_uint)count;
+    size_t global = round_up(count, MAX_LOCAL_SIZE);
+    cl_mem output = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * e->dims * count, NULL, &err);
+
+    if (!output)
+    {
+        printf("Error: Failed to allocate device memory! %d\n", err);
+        return err ? err : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+
+    err = clSetKernelArg(e->whitener, 0, sizeof(cl_mem), buffer);
+    err |= clSetKernelArg(e->whitener, 1, sizeof(cl_uint), &n);
+    err |= clSetKernelArg(e->whitener, 2, sizeof(cl_mem), &inverse);
+    err |= clSetKernelArg(e->whitener, 3, sizeof(cl_mem), &output);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to set kernel arguments! %d\n", err);
+        clReleaseMemObject(output);
+        return err;
+    }
+
+    err = clEnqueueNDRangeKernel(e->commands[d], e->whitener, 1, NULL, &global, NULL, 0, NULL, event);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to execute kernel! %d\n", err);
+        clReleaseMemObject(output);
+        return err;
+    }
+    *previous = *buffer;
+    *buffer = output;
+    return err;
+}
+
+int ms_engine_whiten(ms_engine *e, const cl_float *matrix, cl_float *factor)
+{
+    int err = CL_SUCCESS;
+    size_t r, c, k;
+    size_t dims = e->dims;
+    cl_uint d;
+    double *lower = calloc(dims * dims, sizeof(double));    // Cholesky factor L
+    double *inverse = calloc(dims * dims, sizeof(double));  // L^-1, both lower triangular
+    cl_float *host = malloc(sizeof(cl_float) * dims * dims);
+    cl_mem buffers[MAX_DEVICES] = {0};                      // L^-1 on each device
+    cl_mem previous[2 * MAX_DEVICES] = {0};                 // points and seeds being replaced on each device
+    cl_event event[2 * MAX_DEVICES] = {0};                  // per-device whitening profile events
+
+    if (!lower || !inverse || !host)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        free(lower);
+        free(inverse);
+        free(host);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    // Cholesky factorization, then the inverse of the factor by forward substitution, both in double precision
+    //
+    for (r = 0; r < dims && err == CL_SUCCESS; r++)
+    {
+        for (c = 0; c <= r; c++)
+        {
+            double sum = matrix[r * dims + c];
+            for (k = 0; k < c; k++)
+            {
+                sum -= lower[r * dims + k] * lower[c * dims + k];
+            }
+            if (matrix[r * dims + c] != matrix[c * dims + r] || (r == c && !(sum > 0.0)))
+            {
+                printf("Error: The bandwidth matrix is not symmetric positive definite!\n");
+                err = CL_INVALID_VALUE;
+                break;
+            }
+            lower[r * dims + c] = r == c ? sqrt(sum) : sum / lower[c * dims + c];
+        }
+    }
+    for (r = 0; r < dims && err == CL_SUCCESS; r++)
+    {
+        for (c = 0; c <= r; c++)
+        {
+            double sum = r == c ? 1.0 : 0.0;
+            for (k = c; k < r; k++)
+            {
+                sum -= lower[r * dims + k] * inverse[k * dims + c];
+            }
+            inverse[r * dims + c] = sum / lower[r * dims + r];
+        }
+    }
+    for (r = 0; r < dims * dims && err == CL_SUCCESS; r++)
+    {
+        factor[r] = (cl_float)lower[r];
+        host[r] = (cl_float)inverse[r];
+    }
+
+    // Every device whitens its own replicas, which keeps them identical without crossing the bus
+    //
+    if (err == CL_SUCCESS)
+    {
+        release_bandwidths(e);
+    }
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        buffers[d] = clCreateBuffer(e->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_float) * dims * dims,
+                                    host, &err);
+        if (!buffers[d])
+        {
+            printf("Error: Failed to allocate device memory! %d\n", err);
+            err = err ? err : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+            break;
+        }
+        err = enqueue_whiten(e, d, &e->points[d], e->count, buffers[d], &previous[2 * d], &event[2 * d]);
+        if (err == CL_SUCCESS && e->num_seeds)
+        {
+            err = enqueue_whiten(e, d, &e->seeds[d], e->num_seeds, buffers[d], &previous[2 * d + 1],
+                                 &event[2 * d + 1]);
+        }
+    }
+
+    for (d = 0; d < e->num_devices; d++)
+    {
+        finish_queue(e, d);
+        for (k = 2 * d; k < 2 * d + 2; k++)
+        {
+            profile_event(e, "whiten", d, -1, event[k]);
+            if (event[k]) clReleaseEvent(event[k]);
+            if (previous[k]) clReleaseMemObject(previous[k]);
+        }
+        if (buffers[d]) clReleaseMemObject(buffers[d]);
+    }
+    free(lower);
+    free(inverse);
+    free(host);
+    return err;
+}
+
+// Move the seeds of the share of device `d` from `input` to the means in `output` by the update rule of the engine,
+// and count the seeds still moving into `moving`
+//
+static int enqueue_update(ms_engine *e, cl_uint d, cl_mem *input, cl_mem *output, cl_mem *history, cl_mem *moving,
+                          size_t count, int first, cl_float bandwidth, size_t offset, size_t global, size_t local,
+                          cl_event *event)
+{
+    int err;
+    cl_uint num_seeds = (cl_uint)count;
+    cl_uint rule = e->update;
+    cl_uint empty = first;
+    cl_uint zero = 0;
+
+    err = clEnqueueFillBuffer(e->commands[d], *moving, &zero, sizeof(zero), 0, sizeof(zero), 0, NULL, NULL);
+    err |= clSetKernelArg(e->updater, 0, sizeof(cl_mem), input);
+    err |= clSetKernelArg(e->updater, 1, sizeof(cl_mem), output);
+    err |= clSetKernelArg(e->updater, 2, sizeof(cl_mem), history);
+    err |= clSetKernelArg(e->updater, 3, sizeof(cl_uint), &num_seeds);
+    err |= clSetKernelArg(e->updater, 4, sizeof(cl_uint), &rule);
+    err |= clSetKernelArg(e->updater, 5, sizeof(cl_uint), &empty);
+    err |= clSetKernelArg(e->updater, 6, sizeof(cl_float), &e->relaxation);
+    err |= clSetKernelArg(e->updater, 7, sizeof(cl_float), &bandwidth);
+    err |= clSetKernelArg(e->updater, 8, sizeof(cl_float), &e->convergence);
+    err |= clSetKernelArg(e->updater, 9, sizeof(cl_mem), moving);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to set update arguments! %d\n", err);
+        return err;
+    }
+
+    err = clEnqueueNDRangeKernel(e->commands[d], e->updater, 1, &offset, &global, &local, 0, NULL, event);
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to execute update kernel! %d\n", err);
+    }
+    return err;
+}
+
+// Shift the seeds on the first device until they converge, with the basins of attraction memoized: every iteration
+// shifts and updates the active seeds only, then the memoize kernel retires those which converged or came within the
+// memoization radius of a position of a converged trajectory, and compacts the others. The host reads the number of
+// active seeds back after every iteration to size the next launches.
+//
+static int shift_memoized(ms_engine *e, cl_float bandwidth, cl_float *results, ms_timing *timing)
+{
+    int err = CL_SUCCESS;
+    int it;
+    size_t count = e->num_seeds ? e->num_seeds : e->count;
+    int iterations = e->iterations > 0 ? e->iterations : 1;
+    size_t local = compute_group_size(e, e->device_ids[0]);
+    size_t table_size = 1;
+    cl_uint table_mask;
+    cl_uint num_active = (cl_uint)count;
+    cl_uint zero = 0;
+
+    cl_mem positions[2] = {0};  // compacted active seeds, the seed set itself being active at the first iteration
+    cl_mem history[2] = {0};    // update history of the active seeds
+    cl_mem origin[2] = {0};     // index of the active seeds in the seed set
+    cl_mem next = NULL;         // means of the active seeds, then their positions after the update
+    cl_mem keys = NULL;         // hash table of the positions the trajectories went through
+    cl_mem owners = NULL;
+    cl_mem path = NULL;
+    cl_mem done = NULL;    // iteration at which each seed stopped
+    cl_mem latest = NULL;  // latest position of every seed
+    cl_mem moving = NULL;  // seeds moving according to the update rule
+    cl_mem active = NULL;  // seeds left active by the memoize kernel
+    cl_event *event;       // shift, update and memoize profile events of every iteration
+    cl_event read = NULL;  // readback profile event
+#ifdef MS_STATS
+    cl_uint *counters;  // counters of every device and iteration, only the first device is used
+#endif
+
+    if (e->convergence <= 0.0F)
+    {
+        printf("Error: Memoized runs need a convergence distance!\n");
+        return CL_INVALID_VALUE;
+    }
+
+    event = calloc(3 * iterations, sizeof(cl_event));
+#ifdef MS_STATS
+    counters = calloc(e->num_devices * iterations * STATS_SIZE, sizeof(cl_uint));
+    if (!counters)
+    {
+        free(event);
+        event = NULL;
+    }
+#endif
+    if (!event)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    // Four slots per seed leave room for a few positions of every trajectory
+    //
+    while (table_size < 4 * count)
+    {
+        table_size *= 2;
+    }
+    table_mask = (cl_uint)table_size - 1;
+
+    for (it = 0; it < 2; it++)
+    {
+        positions[it] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * e->dims * count, NULL, NULL);
+        history[it] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * 2 * e->dims * count, NULL,
+                                     NULL);
+        origin[it] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_uint) * count, NULL, NULL);
+        err = positions[it] && history[it] && origin[it] ? err : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+    next = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * e->dims * count, NULL, NULL);
+    keys = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_uint) * table_size, NULL, NULL);
+    owners = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_uint) * table_size, NULL, NULL);
+    path = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * e->dims * table_size, NULL, NULL);
+    done = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_uint) * count, NULL, NULL);
+    latest = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * e->dims * count, NULL, NULL);
+    moving = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, NULL);
+    active = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, NULL);
+    if (err != CL_SUCCESS || !next || !keys || !owners || !path || !done || !latest || !moving || !active)
+    {
+        printf("Error: Failed to allocate device memory!\n");
+        err = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+    else
+    {
+        err = clEnqueueFillBuffer(e->commands[0], keys, &zero, sizeof(zero), 0, sizeof(cl_uint) * table_size, 0, NULL,
+                                  NULL);
+        err |= clEnqueueFillBuffer(e->commands[0], owners, &zero, sizeof(zero), 0, sizeof(cl_uint) * table_size, 0,
+                                   NULL, NULL);
+        err |= clEnqueueFillBuffer(e->commands[0], done, &zero, sizeof(zero), 0, sizeof(cl_uint) * count, 0, NULL,
+                                   NULL);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to clear the memoization table! %d\n", err);
+        }
+    }
+
+    for (it = 0; it < iterations && num_active && err == CL_SUCCESS; it++)
+    {
+        cl_mem *input = it ? &positions[it % 2] : e->num_seeds ? &e->seeds[0] : &e->points[0];
+        cl_uint iteration = it;
+        size_t global = round_up(num_active, local);
+
+        err = set_kernel_args(e, 0, input, &e->points[0], num_active, e->count, bandwidth, &next, local, 0);
+#ifdef MS_STATS
+        err |= stats_begin(e, 0);
+#endif
+        if (err != CL_SUCCESS)
+        {
+            break;
+        }
+        err = clEnqueueNDRangeKernel(e->commands[0], e->kernel, 1, NULL, &global, &local, 0, NULL, &event[3 * it]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to execute kernel! %d\n", err);
+            break;
+        }
+        err = enqueue_update(e, 0, input, &next, &history[it % 2], &moving, num_active, it == 0, bandwidth, 0, global,
+                             local, &event[3 * it + 1]);
+        if (err != CL_SUCCESS)
+        {
+            break;
+        }
+
+        err = clEnqueueFillBuffer(e->commands[0], active, &zero, sizeof(zero), 0, sizeof(zero), 0, NULL, NULL);
+        err |= clSetKernelArg(e->memoizer, 0, sizeof(cl_mem), input);
+        err |= clSetKernelArg(e->memoizer, 1, sizeof(cl_mem), &next);
+        err |= clSetKernelArg(e->memoizer, 2, sizeof(cl_mem), &history[it % 2]);
+        err |= clSetKernelArg(e->memoizer, 3, sizeof(cl_mem), &origin[it % 2]);
+        err |= clSetKernelArg(e->memoizer, 4, sizeof(cl_uint), &num_active);
+        err |= clSetKernelArg(e->memoizer, 5, sizeof(cl_uint), &iteration);
+        err |= clSetKernelArg(e->memoizer, 6, sizeof(cl_float), &e->convergence);
+        err |= clSetKernelArg(e->memoizer, 7, sizeof(cl_float), &e->memo_radius);
+        err |= clSetKernelArg(e->memoizer, 8, sizeof(cl_mem), &keys);
+        err |= clSetKernelArg(e->memoizer, 9, sizeof(cl_mem), &owners);
+        err |= clSetKernelArg(e->memoizer, 10, sizeof(cl_mem), &path);
+        err |= clSetKernelArg(e->memoizer, 11, sizeof(cl_uint), &table_mask);
+        err |= clSetKernelArg(e->memoizer, 12, sizeof(cl_mem), &done);
+        err |= clSetKernelArg(e->memoizer, 13, sizeof(cl_mem), &latest);
+        err |= clSetKernelArg(e->memoizer, 14, sizeof(cl_mem), &positions[(it + 1) % 2]);
+        err |= clSetKernelArg(e->memoizer, 15, sizeof(cl_mem), &history[(it + 1) % 2]);
+        err |= clSetKernelArg(e->memoizer, 16, sizeof(cl_mem), &origin[(it + 1) % 2]);
+        err |= clSetKernelArg(e->memoizer, 17, sizeof(cl_mem), &active);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to set memoize arguments! %d\n", err);
+            break;
+        }
+        err = clEnqueueNDRangeKernel(e->commands[0], e->memoizer, 1, NULL, &global, &local, 0, NULL,
+                                     &event[3 * it + 2]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to execute memoize kernel! %d\n", err);
+            break;
+        }
+#ifdef MS_STATS
+        err = stats_end(e, 0, &counters[it * e->num_devices * STATS_SIZE]);
+#endif
+        if (err == CL_SUCCESS)
+        {
+            err = clEnqueueReadBuffer(e->commands[0], active, CL_TRUE, 0, sizeof(cl_uint), &num_active, 0, NULL,
+                                      NULL);
+            if (err != CL_SUCCESS)
+            {
+                printf("Error: Failed to read the active seeds! %d\n", err);
+            }
+        }
+    }
+    e->iterations_run = it;
+
+    if (err == CL_SUCCESS)
+    {
+        err = clEnqueueReadBuffer(e->commands[0], latest, CL_FALSE, 0, sizeof(cl_float) * e->dims * count, results, 0,
+                                  NULL, &read);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to read output array! %d\n", err);
+        }
+    }
+
+    memset(timing, 0, sizeof(*timing));
+    timing->transfer_time = e->upload_time;
+    finish_queue(e, 0);
+    for (it = 0; it < 3 * iterations; it++)
+    {
+        static const char *names[3] = {"kernel", "update", "memoize"};
+        if (!event[it])
+        {
+            continue;
+        }
+        if (err == CL_SUCCESS)
+        {
+            timing->device_time[0] += event_time(event[it]);
+            profile_event(e, names[it % 3], 0, it / 3, event[it]);
+        }
+        clReleaseEvent(event[it]);
+    }
+    if (err == CL_SUCCESS && read)
+    {
+        timing->kernel_time = timing->device_time[0];
+        timing->device_share[0] = count;
+        timing->transfer_time += event_time(read);
+        profile_event(e, "read", 0, -1, read);
+    }
+
+    if (read) clReleaseEvent(read);
+    for (it = 0; it < 2; it++)
+    {
+        if (positions[it]) clReleaseMemObject(positions[it]);
+        if (history[it]) clReleaseMemObject(history[it]);
+        if (origin[it]) clReleaseMemObject(origin[it]);
+    }
+    if (next) clReleaseMemObject(next);
+    if (keys) clReleaseMemObject(keys);
+    if (owners) clReleaseMemObject(owners);
+    if (path) clReleaseMemObject(path);
+    if (done) clReleaseMemObject(done);
+    if (latest) clReleaseMemObject(latest);
+    if (moving) clReleaseMemObject(moving);
+    if (active) clReleaseMemObject(active);
+    free(event);
+
+#ifdef MS_STATS
+    if (err == CL_SUCCESS)
+    {
+        err = stats_gather(e, counters, e->iterations_run, count);
+    }
+    free(counters);
+#endif
+    return err;
+}
+
+// Blurring mean shift on the first device: every iteration shifts the output of the previous one against itself,
+// ping-ponging between two buffers. The symmetric variant accumulates the weighted sums of each pair once into two
+// zeroed buffers, which a second kernel divides into the shifted points.
+//
+static int shift_blurring(ms_engine *e, cl_float bandwidth, cl_float *results, ms_timing *timing)
+{
+    int err = CL_SUCCESS;
+    int it;
+    size_t count = e->count;
+    cl_uint n = (cl_uint)count;
+    int iterations = e->iterations > 0 ? e->iterations : 1;
+    int symmetric = e->variant == MS_VARIANT_SYMMETRIC;
+    size_t local = compute_group_size(e, e->device_ids[0]);
+    size_t blocks = (count + local - 1) / local;
+    size_t global = symmetric ? blocks * (blocks + 1) / 2 * local : round_up(count, local);
+    size_t normalize_global = round_up(count, MAX_LOCAL_SIZE);
+    cl_float zero = 0.0F;
+
+    cl_mem output[2] = {0};  // shifted points of the even and odd iterations
+    cl_mem sums = NULL;      // weighted sums of the symmetric kernel
+    cl_mem scales = NULL;    // sums of the weights of the symmetric kernel
+    cl_event *event;         // compute profile events of every iteration, and normalization ones
+    cl_event read = NULL;    // readback profile event
+#ifdef MS_STATS
+    cl_uint *counters;  // counters of every device and iteration, only the first device is used
+#endif
+
+    event = calloc(2 * iterations, sizeof(cl_event));
+#ifdef MS_STATS
+    counters = calloc(e->num_devices * iterations * STATS_SIZE, sizeof(cl_uint));
+    if (!counters)
+    {
+        free(event);
+        event = NULL;
+    }
+#endif
+    if (!event)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    for (it = 0; it < 2 && it < iterations; it++)
+    {
+        output[it] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * e->dims * count, NULL, NULL);
+        err = output[it] ? err : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+    if (symmetric)
+    {
+        sums = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * e->dims * count, NULL, NULL);
+        scales = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * count, NULL, NULL);
+        err = sums && scales ? err : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+    if (err != CL_SUCCESS)
+    {
+        printf("Error: Failed to allocate device memory!\n");
+    }
+
+    for (it = 0; it < iterations && err == CL_SUCCESS; it++)
+    {
+        cl_mem *input = it ? &output[(it - 1) % 2] : &e->points[0];
+
+        if (symmetric)
+        {
+            err = clEnqueueFillBuffer(e->commands[0], sums, &zero, sizeof(zero), 0, sizeof(cl_float) * e->dims * count,
+                                      0, NULL, NULL);
+            err |= clEnqueueFillBuffer(e->commands[0], scales, &zero, sizeof(zero), 0, sizeof(cl_float) * count, 0,
+                                       NULL, NULL);
+            err |= clSetKernelArg(e->kernel, 0, sizeof(cl_mem), input);
+            err |= clSetKernelArg(e->kernel, 1, sizeof(cl_uint), &n);
+            err |= clSetKernelArg(e->kernel, 2, sizeof(cl_float), &bandwidth);
+            err |= clSetKernelArg(e->kernel, 3, sizeof(cl_mem), &sums);
+            err |= clSetKernelArg(e->kernel, 4, sizeof(cl_mem), &scales);
+            err |= clSetKernelArg(e->kernel, 5, sizeof(cl_float) * e->dims * local, NULL);
+            err |= clSetKernelArg(e->kernel, 6, sizeof(cl_float) * (e->dims + 1) * local, NULL);
+            err |= clSetKernelArg(e->normalizer, 0, sizeof(cl_mem), &sums);
+            err |= clSetKernelArg(e->normalizer, 1, sizeof(cl_mem), &scales);
+            err |= clSetKernelArg(e->normalizer, 2, sizeof(cl_uint), &n);
+            err |= clSetKernelArg(e->normalizer, 3, sizeof(cl_mem), &output[it % 2]);
+            if (err != CL_SUCCESS)
+            {
+                printf("Error: Failed to set kernel arguments! %d\n", err);
+                break;
+            }
+        }
+        else
+        {
+            err = set_kernel_args(e, 0, input, input, count, count, bandwidth, &output[it % 2], local, 0);
+#ifdef MS_STATS
+            err |= stats_begin(e, 0);
+#endif
+            if (err != CL_SUCCESS)
+            {
+                break;
+            }
+        }
+
+        err = clEnqueueNDRangeKernel(e->commands[0], e->kernel, 1, NULL, &global, &local, 0, NULL, &event[2 * it]);
+        if (err == CL_SUCCESS && symmetric)
+        {
+            err = clEnqueueNDRangeKernel(e->commands[0], e->normalizer, 1, NULL, &normalize_global, NULL, 0, NULL,
+                                         &event[2 * it + 1]);
+        }
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to execute kernel! %d\n", err);
+            break;
+        }
+#ifdef MS_STATS
+        if (!symmetric)
+        {
+            err = stats_end(e, 0, &counters[it * e->num_devices * STATS_SIZE]);
+        }
+#endif
+    }
+
+    if (err == CL_SUCCESS)
+    {
+        err = clEnqueueReadBuffer(e->commands[0], output[(iterations - 1) % 2], CL_FALSE, 0,
+                                  sizeof(cl_float) * e->dims * count, results, 0, NULL, &read);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to read output array! %d\n", err);
+        }
+    }
+
+    memset(timing, 0, sizeof(*timing));
+    timing->transfer_time = e->upload_time;
+    finish_queue(e, 0);
+    for (it = 0; it < 2 * iterations; it++)
+    {
+        if (!event[it])
+        {
+            continue;
+        }
+        if (err == CL_SUCCESS)
+        {
+            timing->device_time[0] += event_time(event[it]);
+            profile_event(e, it % 2 ? "normalize" : "kernel", 0, it / 2, event[it]);
+        }
+        clReleaseEvent(event[it]);
+    }
+    if (err == CL_SUCCESS && read)
+    {
+        timing->kernel_time = timing->device_time[0];
+        timing->device_share[0] = count;
+        timing->transfer_time += event_time(read);
+        profile_event(e, "read", 0, -1, read);
+    }
+
+    if (read) clReleaseEvent(read);
+    if (output[0]) clReleaseMemObject(output[0]);
+    if (output[1]) clReleaseMemObject(output[1]);
+    if (sums) clReleaseMemObject(sums);
+    if (scales) clReleaseMemObject(scales);
+    free(event);
+
+#ifdef MS_STATS
+    if (err == CL_SUCCESS)
+    {
+        err = stats_gather(e, counters, iterations, count);
+    }
+    free(counters);
+#endif
+    return err;
+}
+
+// Run the kernel with the seeds partitioned across the devices of the engine. Every device holds a replica of the
+// points and seeds and shifts a share of the seeds that is proportional to its throughput, measured once per engine
+// on a calibration slice which fills the device. A single device simply gets every seed. Each device executes its
+// share through the global work offset and only its share of the output is read back. Iterations ping-pong between
+// two output buffers, each one shifting the output of the previous one against the original points.
+//
+int ms_engine_shift(ms_engine *e, cl_float bandwidth, cl_float *results, ms_timing *timing)
+{
+    int err = CL_SUCCESS;
+    cl_uint d;
+    int it;
+    size_t count = e->num_seeds ? e->num_seeds : e->count;  // number of seeds
+    int iterations = e->iterations > 0 ? e->iterations : 1;
+
+    cl_mem output[MAX_DEVICES][2] = {{0}};  // per-device shifted points, only its share is valid
+    cl_mem history[MAX_DEVICES] = {0};      // per-device previous step and mean of every seed
+    cl_mem moving[MAX_DEVICES] = {0};       // per-device number of seeds which moved at the last iteration
+    cl_event *event;                        // per-device compute and update profile events of every iteration
+    cl_event read[MAX_DEVICES] = {0};       // per-device readback profile events
+    size_t local[MAX_DEVICES];              // per-device work group size
+    int last[MAX_DEVICES];                  // per-device last iteration, earlier once its seeds converged
+    int updating = e->update != MS_UPDATE_PLAIN || e->convergence > 0.0F;
+    cl_uint running;                        // devices whose seeds are still moving
+
+    size_t offset[MAX_DEVICES];  // first point handled by each device
+    size_t share[MAX_DEVICES];   // number of points handled by each device
+    double total_throughput = 0.0;
+    int calibrate;               // the throughput of the devices is not known yet
+#ifdef MS_STATS
+    cl_uint *counters;  // counters of every device and iteration
+#endif
+
+    if (e->blurring && e->num_seeds)
+    {
+        printf("Error: Blurring mean shift only shifts the points themselves!\n");
+        return CL_INVALID_VALUE;
+    }
+    if (e->blurring && (e->update != MS_UPDATE_PLAIN || e->convergence > 0.0F || e->memo_radius > 0.0F))
+    {
+        printf("Error: Blurring mean shift runs plain iterations only!\n");
+        return CL_INVALID_VALUE;
+    }
+    if (e->variant == MS_VARIANT_ADAPTIVE && (e->blurring || !e->bandwidths[0]))
+    {
+        printf("Error: The adaptive kernel needs the bandwidths of ms_engine_adapt(), and does not blur!\n");
+        return CL_INVALID_VALUE;
+    }
+    if (e->blurring)
+    {
+        e->iterations_run = e->iterations > 0 ? e->iterations : 1;
+        return shift_blurring(e, bandwidth, results, timing);
+    }
+    if (e->memo_radius > 0.0F && e->variant != MS_VARIANT_SYMMETRIC)
+    {
+        return shift_memoized(e, bandwidth, results, timing);
+    }
+    if (e->variant == MS_VARIANT_SYMMETRIC)
+    {
+        printf("Error: The symmetric kernel only runs blurring mean shift!\n");
+        return CL_INVALID_VALUE;
+    }
+
+    event = calloc(2 * e->num_devices * iterations, sizeof(cl_event));
+#ifdef MS_STATS
+    counters = calloc(e->num_devices * iterations * STATS_SIZE, sizeof(cl_uint));
+    if (!counters)
+    {
+        free(event);
+        event = NULL;
+    }
+#endif
+    if (!event)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        local[d] = compute_group_size(e, e->device_ids[d]);
+
+        for (it = 0; it < 2 && it < iterations; it++)
+        {
+            output[d][it] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * e->dims * count, NULL,
+                                           NULL);
+            if (!output[d][it])
+            {
+                printf("Error: Failed to allocate device memory!\n");
+                err = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+            }
+        }
+        if (updating && err == CL_SUCCESS)
+        {
+            history[d] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_float) * 2 * e->dims * count, NULL,
+                                        NULL);
+            moving[d] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, NULL);
+            if (!history[d] || !moving[d])
+            {
+                printf("Error: Failed to allocate device memory!\n");
+                err = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+            }
+        }
+    }
+
+    // Measure the throughput of every device the first time, on a slice of a few work groups per compute unit so that
+    // the launch latency does not dominate
+    //
+    calibrate = e->num_devices > 1 && !(e->throughput[0] > 0.0);
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS && calibrate; d++)
+    {
+        cl_uint units = 1;
+        size_t global;
+        cl_event calibration;
+
+        cl_mem *seeds = e->num_seeds ? &e->seeds[d] : &e->points[d];
+
+        clGetDeviceInfo(e->device_ids[d], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+        global = CALIBRATION_GROUPS * (units ? units : 1) * local[d];
+        global = round_up(count < global ? count : global, local[d]);
+        err = set_kernel_args(e, d, seeds, &e->points[d], count, e->count, bandwidth, &output[d][0], local[d], 0);
+#ifdef MS_STATS
+        err |= stats_begin(e, d);
+#endif
+        if (err != CL_SUCCESS)
+        {
+            break;
+        }
+
+        err = clEnqueueNDRangeKernel(e->commands[d], e->kernel, 1, NULL, &global, &local[d], 0, NULL, &calibration);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to execute kernel! %d\n", err);
+            break;
+        }
+        finish_queue(e, d);
+
+        e->throughput[d] = global / (event_time(calibration) + 1e-6);
+        profile_event(e, "calibrate", d, -1, calibration);
+        clReleaseEvent(calibration);
+    }
+    if (err != CL_SUCCESS)
+    {
+        memset(e->throughput, 0, sizeof(e->throughput));  // measure again next time
+    }
+
+    // Split the points to shift proportionally to the measured throughput, the last device takes the remainder. The
+    // other shares are whole work groups, so that no padding work item spills over the share of the next device.
+    //
+    for (d = 0; d < e->num_devices && e->num_devices > 1; d++)
+    {
+        total_throughput += e->throughput[d];
+    }
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        offset[d] = d ? offset[d - 1] + share[d - 1] : 0;
+        share[d] = e->num_devices > 1 ? (size_t)(count * (e->throughput[d] / total_throughput)) : count;
+        share[d] = (share[d] + local[d] / 2) / local[d] * local[d];
+        if (d == e->num_devices - 1 || offset[d] + share[d] > count)
+        {
+            share[d] = count - offset[d];
+        }
+    }
+
+    // Execute every iteration over each share on every device without waiting in between, the global work size is
+    // padded to the work group size and the kernel skips the padding. When converging, the host waits for the number
+    // of moving seeds of every device after each iteration, and a device is done once none of its seeds moved.
+    //
+    running = 0;
+    for (d = 0; d < e->num_devices; d++)
+    {
+        last[d] = share[d] ? iterations - 1 : -1;
+        running += share[d] != 0;
+    }
+    for (it = 0; it < iterations && err == CL_SUCCESS && running; it++)
+    {
+        for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+        {
+            size_t global = round_up(share[d], local[d]);
+            cl_mem *input = it ? &output[d][(it - 1) % 2] : e->num_seeds ? &e->seeds[d] : &e->points[d];
+            if (last[d] < it)
+            {
+                continue;
+            }
+
+            err = set_kernel_args(e, d, input, &e->points[d], count, e->count, bandwidth, &output[d][it % 2], local[d],
+                                  0);
+#ifdef MS_STATS
+            err |= stats_begin(e, d);
+#endif
+            if (err != CL_SUCCESS)
+            {
+                break;
+            }
+
+            err = clEnqueueNDRangeKernel(e->commands[d], e->kernel, 1, &offset[d], &global, &local[d], 0, NULL,
+                                         &event[2 * (d * iterations + it)]);
+            if (err != CL_SUCCESS)
+            {
+                printf("Error: Failed to execute kernel! %d\n", err);
+                break;
+            }
+            if (updating)
+            {
+                err = enqueue_update(e, d, input, &output[d][it % 2], &history[d], &moving[d], count, it == 0,
+                                     bandwidth, offset[d], global, local[d], &event[2 * (d * iterations + it) + 1]);
+            }
+#ifdef MS_STATS
+            err |= stats_end(e, d, &counters[(it * e->num_devices + d) * STATS_SIZE]);
+#endif
+            clFlush(e->commands[d]);
+        }
+
+        for (d = 0; d < e->num_devices && err == CL_SUCCESS && e->convergence > 0.0F; d++)
+        {
+            cl_uint num_moving;
+            if (last[d] < it)
+            {
+                continue;
+            }
+
+            err = clEnqueueReadBuffer(e->commands[d], moving[d], CL_TRUE, 0, sizeof(cl_uint), &num_moving, 0, NULL,
+                                      NULL);
+            if (err != CL_SUCCESS)
+            {
+                printf("Error: Failed to read the moving seeds! %d\n", err);
+            }
+            else if (num_moving == 0)
+            {
+                last[d] = it;
+                running--;
+            }
+        }
+    }
+
+    e->iterations_run = 0;
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        size_t share_offset = sizeof(cl_float) * e->dims * offset[d];
+        if (share[d] == 0)
+        {
+            continue;
+        }
+
+        e->iterations_run = last[d] + 1 > e->iterations_run ? last[d] + 1 : e->iterations_run;
+        err = clEnqueueReadBuffer(e->commands[d], output[d][last[d] % 2], CL_FALSE, share_offset,
+                                  sizeof(cl_float) * e->dims * share[d], results + e->dims * offset[d], 0, NULL,
+                                  &read[d]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to read output array! %d\n", err);
+            break;
+        }
+        clFlush(e->commands[d]);
+    }
+
+    // Gather the results and report the slowest device as the kernel time
+    //
+    memset(timing, 0, sizeof(*timing));
+    timing->transfer_time = e->upload_time;
+    for (d = 0; d < e->num_devices; d++)
+    {
+        finish_queue(e, d);
+        for (it = 0; it < 2 * iterations; it++)
+        {
+            cl_event kernel = event[2 * d * iterations + it];
+            if (!kernel)
+            {
+                continue;
+            }
+            if (err == CL_SUCCESS)
+            {
+                timing->device_time[d] += event_time(kernel);
+                profile_event(e, it % 2 ? "update" : "kernel", d, it / 2, kernel);
+            }
+            clReleaseEvent(kernel);
+        }
+
+        if (err == CL_SUCCESS && read[d])
+        {
+            timing->device_share[d] = share[d];
+            timing->kernel_time = timing->device_time[d] > timing->kernel_time ? timing->device_time[d]
+                                                                               : timing->kernel_time;
+            timing->transfer_time += event_time(read[d]);
+            profile_event(e, "read", d, -1, read[d]);
+        }
+
+        if (read[d]) clReleaseEvent(read[d]);
+        if (output[d][0]) clReleaseMemObject(output[d][0]);
+        if (output[d][1]) clReleaseMemObject(output[d][1]);
+        if (history[d]) clReleaseMemObject(history[d]);
+        if (moving[d]) clReleaseMemObject(moving[d]);
+    }
+    free(event);
+
+#ifdef MS_STATS
+    if (err == CL_SUCCESS)
+    {
+        err = stats_gather(e, counters, e->iterations_run, count);
+    }
+    free(counters);
+#endif
+
+    return err;
+}
+
+int ms_engine_run(ms_engine *e, const cl_float *data, size_t count, cl_float bandwidth, cl_float *results,
+                  ms_timing *timing)
+{
+    int err = ms_engine_upload(e, data, count);
+    if (err != CL_SUCCESS)
+    {
+        return err;
+    }
+    return ms_engine_shift(e, bandwidth, results, timing);
+}
+
+int ms_engine_shift_multi(ms_engine *e, const cl_float *bandwidths, size_t num_bandwidths, cl_float *results,
+                          ms_timing *timing)
+{
+    int err = CL_SUCCESS;
+    cl_uint d;
+    int it;
+    size_t b;
+    size_t count = e->num_seeds ? e->num_seeds : e->count;  // number of seeds
+    int iterations = e->iterations > 0 ? e->iterations : 1;
+    size_t size = sizeof(cl_float) * e->dims * count * num_bandwidths;  // positions of every scale
+    cl_uint seeds = (cl_uint)count;
+    cl_uint points = (cl_uint)e->count;
+    cl_uint scales = (cl_uint)num_bandwidths;
+    cl_uint zero = 0;
+
+    cl_mem output[MAX_DEVICES][2] = {{0}};           // per-device shifted points of every scale
+    cl_mem scale_buffers[MAX_DEVICES] = {0};         // per-device bandwidths
+    cl_mem moving[MAX_DEVICES] = {0};                // per-device number of seeds which moved at the last iteration
+    cl_event *event;                                 // per-device compute profile events of every iteration
+    cl_event read[MAX_DEVICES][MAX_SCALES] = {{0}};  // per-device readback profile events of every scale
+    size_t local[MAX_DEVICES];                       // per-device work group size
+    size_t offset[MAX_DEVICES];                      // first seed handled by each device
+    size_t share[MAX_DEVICES];                       // number of seeds handled by each device
+    int last[MAX_DEVICES];                           // per-device last iteration, earlier once its seeds converged
+    cl_uint running = 0;                             // devices whose seeds are still moving
+
+    if (num_bandwidths < 1 || num_bandwidths > MAX_SCALES)
+    {
+        printf("Error: A sweep takes between 1 and %d bandwidths!\n", MAX_SCALES);
+        return CL_INVALID_VALUE;
+    }
+    if (e->blurring || e->update != MS_UPDATE_PLAIN || e->memo_radius > 0.0F)
+    {
+        printf("Error: Bandwidth sweeps run plain iterations only!\n");
+        return CL_INVALID_VALUE;
+    }
+
+    event = calloc(e->num_devices * iterations, sizeof(cl_event));
+    if (!event)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    // Split the seeds evenly, in whole work groups but for the last device
+    //
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        local[d] = work_group_size(e->sweeper, e->device_ids[d], 0);
+        offset[d] = d ? offset[d - 1] + share[d - 1] : 0;
+        share[d] = round_up(count / e->num_devices, local[d]);
+        share[d] = d == e->num_devices - 1 || offset[d] + share[d] > count ? count - offset[d] : share[d];
+        last[d] = share[d] ? iterations - 1 : -1;
+        running += share[d] != 0;
+
+        for (it = 0; it < 2 && it < iterations; it++)
+        {
+            output[d][it] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, size, NULL, NULL);
+        }
+        scale_buffers[d] = clCreateBuffer(e->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                          sizeof(cl_float) * num_bandwidths, (void *)bandwidths, NULL);
+        moving[d] = clCreateBuffer(e->context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, NULL);
+        if (!output[d][0] || (iterations > 1 && !output[d][1]) || !scale_buffers[d] || !moving[d])
+        {
+            printf("Error: Failed to allocate device memory!\n");
+            err = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        }
+    }
+
+    // Execute every iteration over each share on every device, the host waiting for the number of moving seeds of
+    // every device after each iteration when converging, as ms_engine_shift() does
+    //
+    for (it = 0; it < iterations && err == CL_SUCCESS && running; it++)
+    {
+        for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+        {
+            size_t global = round_up(share[d], local[d]);
+            cl_mem *input = it ? &output[d][(it - 1) % 2] : e->num_seeds ? &e->seeds[d] : &e->points[d];
+            cl_uint first = it == 0;
+            if (last[d] < it)
+            {
+                continue;
+            }
+
+            err = clSetKernelArg(e->sweeper, 0, sizeof(cl_mem), input);
+            err |= clSetKernelArg(e->sweeper, 1, sizeof(cl_mem), &e->points[d]);
+            err |= clSetKernelArg(e->sweeper, 2, sizeof(cl_uint), &seeds);
+            err |= clSetKernelArg(e->sweeper, 3, sizeof(cl_uint), &points);
+            err |= clSetKernelArg(e->sweeper, 4, sizeof(cl_mem), &scale_buffers[d]);
+            err |= clSetKernelArg(e->sweeper, 5, sizeof(cl_uint), &scales);
+            err |= clSetKernelArg(e->sweeper, 6, sizeof(cl_uint), &first);
+            err |= clSetKernelArg(e->sweeper, 7, sizeof(cl_mem), &output[d][it % 2]);
+            err |= clSetKernelArg(e->sweeper, 8, sizeof(cl_float), &e->convergence);
+            err |= clSetKernelArg(e->sweeper, 9, sizeof(cl_mem), &moving[d]);
+            if (err != CL_SUCCESS)
+            {
+                printf("Error: Failed to set kernel arguments! %d\n", err);
+                break;
+            }
+
+            err = clEnqueueFillBuffer(e->commands[d], moving[d], &zero, sizeof(zero), 0, sizeof(zero), 0, NULL, NULL);
+            err |= clEnqueueNDRangeKernel(e->commands[d], e->sweeper, 1, &offset[d], &global, &local[d], 0, NULL,
+                                          &event[d * iterations + it]);
+            if (err != CL_SUCCESS)
+            {
+                printf("Error: Failed to execute kernel! %d\n", err);
+                break;
+            }
+            clFlush(e->commands[d]);
+        }
+
+        for (d = 0; d < e->num_devices && err == CL_SUCCESS && e->convergence > 0.0F; d++)
+        {
+            cl_uint num_moving;
+            if (last[d] < it)
+            {
+                continue;
+            }
+
+            err = clEnqueueReadBuffer(e->commands[d], moving[d], CL_TRUE, 0, sizeof(cl_uint), &num_moving, 0, NULL,
+                                      NULL);
+            if (err != CL_SUCCESS)
+            {
+                printf("Error: Failed to read the moving seeds! %d\n", err);
+            }
+            else if (num_moving == 0)
+            {
+                last[d] = it;
+                running--;
+            }
+        }
+    }
+
+    // Read the share of every scale back, the scales being apart in the output
+    //
+    e->iterations_run = 0;
+    for (d = 0; d < e->num_devices && err == CL_SUCCESS; d++)
+    {
+        if (share[d] == 0)
+        {
+            continue;
+        }
+
+        e->iterations_run = last[d] + 1 > e->iterations_run ? last[d] + 1 : e->iterations_run;
+        for (b = 0; b < num_bandwidths && err == CL_SUCCESS; b++)
+        {
+            size_t row = b * count + offset[d];
+            err = clEnqueueReadBuffer(e->commands[d], output[d][last[d] % 2], CL_FALSE,
+                                      sizeof(cl_float) * e->dims * row, sizeof(cl_float) * e->dims * share[d],
+                                      results + e->dims * row, 0, NULL, &read[d][b]);
+            if (err != CL_SUCCESS)
+            {
+                printf("Error: Failed to read output array! %d\n", err);
+            }
+        }
+        clFlush(e->commands[d]);
+    }
+
+    memset(timing, 0, sizeof(*timing));
+    timing->transfer_time = e->upload_time;
+    for (d = 0; d < e->num_devices; d++)
+    {
+        finish_queue(e, d);
+        for (it = 0; it < iterations; it++)
+        {
+            cl_event kernel = event[d * iterations + it];
+            if (!kernel)
+            {
+                continue;
+            }
+            if (err == CL_SUCCESS)
+            {
+                timing->device_time[d] += event_time(kernel);
+                profile_event(e, "sweep", d, it, kernel);
+            }
+            clReleaseEvent(kernel);
+        }
+
+        for (b = 0; b < num_bandwidths; b++)
+        {
+            if (err == CL_SUCCESS && read[d][b])
+            {
+                timing->transfer_time += event_time(read[d][b]);
+                profile_event(e, "read", d, -1, read[d][b]);
+            }
+            if (read[d][b]) clReleaseEvent(read[d][b]);
+        }
+        if (err == CL_SUCCESS)
+        {
+            timing->device_share[d] = share[d];
+            timing->kernel_time = timing->device_time[d] > timing->kernel_time ? timing->device_time[d]
+                                                                               : timing->kernel_time;
+        }
+
+        if (output[d][0]) clReleaseMemObject(output[d][0]);
+        if (output[d][1]) clReleaseMemObject(output[d][1]);
+        if (scale_buffers[d]) clReleaseMemObject(scale_buffers[d]);
+        if (moving[d]) clReleaseMemObject(moving[d]);
+    }
+    free(event);
+    return err;
+}
+
+int ms_engine_link_scales(ms_engine *e, const cl_float *bandwidths, size_t num_bandwidths, const cl_float *modes,
+                          const size_t *num_modes, cl_uint *parents, cl_float *distances, ms_timing *timing)
+{
+    int err = CL_SUCCESS;
+    size_t b, m, p, k;
+    size_t first = 0;         // first mode of the scale being linked
+    size_t most = 0;          // most modes of a scale
+    cl_float *shifted;        // modes of the scale shifted at the next bandwidth
+    ms_timing scale_timing;   // timing of the run of one scale
+
+    if (num_bandwidths == 0)
+    {
+        printf("Error: The scales need increasing bandwidths and at least one mode each!\n");
+        return CL_INVALID_VALUE;
+    }
+    for (b = 0; b < num_bandwidths; b++)
+    {
+        most = num_modes[b] > most ? num_modes[b] : most;
+        if (num_modes[b] == 0 || (b && !(bandwidths[b] > bandwidths[b - 1])))
+        {
+            printf("Error: The scales need increasing bandwidths and at least one mode each!\n");
+            return CL_INVALID_VALUE;
+        }
+    }
+    shifted = malloc(sizeof(cl_float) * e->dims * most);
+    if (!shifted)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    // The modes of every scale are a handful of seeds, each run being a few small launches. The coarser modes are
+    // few enough to be searched by the host.
+    //
+    memset(timing, 0, sizeof(*timing));
+    for (b = 0; b + 1 < num_bandwidths && err == CL_SUCCESS; b++)
+    {
+        const cl_float *coarser = modes + e->dims * (first + num_modes[b]);
+
+        err = ms_engine_seed(e, modes + e->dims * first, num_modes[b]);
+        if (err == CL_SUCCESS)
+        {
+            err = ms_engine_shift(e, bandwidths[b + 1], shifted, &scale_timing);
+        }
+        for (m = 0; m < num_modes[b] && err == CL_SUCCESS; m++)
+        {
+            double best = INFINITY;
+            cl_uint parent = 0;
+            for (p = 0; p < num_modes[b + 1]; p++)
+            {
+                double dist2 = 0.0;
+                for (k = 0; k < e->dims; k++)
+                {
+                    double diff = shifted[m * e->dims + k] - coarser[p * e->dims + k];
+                    dist2 += diff * diff;
+                }
+                if (dist2 < best)
+                {
+                    best = dist2;
+                    parent = (cl_uint)p;
+                }
+            }
+            parents[first + m] = parent;
+            if (distances)
+            {
+                distances[first + m] = (cl_float)sqrt(best);
+            }
+        }
+        timing->kernel_time += err == CL_SUCCESS ? scale_timing.kernel_time : 0.0;
+        first += num_modes[b];
+    }
+    for (m = 0; m < num_modes[num_bandwidths - 1] && err == CL_SUCCESS; m++)
+    {
+        parents[first + m] = (cl_uint)m;
+        if (distances)
+        {
+            distances[first + m] = 0.0F;
+        }
+    }
+
+    ms_engine_seed(e, NULL, 0);
+    free(shifted);
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef CL_VERSION_2_0
+void *ms_svm_alloc(ms_engine *e, size_t size)
+{
+    int err;
+    void *ptr;
+    cl_device_svm_capabilities svm_caps = 0;
+
+    err = clGetDeviceInfo(e->device_ids[0], CL_DEVICE_SVM_CAPABILITIES, sizeof(svm_caps), &svm_caps, NULL);
+    if (err != CL_SUCCESS || !(svm_caps & (CL_DEVICE_SVM_COARSE_GRAIN_BUFFER | CL_DEVICE_SVM_FINE_GRAIN_BUFFER)))
+    {
+        printf("Error: Device does not support shared virtual memory! %d\n", err);
+        return NULL;
+    }
+    e->svm_fine = (svm_caps & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) != 0;
+
+    ptr = clSVMAlloc(e->context, CL_MEM_READ_WRITE | (e->svm_fine ? CL_MEM_SVM_FINE_GRAIN_BUFFER : 0), size, 0);
+    if (!ptr)
+    {
+        printf("Error: Failed to allocate shared virtual memory!\n");
+        return NULL;
+    }
+
+    // Coarse-grained allocations have to be mapped before the host may touch them, they stay mapped whenever the
+    // kernel is not running
+    //
+    if (!e->svm_fine)
+    {
+        err = clEnqueueSVMMap(e->commands[0], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, ptr, size, 0, NULL, NULL);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to map shared virtual memory! %d\n", err);
+            clSVMFree(e->context, ptr);
+            return NULL;
+        }
+    }
+    return ptr;
+}
+
+void ms_svm_free(ms_engine *e, void *ptr)
+{
+    if (!e->svm_fine)
+    {
+        clEnqueueSVMUnmap(e->commands[0], ptr, 0, NULL, NULL);
+        clFinish(e->commands[0]);
+    }
+    clSVMFree(e->context, ptr);
+}
+
+int ms_engine_run_svm(ms_engine *e, cl_float *points, size_t count, cl_float bandwidth, cl_float *shifted,
+                      ms_timing *timing)
+{
+    int err = CL_SUCCESS;
+    int it;
+    int iterations = e->iterations > 0 ? e->iterations : 1;
+    size_t size = sizeof(cl_float) * e->dims * count;
+    size_t local = compute_group_size(e, e->device_ids[0]);
+    size_t global = round_up(count, local);
+    cl_float *scratch = NULL;  // device only buffer the iterations ping-pong with, ending on the shifted points
+    cl_event *event;
+    cl_event unmap[2] = {0};
+    cl_event map[2] = {0};
+#ifdef MS_STATS
+    cl_uint *counters;  // counters of every iteration
+#endif
+
+    if (e->variant == MS_VARIANT_SYMMETRIC || e->blurring)
+    {
+        printf("Error: Blurring mean shift does not run on shared virtual memory!\n");
+        return CL_INVALID_VALUE;
+    }
+    if (e->variant == MS_VARIANT_ADAPTIVE)
+    {
+        printf("Error: The adaptive kernel does not run on shared virtual memory!\n");
+        return CL_INVALID_VALUE;
+    }
+    if (e->update != MS_UPDATE_PLAIN || e->convergence > 0.0F || e->memo_radius > 0.0F)
+    {
+        printf("Error: Shared virtual memory runs plain iterations only!\n");
+        return CL_INVALID_VALUE;
+    }
+    e->iterations_run = iterations;
+
+    event = calloc(iterations, sizeof(cl_event));
+#ifdef MS_STATS
+    counters = calloc(iterations * STATS_SIZE, sizeof(cl_uint));
+    if (!counters)
+    {
+        free(event);
+        event = NULL;
+    }
+#endif
+    if (!event)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+    if (iterations > 1)
+    {
+        scratch = clSVMAlloc(e->context, CL_MEM_READ_WRITE | (e->svm_fine ? CL_MEM_SVM_FINE_GRAIN_BUFFER : 0), size, 0);
+        if (!scratch)
+        {
+            printf("Error: Failed to allocate shared virtual memory!\n");
+            free(event);
+            return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        }
+    }
+
+    // Hand the points back to the device and pass the shared pointers straight to the kernel. Both inputs of the
+    // kernel read the same allocation, so the points are written once by the host and never copied.
+    //
+    if (!e->svm_fine)
+    {
+        clEnqueueSVMUnmap(e->commands[0], points, 0, NULL, &unmap[0]);
+        clEnqueueSVMUnmap(e->commands[0], shifted, 0, NULL, &unmap[1]);
+    }
+
+    for (it = 0; it < iterations && err == CL_SUCCESS; it++)
+    {
+        cl_float *input = it ? ((iterations - it) % 2 ? scratch : shifted) : points;
+        cl_float *output = (iterations - 1 - it) % 2 ? scratch : shifted;
+
+        err = set_kernel_args(e, 0, input, points, count, count, bandwidth, output, local, 1);
+#ifdef MS_STATS
+        err |= stats_begin(e, 0);
+#endif
+        if (err != CL_SUCCESS)
+        {
+            break;
+        }
+
+        err = clEnqueueNDRangeKernel(e->commands[0], e->kernel, 1, NULL, &global, &local, 0, NULL, &event[it]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error: Failed to execute kernel! %d\n", err);
+            break;
+        }
+#ifdef MS_STATS
+        err = stats_end(e, 0, &counters[it * STATS_SIZE]);
+#endif
+    }
+
+    // Wait for the command commands to get serviced before reading back results. Results in fine-grained SVM are
+    // already visible to the host, coarse-grained ones only need to be mapped again.
+    //
+    finish_queue(e, 0);
+    if (!e->svm_fine)
+    {
+        int map_err = clEnqueueSVMMap(e->commands[0], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, points, size, 0, NULL,
+                                      &map[0]);
+        map_err |= clEnqueueSVMMap(e->commands[0], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, shifted, size, 0, NULL,
+                                   &map[1]);
+        if (map_err != CL_SUCCESS)
+        {
+            printf("Error: Failed to read output array! %d\n", map_err);
+            err = err ? err : map_err;
+        }
+    }
+
+    memset(timing, 0, sizeof(*timing));
+    for (it = 0; it < 2; it++)
+    {
+        if (unmap[it])
+        {
+            profile_event(e, "unmap", 0, -1, unmap[it]);
+            clReleaseEvent(unmap[it]);
+        }
+    }
+    for (it = 0; it < iterations; it++)
+    {
+        if (event[it])
+        {
+            timing->kernel_time += event_time(event[it]);
+            profile_event(e, "kernel", 0, it, event[it]);
+            clReleaseEvent(event[it]);
+        }
+    }
+    for (it = 0; it < 2; it++)
+    {
+        if (map[it])
+        {
+            profile_event(e, "map", 0, -1, map[it]);
+            clReleaseEvent(map[it]);
+        }
+    }
+    timing->device_time[0] = timing->kernel_time;
+    timing->device_share[0] = count;
+
+    if (scratch) clSVMFree(e->context, scratch);
+    free(event);
+
+#ifdef MS_STATS
+    if (err == CL_SUCCESS)
+    {
+        err = stats_gather(e, counters, iterations, count);
+    }
+    free(counters);
+#endif
+    return err;
+}
+#endif
@@ -0,0 +1,366 @@
+///
+/// @file       meanshift_engine.h
+///
+
+// OpenCL setup and execution of the mean shift kernels, shared by the meanshift and meanshift_bench programs.
+// Points are stored row major as `count * dims` floats; the dimension is baked into the program at build time.
+//
+
+#ifndef MEANSHIFT_ENGINE_H
+#define MEANSHIFT_ENGINE_H
+
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 200
+#endif
+#if defined(__APPLE__) || defined(__MACOSX)
+#include <OpenCL/opencl.h>
+#else
+#include <CL/opencl.h>
+#endif
+#include <stddef.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Upper bound of devices (or NUMA sub-devices) used in multi-device mode
+//
+#define MAX_DEVICES (16)
+
+// Floating point operations per evaluated (point, original point) pair: the squared distance, the weight and the
+// weighted accumulation, counting exp() as a single operation
+//
+#define FLOPS_PER_PAIR(dims) (5 * (dims) + 4)
+
+// Upper bound of stages recorded by a profile
+//
+#define MAX_STAGES (1024)
+
+// Upper bound of the neighbour rank giving the bandwidths of the adaptive variant
+//
+#define MAX_KNN (64)
+
+// Upper bound of the bandwidths of a sweep
+//
+#define MAX_SCALES (16)
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Devices an engine runs on
+//
+typedef enum
+{
+    MS_DEVICE_GPU,   // the first GPU
+    MS_DEVICE_CPU,   // the first CPU
+    MS_DEVICE_ALL,   // every device of the first platform
+    MS_DEVICE_NUMA,  // one sub-device per NUMA node of the first CPU
+    MS_NUM_DEVICE_MODES
+} ms_device_mode;
+
+// Implementations of the mean shift kernel
+//
+typedef enum
+{
+    MS_VARIANT_NAIVE,      // every work item streams the original points from global memory
+    MS_VARIANT_TILED,      // work groups stage tiles of the original points in local memory
+    MS_VARIANT_SYMMETRIC,  // blurring only, every pair is weighted once and contributes to both of its points
+    MS_VARIANT_ADAPTIVE,   // every original point weighs with its own bandwidth, see ms_engine_adapt()
+    MS_NUM_VARIANTS
+} ms_variant;
+
+// Rules moving a seed from its position and the weighted mean of the points around it, at every iteration
+//
+typedef enum
+{
+    MS_UPDATE_PLAIN,     // move to the mean
+    MS_UPDATE_RELAXED,   // over-relaxed step along the mean shift, plain as soon as the seed turns back
+    MS_UPDATE_ANDERSON,  // extrapolate along the last two steps of the seed, depth one Anderson acceleration
+    MS_NUM_UPDATES
+} ms_update;
+
+// Bandwidth estimators, from a subsample of the points
+//
+typedef enum
+{
+    MS_ESTIMATOR_SCOTT,      // Scott's rule of thumb, the spread of the points times count^(-1 / (dims + 4))
+    MS_ESTIMATOR_SILVERMAN,  // Silverman's rule of thumb, Scott's with a factor of (4 / (dims + 2))^(1 / (dims + 4))
+    MS_ESTIMATOR_QUANTILE,   // mean distance of the samples to their nearest quantile of samples, as scikit-learn
+    MS_NUM_ESTIMATORS
+} ms_estimator;
+
+// Synthetic data sets produced on the device, with points in [0, 100) per dimension
+//
+typedef enum
+{
+    MS_DATA_DIAGONAL,     // point i is (i, i, ...)
+    MS_DATA_BLOBS,        // isotropic gaussian clusters
+    MS_DATA_UNIFORM,      // uniform noise
+    MS_DATA_ANISOTROPIC,  // sheared gaussian clusters with a different spread per dimension
+    MS_DATA_IMAGE,        // pixel positions followed by noisy piecewise constant colors
+    MS_NUM_DATASETS
+} ms_dataset;
+
+extern const char *DeviceModeNames[MS_NUM_DEVICE_MODES];
+extern const char *VariantNames[MS_NUM_VARIANTS];
+extern const char *DatasetNames[MS_NUM_DATASETS];
+extern const char *UpdateNames[MS_NUM_UPDATES];
+extern const char *EstimatorNames[MS_NUM_ESTIMATORS];
+
+// One timed stage of a run, either a command executed by a device queue or a host stage. Timestamps are in ns on the
+// host monotonic clock, device timestamps are moved onto it with the offset measured when the engine is created.
+// Host stages start as soon as they are queued.
+//
+typedef struct
+{
+    const char *name;  // stage name, a string literal
+    int device;        // index of the device queue, -1 for host stages
+    int iteration;     // kernel iteration, -1 outside of the iterations
+    cl_ulong queued;   // enqueued by the host
+    cl_ulong submit;   // submitted to the device
+    cl_ulong start;    // started executing
+    cl_ulong end;      // finished executing
+} ms_stage;
+
+// Stages recorded by an engine created with profiling, in the order they were recorded
+//
+typedef struct
+{
+    ms_stage stages[MAX_STAGES];
+    int num_stages;
+} ms_profile;
+
+#ifdef MS_STATS
+// Counters of one iteration, accumulated with atomics on the device(s) when the programs are built with MS_STATS
+//
+typedef struct
+{
+    cl_ulong pairs;           // (point, original point) pairs evaluated
+    cl_ulong weighted_pairs;  // pairs with a weight above 1e-6 of the peak weight
+    cl_uint active;           // points which moved by at least the tolerance
+    float max_shift;          // longest shift of a point
+    double mean_shift;        // average shift of the points
+} ms_stats;
+#endif
+
+// Compute device(s), context and kernel built for one dimension and one kernel variant
+//
+typedef struct
+{
+    cl_device_id device_ids[MAX_DEVICES];    // compute device ids
+    cl_uint num_devices;                     // number of compute devices in use
+    cl_uint num_sub_devices;                 // number of those devices that are NUMA sub-devices
+    cl_context context;                      // compute context
+    cl_command_queue commands[MAX_DEVICES];  // compute command queue of each device
+    cl_program program;                      // compute program
+    cl_kernel kernel;                        // compute kernel
+    cl_kernel generator;                     // synthetic data set kernel
+    cl_kernel binner;                        // bin seeding kernels, counting the points of each cell of a grid
+    cl_kernel bin_seeder;                    // and turning the cells with enough points into seeds
+    cl_kernel assigner;                      // nearest mode kernel, for a few modes
+    cl_kernel grid_assigner;                 // nearest mode kernel, for many modes
+    cl_kernel normalizer;                    // division of the sums of the symmetric kernel
+    cl_kernel updater;                       // update rule of the seeds
+    cl_kernel memoizer;                      // retirement and compaction of the seeds of a memoized run
+    cl_kernel estimator;                     // quick shift kernels, computing the density of every point
+    cl_kernel linker;                        // and linking it to its nearest denser neighbour
+    cl_kernel knn;                           // nearest neighbour bandwidths of the adaptive variant
+    cl_kernel sampler;                       // bandwidth estimation kernels, taking a subsample of the points
+    cl_kernel quantiler;                     // and finding the distance of every sample to its k-th nearest
+    cl_kernel sweeper;                       // mean shift at several bandwidths at once
+    cl_kernel whitener;                      // transform of the points by the inverse factor of a bandwidth matrix
+    cl_mem points[MAX_DEVICES];              // replica of the points on each device
+    size_t count;                            // number of points
+    cl_mem seeds[MAX_DEVICES];               // replica of the seeds on each device, if any
+    size_t num_seeds;                        // number of seeds, 0 when the points are their own seeds
+    cl_mem bandwidths[MAX_DEVICES];          // replica of the bandwidths of the points on each device, if adapted
+    double upload_time;                      // time taken to write the points to the devices, in ms
+    ms_variant variant;                      // implementation of the compute kernel
+    size_t dims;                             // dimension of the points
+    double build_time;                       // time taken to build the program, in ms
+    int svm_fine;                            // shared virtual memory allocations are fine-grained
+    int iterations;                          // number of mean shift iterations executed by a run, at most
+    int iterations_run;                      // iterations executed by the last run, on the slowest converging device
+    ms_update update;                        // rule moving the seeds at every iteration
+    cl_float relaxation;                     // step factor of the relaxed rule, in (1, 2)
+    cl_float convergence;                    // stop once every seed moves less than this, 0 runs every iteration
+    cl_float memo_radius;                    // stop trajectories this close to a converged one, 0 disables it
+    int blurring;                            // blurring mean shift, the points move along with the seeds
+    ms_profile *profile;                     // stages of every run, when profiling
+    cl_long clock_offset[MAX_DEVICES];       // host minus device clock of each device, in ns
+    double throughput[MAX_DEVICES];          // seeds per ms of each device, measured by the first multi-device shift
+#ifdef MS_STATS
+    cl_float tolerance;                 // points shifted by less than this are counted as converged
+    cl_mem stats_buffers[MAX_DEVICES];  // counters of the running iteration on each device
+    ms_stats *stats;                    // counters of every iteration of the last run
+#endif
+} ms_engine;
+
+// Timings of one run, in ms
+//
+typedef struct
+{
+    double kernel_time;                // slowest device, from the kernel profiling events of every iteration
+    double transfer_time;              // sum of every buffer write and read
+    double device_time[MAX_DEVICES];   // kernel time of each device
+    size_t device_share[MAX_DEVICES];  // number of points shifted by each device
+} ms_timing;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Look up an enum value by name, returns -1 when the name is unknown
+//
+int ms_device_mode_from_name(const char *name);
+int ms_variant_from_name(const char *name);
+int ms_dataset_from_name(const char *name);
+int ms_update_from_name(const char *name);
+int ms_estimator_from_name(const char *name);
+
+// Connect to the device(s), create the context and queues and build the kernel. Returns a CL error code and prints
+// the reason of a failure. When a profile is given, every stage of the engine is recorded to it, from the device
+// discovery onwards.
+//
+int ms_engine_create(ms_engine *e, ms_device_mode mode, ms_variant variant, size_t dims, ms_profile *profile);
+void ms_engine_release(ms_engine *e);
+
+// Place `count` points on every device of the engine, either written from the host or generated on the devices from
+// a seed. Generated data sets are identical whatever the device, and never cross the bus.
+//
+int ms_engine_upload(ms_engine *e, const cl_float *data, size_t count);
+int ms_engine_generate(ms_engine *e, ms_dataset dataset, size_t count, cl_uint seed, cl_uint clusters);
+
+// Place `count` points on every device of the engine from host memory which outlives them, such as a mapped file.
+// CPU devices use the memory in place through CL_MEM_USE_HOST_PTR, without any copy; the runtime may still copy
+// when the memory is not aligned as it requires, usually to a page. Other devices get the points written. The devices
+// may use the memory until ms_engine_detach() releases the points, which must come before it is freed or reused. A
+// failed attach leaves the engine without points.
+//
+int ms_engine_attach(ms_engine *e, const cl_float *data, size_t count);
+void ms_engine_detach(ms_engine *e);
+int ms_engine_download(ms_engine *e, cl_float *data);
+
+// Shift `num_seeds` seeds against the points of the engine instead of the points themselves, such as a grid, a
+// subsample of the points or the modes of a previous run; the results then hold one shifted point per seed. The seeds
+// are kept when other points are placed on the engine, a NULL set of 0 seeds goes back to shifting the points.
+//
+int ms_engine_seed(ms_engine *e, const cl_float *seeds, size_t num_seeds);
+
+// Seed the engine from a grid of cell size `cell` over its points, usually the bandwidth: every cell holding at least
+// `min_count` points gives a seed at its center. The points are binned on the first device into a hash table of
+// cells, the centers are written to `seeds`, which must have room for as many points as the engine holds, and then
+// placed on every device.
+//
+int ms_engine_bin_seed(ms_engine *e, cl_float cell, cl_uint min_count, cl_float *seeds);
+
+// Label every point of the engine with its nearest mode and the distance to it, typically after shifting a seed set
+// smaller than the points. The points are split evenly across the devices. Up to a few hundred modes, every work
+// group goes through all of them tile by tile in local memory; beyond that they are sorted into a grid over their
+// first two coordinates, which each point searches outwards from its own cell.
+//
+int ms_engine_assign(ms_engine *e, const cl_float *modes, size_t num_modes, cl_uint *labels, cl_float *distances);
+
+// Quick shift over the points of the engine, a one pass alternative to the mean shift iterations. The density of
+// every point is estimated with the gaussian kernel of the mean shift, then every point is linked to its nearest
+// neighbour of higher density closer than `max_distance`, or to itself when there is none. The links form a forest
+// whose roots are the modes. `parents` and `densities` get one value per point. Both passes split the points evenly
+// across the devices, the densities going through the host in between.
+//
+int ms_engine_quick_shift(ms_engine *e, cl_float bandwidth, cl_float max_distance, cl_uint *parents,
+                          cl_float *densities, ms_timing *timing);
+
+// Estimate a bandwidth for the points of the engine from `num_samples` of them spread evenly over the data set, all of
+// them when 0, on the first device. The rules of thumb take the spread of the samples, the root mean variance of their
+// coordinates, and scale it to the number of points; they suit a single gaussian-like cluster and oversmooth several.
+// The quantile estimator is scikit-learn's estimate_bandwidth(): the mean distance of every sample to its k-th nearest
+// sample, itself included, k being `quantile` of the samples, a fraction in (0, 1]. It is quadratic in the number of
+// samples, all of them being compared on the device. Returns a CL error code, the bandwidth in `bandwidth`.
+//
+int ms_engine_estimate_bandwidth(ms_engine *e, ms_estimator estimator, cl_float quantile, size_t num_samples,
+                                 cl_float *bandwidth);
+
+// Give every point of the engine its own bandwidth for the adaptive variant: the distance to its `k`-th nearest
+// neighbour, `k` being at most MAX_KNN, and at least `min_bandwidth` so that duplicated points keep a finite weight.
+// Dense regions then get a narrow kernel which keeps close clusters apart, and sparse ones a wide kernel which still
+// reaches the points of their tail. The points are split evenly across the devices, the bandwidths are written to
+// `bandwidths`, one per point, and then placed on every device. They are dropped when other points are placed on the
+// engine.
+//
+int ms_engine_adapt(ms_engine *e, cl_uint k, cl_float min_bandwidth, cl_float *bandwidths);
+
+// Give the gaussian kernel a full bandwidth matrix `matrix`, `dims * dims` values in row major order, symmetric and
+// positive definite, instead of the isotropic h^2 I of a single bandwidth h; a diagonal matrix holds the squares of
+// per-dimension bandwidths. The host factors it as L L^T, then the points and seeds of every device are replaced by
+// their whitened copies L^-1 x, so that the Mahalanobis distances under the matrix become plain distances and every
+// kernel runs unchanged with a bandwidth of 1. Shifted points and modes are in whitened coordinates, multiplying them
+// by L, written to `factor` in row major order, takes them back. The bandwidths of the adaptive variant are dropped.
+//
+int ms_engine_whiten(ms_engine *e, const cl_float *matrix, cl_float *factor);
+
+// Shift the seeds of the engine, or its points when it has no seeds, against its points `e->iterations` times, with
+// the shifting partitioned across the devices proportionally to their throughput, measured by the first call and kept
+// by the engine. ms_engine_run() uploads the points first. The adaptive variant needs the bandwidths of
+// ms_engine_adapt(), and does not blur.
+//
+// With `e->blurring` set the points are shifted against themselves and every iteration shifts the output of the
+// previous one against itself, so the reference set contracts along with the points and converges in fewer
+// iterations. As every launch then depends on every shifted point, blurring runs on the first device only; it is the
+// only mode of the symmetric variant.
+//
+// The seeds move by `e->update`. With a `e->convergence` distance the run stops as soon as every seed of a device
+// moves less than it, which the host checks after every iteration; `e->iterations_run` then tells how many were
+// needed. The accelerated rules keep the previous step of every seed on the device and need fewer iterations than
+// plain mean shift to converge near flat modes, where its steps shrink slowly. They do not apply to blurring.
+//
+// With a `e->memo_radius` the basins of attraction are memoized on the first device: the positions every trajectory
+// goes through are recorded in a hash table of cells of that size, and a trajectory coming within the radius of a
+// position of a converged one stops there and takes over its end point. Only the seeds still moving are shifted at
+// each iteration, so dense clusters, where trajectories soon run into each other, cost a few iterations of a few
+// seeds. The end points are those of neighbouring trajectories, a small fraction of the bandwidth away at most from
+// the mode the seed would have reached. The memoization is approximate: only the cell of a position is looked up, so
+// a converged trajectory within the radius but across a cell border is missed and the seed keeps moving. A
+// convergence distance is required.
+//
+int ms_engine_shift(ms_engine *e, cl_float bandwidth, cl_float *results, ms_timing *timing);
+int ms_engine_run(ms_engine *e, const cl_float *data, size_t count, cl_float bandwidth, cl_float *results,
+                  ms_timing *timing);
+
+// Shift the seeds of the engine, or its points, at `num_bandwidths` bandwidths in a single pass, up to MAX_SCALES:
+// every work item follows one trajectory per bandwidth and weighs each original point it loads at every scale, which
+// replaces a sweep of separate runs for model selection. `results` gets `num_bandwidths` sets of shifted seeds, one
+// after the other. The runs are plain mean shift for `e->iterations` iterations, or until every trajectory moves less
+// than `e->convergence`; the seeds are split evenly across the devices. The compute kernel of the engine and its
+// variant are not used, nor are per-iteration counters collected.
+//
+int ms_engine_shift_multi(ms_engine *e, const cl_float *bandwidths, size_t num_bandwidths, cl_float *results,
+                          ms_timing *timing);
+
+// Link the modes found at increasing `bandwidths`, such as those of a sweep, into a scale-space tree: the modes of
+// every scale are shifted with the kernel of the next coarser bandwidth, as seeds of the engine, and linked to the
+// nearest mode of that scale. `modes` holds the `num_modes[k]` modes of every scale k one scale after the other, and
+// `parents` gets one index per mode into the modes of the next scale, the modes of the coarsest scale being their
+// own parents. `distances`, unless NULL, gets the distance of every shifted mode to its parent. The runs follow
+// `e->iterations` and `e->convergence` like ms_engine_shift() and the kernel times add up in `timing`; the engine is
+// left without seeds.
+//
+int ms_engine_link_scales(ms_engine *e, const cl_float *bandwidths, size_t num_bandwidths, const cl_float *modes,
+                          const size_t *num_modes, cl_uint *parents, cl_float *distances, ms_timing *timing);
+
+// Host monotonic clock in ns, and recording of a host stage which started at `start` and ends now. Recording into a
+// NULL profile does nothing.
+//
+cl_ulong ms_profile_clock(void);
+void ms_profile_host(ms_profile *p, const char *name, cl_ulong start);
+
+// Write the stages of a profile as a Chrome trace event file, viewable in chrome://tracing or ui.perfetto.dev, with
+// one track for the host thread and one per device queue of the engine. Returns -1 when the file cannot be written.
+//
+int ms_profile_write_trace(const ms_profile *p, const ms_engine *e, const char *path);
+
+#ifdef CL_VERSION_2_0
+// Shared virtual memory on the first device of the engine. ms_svm_alloc() returns memory the host may write to right
+// away; ms_engine_run_svm() hands it to the kernel without any copy and leaves the results readable by the host.
+//
+void *ms_svm_alloc(ms_engine *e, size_t size);
+void ms_svm_free(ms_engine *e, void *ptr);
+int ms_engine_run_svm(ms_engine *e, cl_float *points, size_t count, cl_float bandwidth, cl_float *shifted,
+                      ms_timing *timing);
+#endif
+
+#endif  // MEANSHIFT_ENGINE_H
@@ -0,0 +1,725 @@
+///
+/// @file       meanshift_io.c
+///
+
+#include "meanshift_io.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define NPY_MAGIC "\x93NUMPY"
+#define NPY_MAGIC_SIZE (6)
+
+// Text files are parsed by up to MAX_THREADS threads, each one getting at least MIN_CHUNK_SIZE bytes
+//
+#define MAX_THREADS (64)
+#define MIN_CHUNK_SIZE (1 << 20)
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Parse the header of a .npy file: the version, the length of the header and a python dictionary literal such as
+// {'descr': '<f4', 'fortran_order': False, 'shape': (1000, 3), }. Returns the offset of the data, or 0 when the file
+// does not hold a float32 array the points can be read from.
+//
+static size_t parse_npy_header(const unsigned char *bytes, size_t size, size_t *count, size_t *dims)
+{
+    size_t header_size;
+    size_t offset;
+    char header[4096];
+    const char *field;
+    char *end;
+
+    if (size < NPY_MAGIC_SIZE + 4 || (bytes[NPY_MAGIC_SIZE] != 1 && size < NPY_MAGIC_SIZE + 6))
+    {
+        return 0;
+    }
+    if (bytes[NPY_MAGIC_SIZE] == 1)
+    {
+        header_size = bytes[8] | (size_t)bytes[9] << 8;
+        offset = 10;
+    }
+    else
+    {
+        header_size = bytes[8] | (size_t)bytes[9] << 8 | (size_t)bytes[10] << 16 | (size_t)bytes[11] << 24;
+        offset = 12;
+    }
+    if (header_size >= sizeof(header) || offset + header_size > size)
+    {
+        return 0;
+    }
+    memcpy(header, bytes + offset, header_size);
+    header[header_size] = '\0';
+
+    if (!strstr(header, "'descr': '<f4'") || !strstr(header, "'fortran_order': False"))
+    {
+        printf("Error: Only C ordered little endian float32 arrays are supported!\n");
+        return 0;
+    }
+
+    field = strstr(header, "'shape': (");
+    if (!field)
+    {
+        return 0;
+    }
+    field += strlen("'shape': (");
+    *count = strtoul(field, &end, 10);
+    *dims = 1;
+    if (end[0] == ',' && end[1] == ' ')
+    {
+        *dims = strtoul(end + 2, &end, 10);
+        end = *end == ')' ? end + 1 : NULL;
+    }
+    else
+    {
+        end = end[0] == ',' && end[1] == ')' ? end + 2 : NULL;
+    }
+    if (!end || !*dims)
+    {
+        printf("Error: Only one and two dimensional arrays are supported!\n");
+        return 0;
+    }
+    return offset + header_size;
+}
+
+// Chunk of a text file handled by one thread, made of whole lines
+//
+typedef struct
+{
+    const char *begin;  // first byte of the chunk
+    const char *end;    // one past the last byte of the chunk
+    size_t dims;        // values expected on every line
+    size_t count;       // points of the chunk, counted by the first pass
+    float *output;      // first value of the chunk in the points, for the second pass
+    const char *error;  // first malformed line, if any
+} csv_chunk;
+
+static const float Powers10[] = {1e0F, 1e1F, 1e2F, 1e3F, 1e4F, 1e5F, 1e6F, 1e7F, 1e8F, 1e9F, 1e10F};
+
+static int is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// SWAR digit parsing: eight ASCII characters loaded as one little endian word are checked and converted at once,
+// with three multiplications instead of eight
+//
+static int is_eight_digits(uint64_t word)
+{
+    return !(((word + 0x4646464646464646ULL) | (word - 0x3030303030303030ULL)) & 0x8080808080808080ULL);
+}
+
+static uint64_t parse_eight_digits(uint64_t word)
+{
+    const uint64_t mask = 0x000000FF000000FFULL;
+    const uint64_t mul1 = 0x000F424000000064ULL;  // 100 + (1000000 << 32)
+    const uint64_t mul2 = 0x0000271000000001ULL;  // 1 + (10000 << 32)
+
+    word -= 0x3030303030303030ULL;
+    word = word * 10 + (word >> 8);
+    return (((word & mask) * mul1) + (((word >> 16) & mask) * mul2)) >> 32;
+}
+
+// Parse the digits at `p`, accumulating them into `mantissa`, and return the first byte which is not a digit. Runs
+// of eight digits go through the SWAR path as long as they stay within the end of the chunk.
+//
+static const char *parse_digits(const char *p, const char *end, uint64_t *mantissa, int *digits)
+{
+    uint64_t word;
+
+    while (end - p >= 8)
+    {
+        memcpy(&word, p, sizeof(word));
+        if (!is_eight_digits(word))
+        {
+            break;
+        }
+        *mantissa = *mantissa * 100000000 + parse_eight_digits(word);
+        *digits += 8;
+        p += 8;
+    }
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        *mantissa = *mantissa * 10 + (*p - '0');
+        *digits += 1;
+        p++;
+    }
+    return p;
+}
+
+// Parse one decimal value such as -12.5e-3. Values whose digits do not fit the 24 bits of a float mantissa, exponents
+// beyond the powers of ten exact in a float, or special values go through strtof(). Returns NULL when there is no
+// value.
+//
+static const char *parse_value(const char *p, const char *end, float *value)
+{
+    const char *start = p;
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int fraction = 0;
+    int exponent = 0;
+    int negative = 0;
+    float result;
+
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        p++;
+    }
+    p = parse_digits(p, end, &mantissa, &digits);
+    if (p < end && *p == '.')
+    {
+        const char *dot = ++p;
+        p = parse_digits(p, end, &mantissa, &digits);
+        fraction = (int)(p - dot);
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        int exponent_negative = 0;
+        p++;
+        if (p < end && (*p == '-' || *p == '+'))
+        {
+            exponent_negative = *p == '-';
+            p++;
+        }
+        while (p < end && *p >= '0' && *p <= '9' && exponent < 10000)
+        {
+            exponent = exponent * 10 + (*p++ - '0');
+        }
+        exponent = exponent_negative ? -exponent : exponent;
+    }
+    exponent -= fraction;
+
+    if (digits == 0 || digits > 19 || exponent < -10 || exponent > 10 || mantissa > (1ULL << 24))
+    {
+        char buffer[64];
+        char *stop;
+        size_t length = 0;
+
+        while (start + length < end && length < sizeof(buffer) - 1 && start[length] != ',' && start[length] != '\n' &&
+               !is_blank(start[length]))
+        {
+            length++;
+        }
+        memcpy(buffer, start, length);
+        buffer[length] = '\0';
+        *value = strtof(buffer, &stop);
+        return stop == buffer ? NULL : start + (stop - buffer);
+    }
+
+    // Both the mantissa and the power of ten are exact floats, so the value is rounded once, by the float product or
+    // quotient, and matches strtof() and the float32 files bit for bit
+    //
+    result = exponent < 0 ? (float)mantissa / Powers10[-exponent] : (float)mantissa * Powers10[exponent];
+    *value = negative ? -result : result;
+    return p;
+}
+
+// Return the start of the next line, or `end`
+//
+static const char *next_line(const char *p, const char *end)
+{
+    const char *newline = memchr(p, '\n', end - p);
+    return newline ? newline + 1 : end;
+}
+
+// A line holds a point unless it only has blanks
+//
+static int has_point(const char *p, const char *end)
+{
+    while (p < end && is_blank(*p))
+    {
+        p++;
+    }
+    return p < end && *p != '\n';
+}
+
+// Values of a line separated by commas, or by blanks alone
+//
+static size_t count_values(const char *p, const char *end)
+{
+    size_t values = 0;
+    float value;
+
+    while (p < end && *p != '\n')
+    {
+        while (p < end && (is_blank(*p) || *p == ','))
+        {
+            p++;
+        }
+        if (p == end || *p == '\n' || !(p = parse_value(p, end, &value)))
+        {
+            break;
+        }
+        values++;
+    }
+    return values;
+}
+
+static void *count_chunk(void *arg)
+{
+    csv_chunk *chunk = arg;
+    const char *p;
+
+    for (p = chunk->begin; p < chunk->end; p = next_line(p, chunk->end))
+    {
+        chunk->count += has_point(p, chunk->end);
+    }
+    return NULL;
+}
+
+static void *parse_chunk(void *arg)
+{
+    csv_chunk *chunk = arg;
+    const char *p = chunk->begin;
+    float *output = chunk->output;
+    size_t k;
+
+    while (p < chunk->end && !chunk->error)
+    {
+        const char *line = p;
+        if (!has_point(p, chunk->end))
+        {
+            p = next_line(p, chunk->end);
+            continue;
+        }
+
+        for (k = 0; k < chunk->dims && p; k++)
+        {
+            while (p < chunk->end && is_blank(*p))
+            {
+                p++;
+            }
+            if (k > 0)
+            {
+                p = p < chunk->end && *p == ',' ? p + 1 : p;
+                while (p < chunk->end && is_blank(*p))
+                {
+                    p++;
+                }
+            }
+            p = parse_value(p, chunk->end, output++);
+        }
+        while (p && p < chunk->end && is_blank(*p))
+        {
+            p++;
+        }
+        if (!p || (p < chunk->end && *p != '\n'))
+        {
+            chunk->error = line;
+            break;
+        }
+        p = next_line(p, chunk->end);
+    }
+    return NULL;
+}
+
+// Parse a comma (or blank) separated text file into a page aligned buffer, which CPU devices can use in place. The
+// file is split into one chunk per thread at line boundaries; a first pass counts the points of every chunk, so that
+// the second one parses each chunk straight to its place in the buffer. A first line which does not start with a
+// number is a header and is skipped.
+//
+static int parse_text(ms_points_file *file, const char *path, const char *text, size_t size)
+{
+    csv_chunk chunks[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];  // the thread of the chunk is running, the caller handles the chunk otherwise
+    const char *begin = text;
+    const char *end = text + size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t num_chunks;
+    size_t c;
+    size_t count = 0;
+    void *buffer = NULL;
+
+    while (begin < end && !has_point(begin, end))
+    {
+        begin = next_line(begin, end);
+    }
+    for (c = 0; begin + c < end && is_blank(begin[c]); c++)
+    {
+    }
+    if (begin + c < end && !strchr("+-.0123456789", begin[c]))
+    {
+        begin = next_line(begin, end);
+    }
+    file->dims = count_values(begin, end);
+    if (!file->dims)
+    {
+        printf("Error: No points in '%s'!\n", path);
+        return -1;
+    }
+
+    // Split at the first line starting after every chunk boundary
+    //
+    num_chunks = (end - begin) / MIN_CHUNK_SIZE + 1;
+    num_chunks = num_chunks < (size_t)(cpus > 0 ? cpus : 1) ? num_chunks : (size_t)(cpus > 0 ? cpus : 1);
+    num_chunks = num_chunks < MAX_THREADS ? num_chunks : MAX_THREADS;
+    memset(chunks, 0, sizeof(chunks));
+    for (c = 0; c < num_chunks; c++)
+    {
+        chunks[c].begin = c ? chunks[c - 1].end : begin;
+        chunks[c].end = c + 1 < num_chunks ? next_line(begin + (end - begin) * (c + 1) / num_chunks - 1, end) : end;
+        chunks[c].end = chunks[c].end > chunks[c].begin ? chunks[c].end : chunks[c].begin;
+        chunks[c].dims = file->dims;
+    }
+
+    for (c = 1; c < num_chunks; c++)
+    {
+        started[c] = pthread_create(&threads[c], NULL, count_chunk, &chunks[c]) == 0;
+    }
+    count_chunk(&chunks[0]);
+    for (c = 1; c < num_chunks; c++)
+    {
+        if (started[c])
+        {
+            pthread_join(threads[c], NULL);
+        }
+        else
+        {
+            count_chunk(&chunks[c]);
+        }
+    }
+
+    // Place every chunk in the buffer, rounded up to whole pages
+    //
+    for (c = 0; c < num_chunks; c++)
+    {
+        count += chunks[c].count;
+    }
+    file->count = count;
+    file->size = ((sizeof(float) * count * file->dims + page - 1) / page) * page;
+    if (posix_memalign(&buffer, page, file->size ? file->size : page) != 0)
+    {
+        printf("Error: Failed to allocate host memory!\n");
+        return -1;
+    }
+    file->buffer = buffer;
+    for (c = 0, count = 0; c < num_chunks; c++)
+    {
+        chunks[c].output = file->buffer + count * file->dims;
+        count += chunks[c].count;
+    }
+
+    for (c = 1; c < num_chunks; c++)
+    {
+        started[c] = pthread_create(&threads[c], NULL, parse_chunk, &chunks[c]) == 0;
+    }
+    parse_chunk(&chunks[0]);
+    for (c = 1; c < num_chunks; c++)
+    {
+        if (started[c])
+        {
+            pthread_join(threads[c], NULL);
+        }
+        else
+        {
+            parse_chunk(&chunks[c]);
+        }
+    }
+
+    for (c = 0; c < num_chunks; c++)
+    {
+        if (chunks[c].error)
+        {
+            printf("Error: Malformed line at byte %zu of '%s', expected %zu values!\n",
+                   (size_t)(chunks[c].error - text), path, file->dims);
+            return -1;
+        }
+    }
+    file->data = file->buffer;
+    return 0;
+}
+
+static int has_extension(const char *path, const char *extension)
+{
+    size_t length = strlen(path);
+    size_t extension_length = strlen(extension);
+    return length >= extension_length && strcasecmp(path + length - extension_length, extension) == 0;
+}
+
+int ms_points_open(ms_points_file *file, const char *path, size_t dims)
+{
+    int fd;
+    struct stat st;
+    size_t offset = 0;
+
+    memset(file, 0, sizeof(*file));
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        printf("Error: Failed to open '%s'!\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    // Text files are mapped read only and parsed into a buffer of their own
+    //
+    if (has_extension(path, ".csv") || has_extension(path, ".txt"))
+    {
+        size_t size = st.st_size;
+        void *text = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        int status;
+
+        close(fd);
+        if (text == MAP_FAILED)
+        {
+            printf("Error: Failed to map '%s'!\n", path);
+            return -1;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(text, size, MADV_SEQUENTIAL);
+#endif
+        status = parse_text(file, path, text, size);
+        munmap(text, size);
+        if (status != 0)
+        {
+            ms_points_close(file);
+        }
+        return status;
+    }
+
+    // Map the whole file privately: pages are read on demand and the runtime may use them as they are
+    //
+    file->size = st.st_size;
+    file->mapping = file->size ? mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (file->mapping == MAP_FAILED)
+    {
+        printf("Error: Failed to map '%s'!\n", path);
+        file->mapping = NULL;
+        return -1;
+    }
+
+    if (file->size >= NPY_MAGIC_SIZE && memcmp(file->mapping, NPY_MAGIC, NPY_MAGIC_SIZE) == 0)
+    {
+        offset = parse_npy_header(file->mapping, file->size, &file->count, &file->dims);
+        if (!offset || file->count > SIZE_MAX / sizeof(float) / file->dims ||
+            sizeof(float) * file->count * file->dims > file->size - offset)
+        {
+            printf("Error: Invalid .npy file '%s'!\n", path);
+            ms_points_close(file);
+            return -1;
+        }
+    }
+    else
+    {
+        file->dims = dims;
+        file->count = dims ? file->size / (sizeof(float) * dims) : 0;
+        if (!dims || file->size % (sizeof(float) * dims) != 0)
+        {
+            printf("Error: Size of '%s' is not a multiple of %zu floats!\n", path, dims);
+            ms_points_close(file);
+            return -1;
+        }
+    }
+
+    file->data = (const float *)((const unsigned char *)file->mapping + offset);
+#ifdef MADV_SEQUENTIAL
+    madvise(file->mapping, file->size, MADV_SEQUENTIAL);
+#endif
+    return 0;
+}
+
+void ms_points_close(ms_points_file *file)
+{
+    if (file->mapping)
+    {
+        munmap(file->mapping, file->size);
+    }
+    free(file->buffer);
+    memset(file, 0, sizeof(*file));
+}
+
+// Round a size up to whole pages
+//
+static size_t page_round(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+int ms_result_create(ms_result_file *file, const char *path, size_t count, size_t dims, float bandwidth)
+{
+    ms_result_header header;
+    void *mapping;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = MS_RESULT_MAGIC;
+    header.version = MS_RESULT_VERSION;
+    header.dims = (uint32_t)dims;
+    header.count = count;
+    header.num_seeds = count;
+    header.points_offset = page_round(sizeof(header));
+    header.labels_offset = header.points_offset + page_round(sizeof(float) * count * dims);
+    header.distances_offset = header.labels_offset + page_round(sizeof(uint32_t) * count);
+    header.matrix_offset = header.distances_offset + page_round(sizeof(float) * count);
+    header.modes_offset = header.matrix_offset + page_round(sizeof(float) * dims * dims);
+
+    memset(file, 0, sizeof(*file));
+    file->size = header.modes_offset + page_round(sizeof(float) * count * dims);
+    file->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file->fd < 0 || ftruncate(file->fd, file->size) != 0)
+    {
+        printf("Error: Failed to create '%s'!\n", path);
+        if (file->fd >= 0) close(file->fd);
+        return -1;
+    }
+
+    // A shared mapping, so that whatever the device reads back lands in the file
+    //
+    mapping = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        printf("Error: Failed to map '%s'!\n", path);
+        close(file->fd);
+        return -1;
+    }
+    file->header = mapping;
+    memcpy(file->header, &header, sizeof(header));
+    file->points = (float *)((char *)mapping + header.points_offset);
+    file->labels = (uint32_t *)((char *)mapping + header.labels_offset);
+    file->distances = (float *)((char *)mapping + header.distances_offset);
+    file->matrix = (float *)((char *)mapping + header.matrix_offset);
+    file->modes = (float *)((char *)mapping + header.modes_offset);
+    ms_result_set_bandwidth(file, bandwidth, NULL);
+    return 0;
+}
+
+void ms_result_set_bandwidth(ms_result_file *file, float bandwidth, const float *matrix)
+{
+    size_t dims = file->header->dims;
+    size_t r, c;
+
+    file->header->bandwidth = matrix ? 0.0F : bandwidth;
+    for (r = 0; r < dims; r++)
+    {
+        for (c = 0; c < dims; c++)
+        {
+            file->matrix[r * dims + c] = matrix ? matrix[r * dims + c] : r == c ? bandwidth * bandwidth : 0.0F;
+        }
+    }
+}
+
+size_t ms_merge_modes(const float *shifted, size_t count, size_t dims, float radius, float *modes, uint32_t *labels)
+{
+    size_t num_modes = 0;
+    size_t i, m, k;
+
+    for (i = 0; i < count; i++)
+    {
+        const float *point = &shifted[i * dims];
+        for (m = 0; m < num_modes; m++)
+        {
+            float dist2 = 0.0F;
+            for (k = 0; k < dims; k++)
+            {
+                float diff = point[k] - modes[m * dims + k];
+                dist2 += diff * diff;
+            }
+            if (dist2 < radius * radius)
+            {
+                break;
+            }
+        }
+
+        if (m == num_modes)
+        {
+            memcpy(&modes[num_modes * dims], point, sizeof(float) * dims);
+            num_modes++;
+        }
+        if (labels)
+        {
+            labels[i] = (uint32_t)m;
+        }
+    }
+    return num_modes;
+}
+
+int ms_result_close(ms_result_file *file, size_t num_seeds, size_t num_modes)
+{
+    int status = 0;
+
+    if (file->header)
+    {
+        size_t size;
+
+        file->header->num_seeds = num_seeds;
+        file->header->num_modes = num_modes;
+        size = file->header->modes_offset + sizeof(float) * file->header->num_modes * file->header->dims;
+        munmap(file->header, file->size);
+        status = ftruncate(file->fd, size);
+        close(file->fd);
+    }
+    memset(file, 0, sizeof(*file));
+    return status == 0 ? 0 : -1;
+}
+
+int ms_stream_read(FILE *stream, ms_frame_header *header, float **points, size_t *capacity)
+{
+    size_t size;
+
+    if (fread(header, sizeof(*header), 1, stream) != 1 || header->count == 0)
+    {
+        return 0;
+    }
+    if (header->magic != MS_FRAME_MAGIC || header->dims == 0 || header->count > SIZE_MAX / sizeof(float) / header->dims)
+    {
+        printf("Error: Invalid frame header!\n");
+        return -1;
+    }
+
+    // Grow the buffer to whole pages, CPU devices use it in place
+    //
+    size = sizeof(float) * header->count * header->dims;
+    if (size > *capacity)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        void *buffer = NULL;
+
+        free(*points);
+        *points = NULL;
+        *capacity = 0;
+        if (posix_memalign(&buffer, page, (size + page - 1) / page * page) != 0)
+        {
+            printf("Error: Failed to allocate host memory!\n");
+            return -1;
+        }
+        *points = buffer;
+        *capacity = (size + page - 1) / page * page;
+    }
+
+    if (fread(*points, sizeof(float) * header->dims, header->count, stream) != header->count)
+    {
+        printf("Error: Truncated frame of %llu points!\n", (unsigned long long)header->count);
+        return -1;
+    }
+    return 1;
+}
+
+int ms_stream_write(FILE *stream, const float *points, size_t count, size_t dims)
+{
+    ms_frame_header header;
+
+    header.magic = MS_FRAME_MAGIC;
+    header.dims = (uint32_t)dims;
+    header.count = count;
+    if (fwrite(&header, sizeof(header), 1, stream) != 1 ||
+        fwrite(points, sizeof(float) * dims, count, stream) != count || fflush(stream) != 0)
+    {
+        printf("Error: Failed to write frame!\n");
+        return -1;
+    }
+    return 0;
+}
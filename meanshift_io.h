@@ -0,0 +1,134 @@
+///
+/// @file       meanshift_io.h
+///
+
+// Point files mapped into memory, so that the points can be given to the engine without being parsed or copied.
+// Three formats are supported:
+//     - raw little endian float32 values, `count * dims` of them, the dimension being given by the caller
+//     - NumPy .npy files holding a C ordered little endian float32 array of shape (count, dims) or (count,)
+//     - .csv or .txt files with one point per line, values separated by commas or blanks and an optional header
+//       line; these are parsed in parallel into a page aligned buffer
+//
+// Results can be written to a file mapped into memory: the shifted seeds are read back from the device straight into
+// its pages, then they are merged into modes and the points labelled in place. The file starts with an
+// `ms_result_header` giving the offset of every section, each section starting on a page boundary:
+//     - shifted seeds, `num_seeds * dims` float32 values, one per point when the points are their own seeds
+//     - labels, `count` uint32 values, the index of the mode of every point
+//     - distances, `count` float32 values, from every point to its mode
+//     - bandwidth matrix, `dims * dims` float32 values in row major order, the covariance of the gaussian kernel
+//     - modes, `num_modes * dims` float32 values
+// Every section is in the coordinates of the points, whatever bandwidth matrix the run used.
+//
+// Points can also be streamed through a pipe as a sequence of frames, each one made of an `ms_frame_header` followed
+// by `count * dims` little endian float32 values. Every frame is an independent data set.
+//
+
+#ifndef MEANSHIFT_IO_H
+#define MEANSHIFT_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define MS_FRAME_MAGIC (0x3146534DU)   // "MSF1" in a little endian file
+#define MS_RESULT_MAGIC (0x3152534DU)  // "MSR1" in a little endian file
+#define MS_RESULT_VERSION (3)
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Header of a frame of the stream, little endian
+//
+typedef struct
+{
+    uint32_t magic;  // MS_FRAME_MAGIC
+    uint32_t dims;   // dimension of the points
+    uint64_t count;  // number of points following the header, 0 ends the stream
+} ms_frame_header;
+
+// Header of a result file, little endian
+//
+typedef struct
+{
+    uint32_t magic;          // MS_RESULT_MAGIC
+    uint32_t version;        // MS_RESULT_VERSION
+    uint32_t dims;           // dimension of the points and modes
+    float bandwidth;         // bandwidth of the run, 0 when it used per-dimension bandwidths or a matrix
+    uint64_t count;             // number of points, labels and distances
+    uint64_t num_seeds;         // number of shifted seeds
+    uint64_t num_modes;         // number of modes, 0 until the points are labelled
+    uint64_t points_offset;     // byte offset of the shifted seeds
+    uint64_t labels_offset;     // byte offset of the labels
+    uint64_t distances_offset;  // byte offset of the distances
+    uint64_t modes_offset;      // byte offset of the modes
+    uint64_t matrix_offset;     // byte offset of the bandwidth matrix
+} ms_result_header;
+
+// Sections of a mapped result file
+//
+typedef struct
+{
+    ms_result_header *header;  // start of the mapping
+    float *points;             // shifted seeds, written by the device, room for one per point
+    uint32_t *labels;          // mode of every point
+    float *distances;          // distance of every point to its mode
+    float *matrix;             // bandwidth matrix of the run
+    float *modes;              // modes, room for one per point until the file is closed
+    size_t size;               // size of the mapping
+    int fd;                    // descriptor of the file
+} ms_result_file;
+
+// Points of a mapped file
+//
+typedef struct
+{
+    const float *data;  // first coordinate of the first point, within the mapping or the buffer
+    size_t count;       // number of points
+    size_t dims;        // dimension of the points
+    void *mapping;      // start of the mapping of the whole file, binary files only
+    float *buffer;      // parsed points of text files, page aligned
+    size_t size;        // size of the mapping or of the buffer, a whole number of pages for the buffer
+} ms_points_file;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Map a point file, the format is detected from the .csv or .txt extension, then from the .npy magic string. `dims`
+// is the dimension of the points of raw files; text files take it from their first line. Returns 0, or -1 and prints
+// the reason of a failure.
+//
+int ms_points_open(ms_points_file *file, const char *path, size_t dims);
+void ms_points_close(ms_points_file *file);
+
+// Create a result file for `count` points of dimension `dims` and map it. The file is sized for one seed and one mode
+// per point, which costs no disk space until they are written. Returns 0, or -1 and prints the reason of a failure.
+//
+int ms_result_create(ms_result_file *file, const char *path, size_t count, size_t dims, float bandwidth);
+
+// Record the bandwidth of the run, either a single `bandwidth` whose matrix is its square on the diagonal, or the
+// `dims * dims` bandwidth `matrix` when it is not NULL.
+//
+void ms_result_set_bandwidth(ms_result_file *file, float bandwidth, const float *matrix);
+
+// Record the number of seeds and modes, then unmap the result file trimmed to the modes actually found. Returns 0,
+// or -1 when the file cannot be written.
+//
+int ms_result_close(ms_result_file *file, size_t num_seeds, size_t num_modes);
+
+// Merge `count` shifted points into modes, every point joining the first mode closer than `radius` or starting a new
+// one, and label the points with the index of their mode unless `labels` is NULL. `modes` must have room for `count`
+// modes. Returns the number of modes.
+//
+size_t ms_merge_modes(const float *shifted, size_t count, size_t dims, float radius, float *modes, uint32_t *labels);
+
+// Read the next frame of a stream into `*points`, a page aligned buffer of `*capacity` bytes which grows as needed
+// and is released with free(). Returns 1 when a frame was read, 0 at the end of the stream and -1 on a malformed or
+// truncated frame.
+//
+int ms_stream_read(FILE *stream, ms_frame_header *header, float **points, size_t *capacity);
+
+// Write a frame and flush it, so that the consumer gets the points as soon as they are shifted. Returns 0 or -1.
+//
+int ms_stream_write(FILE *stream, const float *points, size_t count, size_t dims);
+
+#endif  // MEANSHIFT_IO_H
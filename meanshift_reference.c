@@ -0,0 +1,396 @@
+///
+/// @file       meanshift_reference.c
+///
+
+#include "meanshift_reference.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+void ms_reference_shift(const float *seeds, size_t num_seeds, const float *points, size_t count, size_t dims,
+                        float bandwidth, const float *bandwidths, int iterations, int blurring, double *shifted)
+{
+    size_t i, j, k;
+    int it;
+    double *point = malloc(sizeof(double) * dims);
+    double *shift = malloc(sizeof(double) * dims);
+    double *previous = blurring ? malloc(sizeof(double) * count * dims) : NULL;  // points of the previous iteration
+
+    for (i = 0; i < num_seeds * dims; i++)
+    {
+        shifted[i] = seeds[i];
+    }
+    for (i = 0; previous && i < count * dims; i++)
+    {
+        previous[i] = points[i];
+    }
+
+    // Gaussian weights of every original point, the constant factor of the kernel cancels out in the ratio; with
+    // per-point bandwidths the weight of a point also scales with the inverse of its bandwidth to the power of the
+    // dimension plus two, as in the sample point estimator of the adaptive kernel. Each seed only depends on its own
+    // previous position, so it is shifted in place. When blurring, the points are their own seeds and are shifted
+    // against their positions of the previous iteration instead.
+    //
+    for (it = 0; it < iterations && point && shift && (previous || !blurring); it++)
+    {
+        if (previous && it)
+        {
+            memcpy(previous, shifted, sizeof(double) * count * dims);
+        }
+        for (i = 0; i < num_seeds; i++)
+        {
+            double scale = 0.0;
+            for (k = 0; k < dims; k++)
+            {
+                point[k] = shifted[i * dims + k];
+                shift[k] = 0.0;
+            }
+
+            for (j = 0; j < count; j++)
+            {
+                double dist2 = 0.0;
+                double weight;
+                for (k = 0; k < dims; k++)
+                {
+                    double diff = point[k] - (previous ? previous[j * dims + k] : points[j * dims + k]);
+                    dist2 += diff * diff;
+                }
+                if (bandwidths)
+                {
+                    double h = bandwidths[j];
+                    weight = exp(-0.5 * dist2 / (h * h)) * pow(h, -(double)(dims + 2));
+                }
+                else
+                {
+                    weight = exp(-0.5 * dist2 / ((double)bandwidth * bandwidth));
+                }
+
+                for (k = 0; k < dims; k++)
+                {
+                    shift[k] += (previous ? previous[j * dims + k] : points[j * dims + k]) * weight;
+                }
+                scale += weight;
+            }
+
+            for (k = 0; k < dims; k++)
+            {
+                shifted[i * dims + k] = shift[k] / scale;
+            }
+        }
+    }
+
+    free(point);
+    free(shift);
+    free(previous);
+}
+
+size_t ms_extract_modes(const double *shifted, size_t count, size_t dims, double radius, double *modes,
+                        size_t max_modes)
+{
+    size_t num_modes = 0;
+    size_t i, m, k;
+
+    for (i = 0; i < count; i++)
+    {
+        for (m = 0; m < num_modes && m < max_modes; m++)
+        {
+            double dist2 = 0.0;
+            for (k = 0; k < dims; k++)
+            {
+                double diff = shifted[i * dims + k] - modes[m * dims + k];
+                dist2 += diff * diff;
+            }
+            if (dist2 < radius * radius)
+            {
+                break;
+            }
+        }
+
+        if (m == num_modes)
+        {
+            if (num_modes < max_modes)
+            {
+                memcpy(&modes[num_modes * dims], &shifted[i * dims], sizeof(double) * dims);
+            }
+            num_modes++;
+        }
+    }
+    return num_modes;
+}
+
+// Compare the shifted seeds with the reference ones, coordinate by coordinate within `check->tolerance` and by the
+// modes they converge to
+//
+static int compare_shift(const double *reference, const float *shifted, size_t num_seeds, size_t dims,
+                         float bandwidth, ms_check *check)
+{
+    size_t i, j, k;
+    double sum_error = 0.0;
+    double radius = MS_MODE_RADIUS * bandwidth;
+    size_t max_modes;
+
+    double *results = malloc(sizeof(double) * num_seeds * dims);  // kernel shifted seeds, in double
+    double *reference_modes = malloc(sizeof(double) * num_seeds * dims);
+    double *modes = malloc(sizeof(double) * num_seeds * dims);
+
+    if (num_seeds && (!results || !reference_modes || !modes))
+    {
+        free(results);
+        free(reference_modes);
+        free(modes);
+        return -1;
+    }
+
+    // Errors of the shifted seeds
+    //
+    for (i = 0; i < num_seeds; i++)
+    {
+        int valid = 1;
+        for (k = 0; k < dims; k++)
+        {
+            double error = fabs(shifted[i * dims + k] - reference[i * dims + k]);
+            results[i * dims + k] = shifted[i * dims + k];
+            check->max_error = error > check->max_error || error != error ? error : check->max_error;
+            sum_error += error;
+            valid &= error <= check->tolerance;
+        }
+        check->correct += valid;
+    }
+    check->mean_error = num_seeds ? sum_error / (num_seeds * dims) : 0.0;
+
+    // Errors of the modes, every mode of the reference has to be close to a mode of the results
+    //
+    max_modes = num_seeds;
+    check->reference_modes = ms_extract_modes(reference, num_seeds, dims, radius, reference_modes, max_modes);
+    check->num_modes = ms_extract_modes(results, num_seeds, dims, radius, modes, max_modes);
+    for (i = 0; i < check->reference_modes; i++)
+    {
+        double nearest = INFINITY;
+        for (j = 0; j < check->num_modes; j++)
+        {
+            double dist2 = 0.0;
+            for (k = 0; k < dims; k++)
+            {
+                double diff = reference_modes[i * dims + k] - modes[j * dims + k];
+                dist2 += diff * diff;
+            }
+            nearest = dist2 < nearest ? dist2 : nearest;
+        }
+        nearest = sqrt(nearest);
+        check->mode_error = nearest > check->mode_error ? nearest : check->mode_error;
+    }
+
+    check->passed = check->correct == num_seeds && check->num_modes == check->reference_modes &&
+                    check->mode_error <= MS_MODE_TOLERANCE * bandwidth;
+
+    free(results);
+    free(reference_modes);
+    free(modes);
+    return 0;
+}
+
+int ms_check_shift(const float *seeds, size_t num_seeds, const float *points, size_t count, const float *shifted,
+                   size_t dims, float bandwidth, const float *bandwidths, int iterations, int blurring,
+                   ms_check *check)
+{
+    size_t i, k;
+    double extent = 1.0;
+    int status;
+    double *reference = malloc(sizeof(double) * num_seeds * dims);  // reference shifted seeds
+
+    memset(check, 0, sizeof(*check));
+    if (num_seeds && !reference)
+    {
+        return -1;
+    }
+
+    // The tolerance scales with the extent of the data set, as float rounding errors grow with the coordinates
+    //
+    for (k = 0; k < dims && count; k++)
+    {
+        double low = points[k];
+        double high = points[k];
+        for (i = 1; i < count; i++)
+        {
+            low = points[i * dims + k] < low ? points[i * dims + k] : low;
+            high = points[i * dims + k] > high ? points[i * dims + k] : high;
+        }
+        extent = high - low > extent ? high - low : extent;
+    }
+    check->tolerance = MS_CHECK_TOLERANCE * extent;
+
+    ms_reference_shift(seeds, num_seeds, points, count, dims, bandwidth, bandwidths, iterations, blurring, reference);
+    status = compare_shift(reference, shifted, num_seeds, dims, bandwidth, check);
+    free(reference);
+    return status;
+}
+
+int ms_check_modes(const float *shifted, const float *expected, size_t num_seeds, size_t dims, float bandwidth,
+                   ms_check *check)
+{
+    size_t i;
+    int status;
+    double *reference = malloc(sizeof(double) * num_seeds * dims);  // plain shifted seeds, in double
+
+    memset(check, 0, sizeof(*check));
+    if (num_seeds && !reference)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < num_seeds * dims; i++)
+    {
+        reference[i] = expected[i];
+    }
+    check->tolerance = MS_MODE_TOLERANCE * bandwidth;
+    status = compare_shift(reference, shifted, num_seeds, dims, bandwidth, check);
+    free(reference);
+    return status;
+}
+
+void ms_reference_quick_shift(const float *points, size_t count, size_t dims, float bandwidth, float max_distance,
+                              double *densities, size_t *parents)
+{
+    size_t i, j, k;
+    double base_weight = 1.0 / (bandwidth * sqrt(2.0 * 3.14));  // same approximation of pi as the kernel
+
+    for (i = 0; i < count; i++)
+    {
+        double scale = 0.0;
+        for (j = 0; j < count; j++)
+        {
+            double dist2 = 0.0;
+            for (k = 0; k < dims; k++)
+            {
+                double diff = (double)points[i * dims + k] - points[j * dims + k];
+                dist2 += diff * diff;
+            }
+            scale += base_weight * exp(-0.5 * dist2 / ((double)bandwidth * bandwidth));
+        }
+        densities[i] = count ? scale / count : 0.0;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        double best = (double)max_distance * max_distance;
+        parents[i] = i;
+        for (j = 0; j < count; j++)
+        {
+            double dist2 = 0.0;
+            if (densities[j] < densities[i] || (densities[j] == densities[i] && j <= i))
+            {
+                continue;
+            }
+            for (k = 0; k < dims; k++)
+            {
+                double diff = (double)points[i * dims + k] - points[j * dims + k];
+                dist2 += diff * diff;
+            }
+            if (dist2 < best)
+            {
+                best = dist2;
+                parents[i] = j;
+            }
+        }
+    }
+}
+
+// Root of the tree of point `i`, walking at most `count` links so that a malformed forest cannot loop
+//
+static size_t find_root(const size_t *parents, size_t count, size_t i)
+{
+    size_t steps;
+    for (steps = 0; steps < count && parents[i] != i && parents[i] < count; steps++)
+    {
+        i = parents[i];
+    }
+    return i;
+}
+
+int ms_check_quick_shift(const float *points, size_t count, size_t dims, float bandwidth, float max_distance,
+                         const float *densities, const uint32_t *parents, ms_check *check)
+{
+    size_t i, j, k;
+    double sum_error = 0.0;
+    double radius = MS_MODE_TOLERANCE * bandwidth;
+
+    double *reference = malloc(sizeof(double) * count);        // reference densities
+    size_t *reference_parents = malloc(sizeof(size_t) * count);
+    size_t *forest = malloc(sizeof(size_t) * count);           // kernel parents, widened
+
+    memset(check, 0, sizeof(*check));
+    if (count && (!reference || !reference_parents || !forest))
+    {
+        free(reference);
+        free(reference_parents);
+        free(forest);
+        return -1;
+    }
+
+    ms_reference_quick_shift(points, count, dims, bandwidth, max_distance, reference, reference_parents);
+    check->tolerance = MS_CHECK_TOLERANCE;
+    for (i = 0; i < count; i++)
+    {
+        forest[i] = parents[i];
+        check->num_modes += forest[i] == i;
+        check->reference_modes += reference_parents[i] == i;
+    }
+
+    // Relative errors of the densities, and distance between the roots each point reaches
+    //
+    for (i = 0; i < count; i++)
+    {
+        size_t root = find_root(forest, count, i);
+        size_t reference_root = find_root(reference_parents, count, i);
+        double error = reference[i] > 0.0 ? fabs(densities[i] - reference[i]) / reference[i] : fabs(densities[i]);
+        double dist2 = 0.0;
+
+        for (k = 0; k < dims; k++)
+        {
+            double diff = (double)points[root * dims + k] - points[reference_root * dims + k];
+            dist2 += diff * diff;
+        }
+        check->max_error = error > check->max_error || error != error ? error : check->max_error;
+        sum_error += error;
+        check->correct += error <= check->tolerance && dist2 <= radius * radius;
+    }
+    check->mean_error = count ? sum_error / count : 0.0;
+
+    // Every root of the reference has to be close to a root of the kernel forest
+    //
+    for (i = 0; i < count; i++)
+    {
+        double nearest = INFINITY;
+        if (reference_parents[i] != i)
+        {
+            continue;
+        }
+        for (j = 0; j < count; j++)
+        {
+            double dist2 = 0.0;
+            if (forest[j] != j)
+            {
+                continue;
+            }
+            for (k = 0; k < dims; k++)
+            {
+                double diff = (double)points[i * dims + k] - points[j * dims + k];
+                dist2 += diff * diff;
+            }
+            nearest = dist2 < nearest ? dist2 : nearest;
+        }
+        nearest = sqrt(nearest);
+        check->mode_error = nearest > check->mode_error ? nearest : check->mode_error;
+    }
+
+    check->passed = check->correct == count && check->num_modes == check->reference_modes &&
+                    check->mode_error <= radius;
+
+    free(reference);
+    free(reference_parents);
+    free(forest);
+    return 0;
+}
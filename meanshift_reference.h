@@ -0,0 +1,84 @@
+///
+/// @file       meanshift_reference.h
+///
+
+// Double precision host implementation of the mean shift and of the quick shift, used to check the results of the
+// kernels. It runs the same iterations as the engine, shifting the output of each iteration against the original
+// points. The seeds are the points themselves, unless the engine was given a separate seed set. Blurring runs shift
+// the points against their own positions of the previous iteration instead.
+//
+
+#ifndef MEANSHIFT_REFERENCE_H
+#define MEANSHIFT_REFERENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Largest error accepted on a coordinate of a shifted point, relative to the extent of the data set, and on a mode,
+// relative to the bandwidth. Points closer than half the bandwidth are merged into one mode.
+//
+#define MS_CHECK_TOLERANCE (1e-4)
+#define MS_MODE_TOLERANCE (0.1)
+#define MS_MODE_RADIUS (0.5)
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Outcome of the check of one run against the reference
+//
+typedef struct
+{
+    double max_error;        // largest absolute error of a coordinate of the shifted points
+    double mean_error;       // mean absolute error of the coordinates of the shifted points
+    double tolerance;        // absolute tolerance of a coordinate
+    size_t correct;          // seeds with every coordinate within the tolerance
+    size_t num_modes;        // modes of the shifted points
+    size_t reference_modes;  // modes of the reference
+    double mode_error;       // largest distance of a reference mode to the closest mode of the shifted points
+    int passed;              // every seed is correct and the modes match
+} ms_check;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Shift `num_seeds` seeds of dimension `dims` `iterations` times against `count` points, the results are written to
+// `shifted`. With `blurring` the seeds must be the points, which every iteration replaces with their shifted positions.
+// Unless `bandwidths` is NULL every point has its own bandwidth, as in the adaptive kernel, instead of `bandwidth`.
+//
+void ms_reference_shift(const float *seeds, size_t num_seeds, const float *points, size_t count, size_t dims,
+                        float bandwidth, const float *bandwidths, int iterations, int blurring, double *shifted);
+
+// Merge the shifted points into modes: every point joins the first mode closer than `radius`, or starts a new one.
+// Writes at most `max_modes` modes and returns the number of modes found.
+//
+size_t ms_extract_modes(const double *shifted, size_t count, size_t dims, double radius, double *modes,
+                        size_t max_modes);
+
+// Compare the seeds shifted by the kernel with the reference, and the modes they converge to. Returns -1 when the
+// host runs out of memory, 0 otherwise, with the outcome in `check`.
+//
+int ms_check_shift(const float *seeds, size_t num_seeds, const float *points, size_t count, const float *shifted,
+                   size_t dims, float bandwidth, const float *bandwidths, int iterations, int blurring,
+                   ms_check *check);
+
+// Compare seeds shifted until they converged with an accelerated update rule to the same seeds shifted until they
+// converged with plain mean shift, which end at different distances from the modes: every seed has to be within the
+// mode tolerance of its plain position, and the modes have to match. Returns -1 when the host runs out of memory.
+//
+int ms_check_modes(const float *shifted, const float *expected, size_t num_seeds, size_t dims, float bandwidth,
+                   ms_check *check);
+
+// Quick shift of `count` points with the same densities and links as ms_engine_quick_shift(), a point being its own
+// parent when it is a root
+//
+void ms_reference_quick_shift(const float *points, size_t count, size_t dims, float bandwidth, float max_distance,
+                              double *densities, size_t *parents);
+
+// Compare the densities and the forest of a quick shift with the reference. The errors are relative to the reference
+// densities; a point is correct when its density is within the tolerance and the root it reaches is within the mode
+// tolerance of its reference root, and the modes are the roots. Returns -1 when the host runs out of memory.
+//
+int ms_check_quick_shift(const float *points, size_t count, size_t dims, float bandwidth, float max_distance,
+                         const float *densities, const uint32_t *parents, ms_check *check);
+
+#endif  // MEANSHIFT_REFERENCE_H